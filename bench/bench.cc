@@ -0,0 +1,713 @@
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "async_io.hpp"
+#include "augmentations.hpp"
+#include "data_loader.hpp"
+#include "image_cache.hpp"
+#include "image_header.hpp"
+#include "noise.hpp"
+#include "op_stats.hpp"
+#include "packed_dataset.hpp"
+#include "pipeline.hpp"
+#include "ppm.hpp"
+#include "random_rotation_utilities.hpp"
+#include "synthetic_dataset.hpp"
+#include "tar_shards.hpp"
+#include "tensor.hpp"
+#include "tracer.hpp"
+
+using namespace std;
+using namespace cv;
+
+/*
+HELPERS
+*/
+
+// Median wall-clock milliseconds of fn over iterations runs, after a warm-up
+// run. The median keeps a few runs slowed down by the rest of the system from
+// moving the result, which the baseline comparison relies on.
+double TimeMs(const std::function<void()>& fn, int iterations) {
+  fn();  // warm up
+  std::vector<double> ms(std::max(1, iterations));
+  for (double& run : ms) {
+    int64 start = getTickCount();
+    fn();
+    run = (getTickCount() - start) * 1000.0 / getTickFrequency();
+  }
+  std::nth_element(ms.begin(), ms.begin() + ms.size() / 2, ms.end());
+  return ms[ms.size() / 2];
+}
+
+struct BenchResult {
+  std::string name;
+  double ms = 0;
+  // 0 for benchmarks that are not measured in pixels
+  double mpix_per_s = 0;
+  double gb_per_s = 0;
+};
+
+// Every result reported by this run, in order, for --json.
+std::vector<BenchResult> results;
+
+void Report(const std::string& name, double ms) {
+  cout << name << ": " << ms << " ms" << endl;
+  BenchResult result;
+  result.name = name;
+  result.ms = ms;
+  results.push_back(result);
+}
+
+// Reports a benchmark that processed pixels pixels and read and wrote bytes
+// bytes in ms milliseconds.
+void ReportThroughput(const std::string& name,
+                      double ms,
+                      double pixels,
+                      double bytes) {
+  BenchResult result;
+  result.name = name;
+  result.ms = ms;
+  result.mpix_per_s = pixels / ms / 1e3;
+  result.gb_per_s = bytes / ms / 1e6;
+  cout << name << ": " << ms << " ms, " << result.mpix_per_s << " MPix/s, "
+       << result.gb_per_s << " GB/s" << endl;
+  results.push_back(result);
+}
+
+// Writes the results as JSON, one benchmark per line.
+void WriteJson(const std::string& path) {
+  std::ofstream out(path, std::ios::trunc);
+  out << "{\"benchmarks\":[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    std::string name;
+    AppendJsonString(name, results[i].name);
+    char numbers[128];
+    snprintf(numbers,
+             sizeof(numbers),
+             ",\"ms\":%.6f,\"mpix_per_s\":%.3f,\"gb_per_s\":%.3f}",
+             results[i].ms,
+             results[i].mpix_per_s,
+             results[i].gb_per_s);
+    out << (i == 0 ? "\n" : ",\n") << "{\"name\":" << name << numbers;
+  }
+  out << "\n]}\n";
+}
+
+// Reads the milliseconds of every benchmark of a file written by WriteJson.
+std::map<std::string, double> ReadJson(const std::string& path) {
+  std::map<std::string, double> ms;
+  std::ifstream in(path);
+  if (!in) {
+    throw std::runtime_error("Cannot read baseline " + path);
+  }
+  std::string line;
+  const std::string name_key = "{\"name\":\"";
+  const std::string ms_key = "\"ms\":";
+  while (std::getline(in, line)) {
+    size_t name = line.find(name_key);
+    size_t time = line.find(ms_key);
+    if (name == std::string::npos || time == std::string::npos) {
+      continue;
+    }
+    name += name_key.size();
+    ms[line.substr(name, line.find('"', name) - name)] =
+        strtod(line.c_str() + time + ms_key.size(), nullptr);
+  }
+  return ms;
+}
+
+/*
+  CompareToBaseline
+
+  Prints how much faster or slower every benchmark ran than in a baseline
+  written by an earlier --json run.
+
+  @param const std::string& path -> the baseline JSON
+  @param const std::map<std::string, double>& baseline -> its times, read by
+  ReadJson
+  @param double threshold -> relative slowdown counted as a regression
+
+  @return int -> the number of regressions
+*/
+int CompareToBaseline(const std::string& path,
+                      const std::map<std::string, double>& baseline,
+                      double threshold) {
+  int regressions = 0;
+  cout << endl << "Compared to " << path << ":" << endl;
+  for (const BenchResult& result : results) {
+    auto it = baseline.find(result.name);
+    if (it == baseline.end() || it->second <= 0) {
+      cout << result.name << ": new" << endl;
+      continue;
+    }
+    double ratio = result.ms / it->second;
+    bool regressed = ratio > 1 + threshold;
+    regressions += regressed;
+    cout << result.name << ": " << ratio << "x the baseline time"
+         << (regressed ? "  REGRESSION" : "") << endl;
+  }
+  return regressions;
+}
+
+// The original CreateMap, kept to show the cost of one Mat product per pixel.
+void PerPixelCreateMap(const Size& src_size,
+                       const Rect_<double>& dst_rect,
+                       const Mat& transMat,
+                       Mat& map_x,
+                       Mat& map_y) {
+  map_x.create(dst_rect.size(), CV_32FC1);
+  map_y.create(dst_rect.size(), CV_32FC1);
+  double Z = transMat.at<double>(2, 3);
+  Mat invTransMat = transMat.inv();
+  Mat dst_pos(3, 1, CV_64FC1);
+  dst_pos.at<double>(2, 0) = Z;
+  for (int dy = 0; dy < map_x.rows; dy++) {
+    dst_pos.at<double>(1, 0) = dst_rect.y + dy;
+    for (int dx = 0; dx < map_x.cols; dx++) {
+      dst_pos.at<double>(0, 0) = dst_rect.x + dx;
+      Mat rMat = -invTransMat(Rect(3, 2, 1, 1)) /
+                 (invTransMat(Rect(0, 2, 3, 1)) * dst_pos);
+      Mat src_pos = invTransMat(Rect(0, 0, 3, 2)) * dst_pos * rMat +
+                    invTransMat(Rect(3, 0, 1, 2));
+      map_x.at<float>(dy, dx) =
+          src_pos.at<double>(0, 0) + (float)src_size.width / 2;
+      map_y.at<float>(dy, dx) =
+          src_pos.at<double>(1, 0) + (float)src_size.height / 2;
+    }
+  }
+}
+
+/*
+BENCHMARKS
+*/
+
+void BenchRotation() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+
+  Mat rot_3x4;
+  composeExternalMatrix(10, 10, 10, 0, 0, 1000, rot_3x4);
+  Mat rot = Mat::eye(4, 4, CV_64FC1);
+  rot_3x4.copyTo(rot(Rect(0, 0, 4, 3)));
+  Rect_<double> dst_rect(0, 0, src.cols, src.rows);
+
+  Mat map_x, map_y;
+  Report("rotation/map/per_pixel_mat/1080p",
+         TimeMs([&] { PerPixelCreateMap(src.size(), dst_rect, rot, map_x, map_y); },
+                3));
+  Report("rotation/map/homography/1080p",
+         TimeMs([&] { CreateMap(src.size(), dst_rect, rot, map_x, map_y); }, 20));
+
+  Mat dst;
+  Report("rotation/RotateImage/1080p",
+         TimeMs([&] { RotateImage(src, dst, 10, 10, 10); }, 20));
+}
+
+void BenchFlips() {
+  int types[] = {CV_8UC1, CV_8UC3, CV_32FC3};
+  const char* names[] = {"8UC1", "8UC3", "32FC3"};
+  for (int t = 0; t < 3; ++t) {
+    Mat src(1080, 1920, types[t]);
+    randu(src, Scalar::all(0), Scalar::all(255));
+    Mat dst;
+    std::string suffix = std::string("/1080p/") + names[t];
+
+    Report("flip/HorizontalFlip" + suffix,
+           TimeMs([&] { dst = HorizontalFlip(src); }, 50));
+    Report("flip/HorizontalFlipInPlace" + suffix,
+           TimeMs([&] { HorizontalFlipInPlace(src); }, 50));
+    Report("flip/cv::flip(1)" + suffix,
+           TimeMs([&] { flip(src, dst, 1); }, 50));
+    Report("flip/VerticalFlip" + suffix,
+           TimeMs([&] { dst = VerticalFlip(src); }, 50));
+    Report("flip/VerticalFlipInPlace" + suffix,
+           TimeMs([&] { VerticalFlipInPlace(src); }, 50));
+    Report("flip/cv::flip(0)" + suffix,
+           TimeMs([&] { flip(src, dst, 0); }, 50));
+  }
+}
+
+void BenchDeform() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  RNG rng;
+  Mat dst;
+  Report("deform/RandomDeform/1080p/8UC3", TimeMs([&] {
+           RandomDeform(src,
+                        dst,
+                        {0.01, 0.05},
+                        {0.01, 0.05},
+                        {0.2, 0.4},
+                        {0.2, 0.4},
+                        rng);
+         }, 50));
+}
+
+void BenchBlur() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  Mat dst;
+  int sizes[] = {3, 9, 21};
+  for (int k : sizes) {
+    std::string suffix = "/" + std::to_string(k) + "x" + std::to_string(k) +
+                         "/1080p/8UC3";
+    Mat box = Mat::ones(k, k, CV_32F) / (float)(k * k);
+    Report("blur/filter2D/box" + suffix, TimeMs([&] {
+             filter2D(src, dst, -1, box, Point(-1, -1), 0, BORDER_DEFAULT);
+           }, 10));
+    Report("blur/Blur/box" + suffix,
+           TimeMs([&] { dst = Blur(src, box); }, 10));
+
+    Mat g = getGaussianKernel(k, k / 6.0, CV_32F);
+    Mat gaussian = g * g.t();
+    Report("blur/filter2D/gaussian" + suffix, TimeMs([&] {
+             filter2D(src, dst, -1, gaussian, Point(-1, -1), 0, BORDER_DEFAULT);
+           }, 10));
+    Report("blur/Blur/gaussian" + suffix,
+           TimeMs([&] { dst = Blur(src, gaussian); }, 10));
+  }
+}
+
+void BenchNoise() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  Mat dst;
+  RNG rng(4);
+  Report("noise/RandomNoise/1080p/8UC3", TimeMs([&] {
+           RandomNoise(src, dst, {0, 0, 0}, {10, 10, 10}, rng);
+         }, 10));
+  std::unique_ptr<NoiseBank> bank;
+  Report("noise/NoiseBank_build/4x512x512", TimeMs([&] {
+           bank.reset(new NoiseBank({0, 0, 0}, {10, 10, 10}, 3));
+         }, 10));
+  Report("noise/RandomNoise_NoiseBank/1080p/8UC3",
+         TimeMs([&] { RandomNoise(src, dst, *bank, rng); }, 50));
+}
+
+void BenchPipeline() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  RNG rng;
+
+  std::vector<std::function<Mat(const Mat&)>> augmentations = {
+      [&rng](const Mat& img) { return RandomHorizontalFlip(img, 0.5, rng); },
+      [&rng](const Mat& img) { return RandomVerticalFlip(img, 0.5, rng); },
+      [&rng](const Mat& img) { return RandomSlide(img, 0.5, rng); }};
+  Report("pipeline/std::function/flip_flip_slide/1080p", TimeMs([&] {
+           Mat img = src;
+           for (auto aug : augmentations) {
+             img = aug(img);
+           }
+         }, 50));
+
+  Pipeline pipeline(HorizontalFlipOp{0.5}, VerticalFlipOp{0.5}, SlideOp{0.5});
+  Mat dst, scratch;
+  Report("pipeline/Pipeline/flip_flip_slide/1080p",
+         TimeMs([&] { pipeline(src, dst, scratch, rng); }, 50));
+}
+
+void BenchTensor() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  TensorOptions options;
+  options.mean = {0.485, 0.456, 0.406};
+  options.std_dev = {0.229, 0.224, 0.225};
+  std::vector<uchar> tensor(TensorImageBytes(options));
+
+  Mat resized, rgb, normalized;
+  std::vector<Mat> planes;
+  Report("tensor/resize_cvtColor_convertTo_split/1080p", TimeMs([&] {
+           resize(src, resized, options.size, 0, 0, INTER_LINEAR);
+           cvtColor(resized, rgb, COLOR_BGR2RGB);
+           rgb.convertTo(normalized, CV_32F, options.scale);
+           normalized -= Scalar(0.485, 0.456, 0.406);
+           divide(normalized, Scalar(0.229, 0.224, 0.225), normalized);
+           split(normalized, planes);
+           float* out = (float*)tensor.data();
+           for (const Mat& plane : planes) {
+             plane.copyTo(Mat(options.size, CV_32F, out));
+             out += options.size.area();
+           }
+         }, 50));
+  Report("tensor/PackTensor/1080p",
+         TimeMs([&] { PackTensor(src, options, tensor.data()); }, 50));
+}
+
+void BenchImageCache() {
+  // A smooth synthetic photo; random pixels would not compress at all.
+  Mat src(1080, 1920, CV_8UC3);
+  for (int i = 0; i < src.rows; ++i) {
+    for (int j = 0; j < src.cols; ++j) {
+      src.at<Vec3b>(i, j) = Vec3b(i / 5, j / 8, (i + j) / 12);
+    }
+  }
+  GaussianBlur(src, src, Size(5, 5), 2);
+  std::vector<uchar> jpeg;
+  imencode(".jpg", src, jpeg);
+  Mat dst;
+  Report("cache/imdecode/jpeg/1080p",
+         TimeMs([&] { dst = imdecode(jpeg, IMREAD_COLOR); }, 20));
+
+  CacheCompression compressions[] = {CacheCompression::kNone,
+                                     CacheCompression::kLz};
+  const char* names[] = {"raw", "lz"};
+  for (int i = 0; i < 2; ++i) {
+    ImageCache cache(64 << 20, compressions[i]);
+    Mat decoded = imdecode(jpeg, IMREAD_COLOR);
+    Report(std::string("cache/Put/") + names[i] + "/1080p",
+           TimeMs([&] { cache.Put("image", decoded); }, 20));
+    Report(std::string("cache/Get/") + names[i] + "/1080p",
+           TimeMs([&] { cache.Get("image", dst); }, 20));
+    ImageCacheStats stats = cache.GetStats();
+    cout << "cache/" << names[i] << "/ratio: "
+         << (double)stats.image_bytes / stats.bytes << endl;
+  }
+}
+
+void BenchPackedDataset() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  GaussianBlur(src, src, Size(9, 9), 3);
+  std::string png_path = "/tmp/bench_packed.png";
+  std::string pack_path = "/tmp/bench_packed.pack";
+  imwrite(png_path, src);
+  {
+    PackedDatasetWriter writer(pack_path);
+    writer.Add("bench_packed.png", src);
+    writer.Finish();
+  }
+  PackedDataset packed(pack_path);
+  Mat dst;
+  Report("packed/imread/png/1080p",
+         TimeMs([&] { dst = imread(png_path); }, 10));
+  // sum the pixels so the mapped pages are actually read
+  Report("packed/PackedDataset/1080p",
+         TimeMs([&] { sum(packed.Image(0)); }, 10));
+  std::remove(png_path.c_str());
+  std::remove(pack_path.c_str());
+}
+
+void BenchTarShards() {
+  Mat src(256, 256, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  GaussianBlur(src, src, Size(9, 9), 3);
+  std::vector<uchar> jpeg;
+  imencode(".jpg", src, jpeg);
+
+  const int count = 500;
+  std::string dir = "/tmp/bench_tar_shards";
+  boost::filesystem::create_directories(dir);
+  std::vector<std::string> files;
+  TarShardWriter writer(dir + "/shard", 64 << 20);
+  for (int i = 0; i < count; ++i) {
+    std::string name = std::to_string(i) + ".jpg";
+    files.push_back(dir + "/" + name);
+    std::ofstream(files.back(), std::ios::binary)
+        .write((const char*)jpeg.data(), jpeg.size());
+    writer.Add(name, jpeg.data(), jpeg.size());
+  }
+  writer.Close();
+
+  Report("tar/imread/500_files", TimeMs([&] {
+           for (const std::string& file : files) {
+             imread(file);
+           }
+         }, 5));
+  AsyncFileIO io;
+  Report(std::string("tar/AsyncFileIO_imdecode/500_files/") +
+             (io.UsesIoUring() ? "io_uring" : "threads"),
+         TimeMs([&] {
+           io.ReadFiles(files, [](size_t, std::vector<uint8_t>& data) {
+             imdecode(data, IMREAD_COLOR);
+             return true;
+           });
+         }, 5));
+  TarShards shards(writer.ShardPaths());
+  std::vector<size_t> members(shards.Size());
+  std::iota(members.begin(), members.end(), 0);
+  Report("tar/ReadSequential_imdecode/500_files", TimeMs([&] {
+           shards.ReadSequential(
+               members, [](size_t, std::vector<uint8_t>& data) {
+                 imdecode(data, IMREAD_COLOR);
+                 return true;
+               });
+         }, 5));
+  boost::filesystem::remove_all(dir);
+}
+
+void BenchReducedDecode() {
+  Mat src(3000, 4000, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  GaussianBlur(src, src, Size(9, 9), 3);
+  std::vector<uchar> jpeg;
+  imencode(".jpg", src, jpeg);
+
+  Report("decode/imdecode_full/4000x3000", TimeMs([&] {
+           imdecode(jpeg, IMREAD_COLOR);
+         }, 5));
+  Report("decode/imdecode_reduced_to_224/4000x3000", TimeMs([&] {
+           ImageHeader probed;
+           ProbeImageHeader(jpeg.data(), jpeg.size(), probed);
+           imdecode(jpeg, ReducedDecodeFlag(probed, Size(224, 224)));
+         }, 5));
+}
+
+void BenchPpm() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  std::vector<uchar> ascii, binary;
+  imencode(".ppm", src, ascii, {IMWRITE_PXM_BINARY, 0});
+  imencode(".ppm", src, binary, {IMWRITE_PXM_BINARY, 1});
+
+  Report("ppm/imdecode/P3/1080p",
+         TimeMs([&] { imdecode(ascii, IMREAD_COLOR); }, 5));
+  Report("ppm/DecodePpm/P3/1080p",
+         TimeMs([&] { DecodePpm(ascii.data(), ascii.size()); }, 5));
+  Report("ppm/imdecode/P6/1080p",
+         TimeMs([&] { imdecode(binary, IMREAD_COLOR); }, 20));
+  Report("ppm/DecodePpm/P6/1080p",
+         TimeMs([&] { DecodePpm(binary.data(), binary.size()); }, 20));
+  std::vector<uchar> encoded;
+  Report("ppm/imencode/P6/1080p",
+         TimeMs([&] { imencode(".ppm", src, encoded); }, 20));
+  Report("ppm/EncodePpm/P6/1080p",
+         TimeMs([&] { EncodePpm(src, encoded); }, 20));
+}
+
+void BenchStats() {
+  Mat src(1080, 1920, CV_8UC3);
+  randu(src, Scalar::all(0), Scalar::all(255));
+  OpStatsRecorder recorder;
+  Report("stats/HorizontalFlip/1080p",
+         TimeMs([&] { HorizontalFlip(src); }, 50));
+  Report("stats/HorizontalFlip_timed/1080p", TimeMs([&] {
+           OpTimer timer(&recorder);
+           Mat out = HorizontalFlip(src);
+           timer.Stop(src.total() * 3, out.total() * 3);
+         }, 50));
+  Report("stats/OpTimer_x1000", TimeMs([&] {
+           for (int i = 0; i < 1000; ++i) {
+             OpTimer timer(&recorder);
+             timer.Stop(0, 0);
+           }
+         }, 50));
+  Tracer tracer;
+  Report("stats/TraceSpan_x1000", TimeMs([&] {
+           for (int i = 0; i < 1000; ++i) {
+             TraceSpan span(&tracer, "bench", "span", i);
+           }
+         }, 50));
+}
+
+/*
+  BenchAugmentations
+
+  Runs every augmentation on 256x256, 1080p and 4K images of 8UC1, 8UC3 and
+  32FC3. Bytes count the input read and the output written.
+*/
+void BenchAugmentations() {
+  struct Shape {
+    const char* name;
+    Size size;
+    int iterations;
+  };
+  Shape shapes[] = {{"256x256", Size(256, 256), 200},
+                    {"1080p", Size(1920, 1080), 10},
+                    {"4K", Size(3840, 2160), 5}};
+  int types[] = {CV_8UC1, CV_8UC3, CV_32FC3};
+  const char* type_names[] = {"8UC1", "8UC3", "32FC3"};
+
+  Mat gaussian = getGaussianKernel(5, 1, CV_32F);
+  gaussian = gaussian * gaussian.t();
+  typedef std::function<Mat(const Mat&, RNG&)> Augmentation;
+  std::vector<std::pair<std::string, Augmentation>> augmentations = {
+      {"HorizontalFlip",
+       [](const Mat& img, RNG&) { return HorizontalFlip(img); }},
+      {"VerticalFlip", [](const Mat& img, RNG&) { return VerticalFlip(img); }},
+      {"Slide",
+       [](const Mat& img, RNG&) {
+         return Slide(img, img.cols / 10, img.rows / 10);
+       }},
+      {"RandomDeform",
+       [](const Mat& img, RNG& rng) {
+         return RandomDeform(
+             img, {0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4}, rng);
+       }},
+      {"Blur",
+       [&gaussian](const Mat& img, RNG&) { return Blur(img, gaussian); }},
+      {"RandomNoise",
+       [](const Mat& img, RNG& rng) {
+         return RandomNoise(img, {0, 0, 0, 0}, {10, 10, 10, 10}, rng);
+       }},
+      {"RandomRotateImage", [](const Mat& img, RNG& rng) {
+         return RandomRotateImage(img, 10, 10, 10, rng);
+       }}};
+
+  RNG rng(1);
+  for (const Shape& shape : shapes) {
+    for (int t = 0; t < 3; ++t) {
+      Mat src(shape.size, types[t]);
+      randu(src, Scalar::all(0), Scalar::all(255));
+      for (const auto& augmentation : augmentations) {
+        Mat dst;
+        double ms = TimeMs([&] { dst = augmentation.second(src, rng); },
+                           shape.iterations);
+        ReportThroughput("augmentation/" + augmentation.first + "/" +
+                             shape.name + "/" + type_names[t],
+                         ms,
+                         src.total(),
+                         src.total() * src.elemSize() +
+                             dst.total() * dst.elemSize());
+      }
+    }
+  }
+}
+
+/*
+  BenchDataLoader
+
+  Runs the DataLoader end to end on a generated dataset of 1080p JPEGs: the
+  serial and parallel AugmentAndSaveToDirectory, and an epoch of streaming
+  tensors, each the median of five runs. Throughput is in input pixels.
+*/
+void BenchDataLoader() {
+  const int count = 24;
+  const int runs = 5;
+  std::string input = "/tmp/bench_dataloader/input";
+  std::string output = "/tmp/bench_dataloader/output";
+  SyntheticDatasetOptions synthetic;
+  synthetic.count = count;
+  synthetic.seed = 3;
+  double pixels = count * 1920.0 * 1080.0;
+  double bytes = 0;
+  for (const std::string& file : GenerateSyntheticDataset(input, synthetic)) {
+    bytes += boost::filesystem::file_size(file);
+  }
+
+  DataLoader dataset(input);
+  dataset.SetSeed(3);
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomHorizontalFlip(img, 0.5, rng);
+  });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomSlide(img, 0.5, rng);
+  });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomNoise(img, {0, 0, 0}, {10, 10, 10}, rng);
+  });
+
+  ReportThroughput("dataloader/AugmentAndSaveToDirectory/serial/1080p_jpeg",
+                   TimeMs([&] { dataset.AugmentAndSaveToDirectory(output); },
+                          runs),
+                   pixels,
+                   bytes);
+  PipelineOptions options;
+  options.decode_workers = 4;
+  options.encode_workers = 4;
+  ReportThroughput(
+      "dataloader/AugmentAndSaveToDirectory/4_1_4_workers/1080p_jpeg",
+      TimeMs([&] { dataset.AugmentAndSaveToDirectory(output, options); },
+             runs),
+      pixels,
+      bytes);
+
+  StreamOptions stream_options;
+  stream_options.batch_size = 16;
+  stream_options.pipeline = options;
+  TensorOptions tensor_options;
+  std::vector<uchar> tensor(stream_options.batch_size *
+                            TensorImageBytes(tensor_options));
+  uint32_t epoch = 0;
+  ReportThroughput("dataloader/NextTensor/4_1_4_workers/1080p_jpeg",
+                   TimeMs([&] {
+                     dataset.StartEpoch(epoch++, stream_options);
+                     while (dataset.NextTensor(tensor_options, tensor.data())) {
+                     }
+                   }, runs),
+                   pixels,
+                   bytes);
+  boost::filesystem::remove_all("/tmp/bench_dataloader");
+}
+
+/*
+  main
+
+  Runs the benchmarks whose group contains the --filter text, all of them by
+  default. --json writes the results to a file; --baseline compares them to
+  such a file and fails if any benchmark got more than --threshold (default
+  0.1) slower.
+*/
+int main(int argc, char** argv) {
+  std::string filter, json_path, baseline_path;
+  double threshold = 0.1;
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 < argc && strcmp(argv[i], "--filter") == 0) {
+      filter = argv[i + 1];
+    } else if (i + 1 < argc && strcmp(argv[i], "--json") == 0) {
+      json_path = argv[i + 1];
+    } else if (i + 1 < argc && strcmp(argv[i], "--baseline") == 0) {
+      baseline_path = argv[i + 1];
+    } else if (i + 1 < argc && strcmp(argv[i], "--threshold") == 0) {
+      threshold = atof(argv[i + 1]);
+    } else {
+      cerr << "Usage: " << argv[0]
+           << " [--filter text] [--json results.json]"
+              " [--baseline baseline.json] [--threshold 0.1]"
+           << endl;
+      return 2;
+    }
+  }
+  // read the baseline first, so that a missing one fails before the run
+  std::map<std::string, double> baseline;
+  if (!baseline_path.empty()) {
+    try {
+      baseline = ReadJson(baseline_path);
+    } catch (const std::exception& e) {
+      cerr << e.what() << "; record one with make bench-baseline" << endl;
+      return 2;
+    }
+  }
+
+  std::vector<std::pair<std::string, std::function<void()>>> groups = {
+      {"rotation", BenchRotation},
+      {"flip", BenchFlips},
+      {"deform", BenchDeform},
+      {"blur", BenchBlur},
+      {"noise", BenchNoise},
+      {"pipeline", BenchPipeline},
+      {"tensor", BenchTensor},
+      {"cache", BenchImageCache},
+      {"packed", BenchPackedDataset},
+      {"tar", BenchTarShards},
+      {"decode", BenchReducedDecode},
+      {"ppm", BenchPpm},
+      {"stats", BenchStats},
+      {"augmentation", BenchAugmentations},
+      {"dataloader", BenchDataLoader}};
+  for (const auto& group : groups) {
+    if (group.first.find(filter) != std::string::npos) {
+      group.second();
+    }
+  }
+
+  if (!json_path.empty()) {
+    WriteJson(json_path);
+  }
+  if (!baseline_path.empty() &&
+      CompareToBaseline(baseline_path, baseline, threshold) > 0) {
+    return 1;
+  }
+  return 0;
+}
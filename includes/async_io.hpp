@@ -0,0 +1,52 @@
+#ifndef ASYNC_IO_HPP
+#define ASYNC_IO_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Reads and writes whole files with many requests in flight at once. Opening,
+// reading or writing and closing every file are all asynchronous io_uring
+// operations, so one thread keeps up to queue_depth files moving without
+// blocking in a syscall per file. Where io_uring is unavailable (old kernels,
+// seccomp filters) the same calls run on a pool of threads doing blocking
+// open/pread/pwrite/close instead.
+class AsyncFileIO {
+public:
+  explicit AsyncFileIO(unsigned queue_depth = 64, bool use_io_uring = true);
+  ~AsyncFileIO();
+  AsyncFileIO(const AsyncFileIO&) = delete;
+  AsyncFileIO& operator=(const AsyncFileIO&) = delete;
+
+  bool UsesIoUring() const;
+
+  // Reads every file of paths and calls done, on the calling thread and in
+  // completion order, with the position of the file in paths and its
+  // contents. done may move the contents out; returning false stops reading.
+  // Throws the first error once no request is in flight anymore.
+  void ReadFiles(
+      const std::vector<std::string>& paths,
+      const std::function<bool(size_t, std::vector<uint8_t>&)>& done);
+
+  // Writes the files next hands out, one (path, contents) pair per call,
+  // until it returns false. next is called on the calling thread and may
+  // block. Returns once every file is written and closed, or throws the
+  // first error.
+  void WriteFiles(
+      const std::function<bool(std::string&, std::vector<uint8_t>&)>& next);
+
+private:
+  struct Ring;
+  struct Request;
+
+  void RunRing(const std::function<bool(Request&)>& next,
+               const std::function<bool(Request&)>& done);
+
+  unsigned queue_depth_;
+  std::unique_ptr<Ring> ring_;
+};
+
+#endif
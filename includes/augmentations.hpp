@@ -10,10 +10,25 @@
 
 using namespace cv;
 
+class NoiseBank;
+class RotationMapCache;
+
 Mat RandomHorizontalFlip(const Mat& img, double hflip_ratio, RNG& rng);
+void RandomHorizontalFlip(const Mat& img,
+                          Mat& dst,
+                          double hflip_ratio,
+                          RNG& rng);
 Mat HorizontalFlip(const Mat& img);
+void HorizontalFlipInPlace(Mat& img);
+void HorizontalFlipTo(const Mat& img, Mat& dst);
 Mat RandomVerticalFlip(const Mat& img, double vflip_ratio, RNG& rng);
+void RandomVerticalFlip(const Mat& img,
+                        Mat& dst,
+                        double vflip_ratio,
+                        RNG& rng);
 Mat VerticalFlip(const Mat& img);
+void VerticalFlipInPlace(Mat& img);
+void VerticalFlipTo(const Mat& img, Mat& dst);
 
 Mat RandomRotateImage(const Mat& src,
                       double yaw_range,
@@ -24,24 +39,78 @@ Mat RandomRotateImage(const Mat& src,
                       double Z = 1000,
                       int interpolation = INTER_LINEAR,
                       int border_mode = BORDER_CONSTANT,
-                      const Scalar& border_color = Scalar(0, 0, 0));
+                      const Scalar& border_color = Scalar(0, 0, 0),
+                      RotationMapCache* cache = nullptr);
+void RandomRotateImage(const Mat& src,
+                       Mat& dst,
+                       double yaw_range,
+                       double pitch_range,
+                       double roll_range,
+                       RNG& rng,
+                       const Rect& area = Rect(-1, -1, 0, 0),
+                       double Z = 1000,
+                       int interpolation = INTER_LINEAR,
+                       int border_mode = BORDER_CONSTANT,
+                       const Scalar& border_color = Scalar(0, 0, 0),
+                       RotationMapCache* cache = nullptr);
 
 Mat Slide(const Mat& img, int x_shift, int y_shift);
+void Slide(const Mat& img, Mat& dst, int x_shift, int y_shift);
 Mat RandomSlide(const Mat& img, double slide_ratio, RNG& rng);
+void RandomSlide(const Mat& img, Mat& dst, double slide_ratio, RNG& rng);
+void DeformOffsets(int num_rows,
+                   int x_wave_amp,
+                   int x_wave_freq,
+                   int y_wave_amp,
+                   int y_wave_freq,
+                   std::vector<int>& x_offsets,
+                   std::vector<int>& y_offsets);
 Mat RandomDeform(const Mat& img,
                  std::pair<double, double> x_amp,
                  std::pair<double, double> y_amp,
                  std::pair<double, double> x_freq,
                  std::pair<double, double> y_freq,
                  RNG& rng);
+void RandomDeform(const Mat& img,
+                  Mat& dst,
+                  std::pair<double, double> x_amp,
+                  std::pair<double, double> y_amp,
+                  std::pair<double, double> x_freq,
+                  std::pair<double, double> y_freq,
+                  RNG& rng);
 Mat Blur(const Mat& src,
          const Mat& kernel,
          const Point& anchor = Point(-1, -1),
          double delta = 0,
          int depth = -1);
+void Blur(const Mat& src,
+          Mat& dst,
+          const Mat& kernel,
+          const Point& anchor = Point(-1, -1),
+          double delta = 0,
+          int depth = -1);
+Mat RandomGaussianBlur(const Mat& src,
+                       std::pair<double, double> sigma,
+                       RNG& rng);
+void RandomGaussianBlur(const Mat& src,
+                        Mat& dst,
+                        std::pair<double, double> sigma,
+                        RNG& rng);
+Mat RandomBoxBlur(const Mat& src, std::pair<int, int> ksize, RNG& rng);
+void RandomBoxBlur(const Mat& src,
+                   Mat& dst,
+                   std::pair<int, int> ksize,
+                   RNG& rng);
 Mat RandomNoise(const Mat& src,
                 const std::vector<double>& mean,
                 const std::vector<double>& variance,
                 RNG& rng);
+void RandomNoise(const Mat& src,
+                 Mat& dst,
+                 const std::vector<double>& mean,
+                 const std::vector<double>& variance,
+                 RNG& rng);
+Mat RandomNoise(const Mat& src, const NoiseBank& bank, RNG& rng);
+void RandomNoise(const Mat& src, Mat& dst, const NoiseBank& bank, RNG& rng);
 
 #endif
@@ -3,33 +3,198 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <opencv2/opencv.hpp>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "async_io.hpp"
+#include "bounded_queue.hpp"
+#include "image_cache.hpp"
+#include "image_header.hpp"
+#include "op_stats.hpp"
+#include "packed_dataset.hpp"
+#include "ping_pong_buffers.hpp"
+#include "ppm.hpp"
+#include "rng_streams.hpp"
+#include "tar_shards.hpp"
+#include "tensor.hpp"
+#include "tracer.hpp"
+
 using namespace cv;
 using namespace boost::filesystem;
 
+// Worker counts for the parallel AugmentAndSaveToDirectory pipeline. Each
+// stage runs on its own threads and hands images to the next stage through a
+// bounded queue of queue_capacity entries, and images waiting to be put back
+// in order also number at most queue_capacity. A nonzero shard_size makes
+// AugmentAndSaveToDirectory write tar shards of at most about that many
+// bytes, save_path/shard-000000.tar and so on, instead of one file per image.
+// With async_io, image files are read and written by AsyncFileIO with up to
+// io_queue_depth files in flight, and decoded and encoded in memory. With
+// ppm_output, every image is saved as binary PPM (P6), under its usual name
+// with a .ppm extension, whatever format it was read from.
+struct PipelineOptions {
+  int decode_workers = 1;
+  int augment_workers = 1;
+  int encode_workers = 1;
+  size_t queue_capacity = 16;
+  uint64_t shard_size = 0;
+  bool async_io = false;
+  unsigned io_queue_depth = 64;
+  bool ppm_output = false;
+};
+
+// Options of the streaming API. At most prefetch_batches batches of augmented
+// images wait for the consumer, on top of the images in flight in the
+// pipeline, so memory use does not depend on the size of the dataset. Tar
+// shards are read whole, so a shuffled epoch over them shuffles the shards
+// and then mixes their members through a buffer of shuffle_buffer augmented
+// images.
+struct StreamOptions {
+  size_t batch_size = 32;
+  size_t prefetch_batches = 2;
+  bool shuffle = true;
+  size_t shuffle_buffer = 64;
+  PipelineOptions pipeline;
+};
+
 class DataLoader {
 public:
   DataLoader();
   DataLoader(const std::string& path);
+  ~DataLoader();
   void LoadInMemory();
-  void AddAugmentation(std::function<Mat(const Mat&)> aug);
+  void AddAugmentation(std::function<Mat(const Mat&)> aug,
+                       const std::string& name = "");
+  void AddAugmentation(std::function<Mat(const Mat&, RNG&)> aug,
+                       const std::string& name = "");
+  void AddAugmentation(std::function<void(const Mat&, Mat&, RNG&)> aug,
+                       const std::string& name = "");
+  void SetSeed(uint64_t seed);
+  void SetEpoch(uint32_t epoch);
+  void EnableImageCache(
+      size_t budget_bytes,
+      CacheCompression compression = CacheCompression::kNone);
+  void SetDecodeSize(const Size& target);
+  ImageCacheStats GetImageCacheStats() const;
+  void EnableStats(bool enabled = true);
+  LoaderStats GetStats() const;
+  void ResetStats();
+  void DumpStats(const std::string& json_path, double interval_seconds);
+  void EnableTracing(bool enabled = true);
+  void WriteTrace(const std::string& json_path) const;
+  void UsePackedDataset(const std::string& pack_path);
+  void SavePacked(const std::string& pack_path);
+  void UseTarShards(const std::vector<std::string>& shard_paths);
   void PerformAugmentations();
   void AugmentAndSaveToDirectory(const std::string& save_path);
+  void AugmentAndSaveToDirectory(const std::string& save_path,
+                                 const PipelineOptions& options);
   void SaveImagesToDirectory(const std::string& path);
+  void StartEpoch(uint32_t epoch,
+                  const StreamOptions& options = StreamOptions());
+  bool Next(std::vector<Mat>& batch);
+  size_t NextTensor(const TensorOptions& options, void* data);
+  void StopStreaming();
   std::vector<Mat>& GetImages();
   std::vector<std::function<Mat(const Mat&)>>& GetAugmentations();
 
 private:
+  // Input and output shape of an augmentation the last time a worker ran it.
+  struct OpShape {
+    Size in_size;
+    int in_type = -1;
+    Size out_size;
+    int out_type = -1;
+  };
+  // State a worker keeps from image to image while running the augmentations.
+  struct Workspace {
+    PingPongBuffers buffers;
+    std::vector<OpShape> shapes;
+  };
+  // Recorders of every stage, one per augmentation in augmentations_ order.
+  struct StageRecorders {
+    std::chrono::steady_clock::time_point start;
+    OpStatsRecorder decode;
+    std::deque<OpStatsRecorder> augmentations;
+    OpStatsRecorder encode;
+  };
+
   Mat LoadImage(const std::string& path);
+  void AddAugmentationName(const std::string& name);
+  const char* AugmentationName(size_t op) const;
+  OpStatsRecorder* AugmentationRecorder(size_t op) const;
+  std::vector<uchar> EncodeImage(const path& file, const Mat& img) const;
+  void WriteImage(const std::string& file, const Mat& img) const;
+  void StopStatsDump();
+  Mat DecodeImage(size_t index, const path& file) const;
+  Mat DecodeBuffer(const std::vector<uint8_t>& data) const;
+  std::vector<path> ListImageFiles() const;
+  std::string OutputName(size_t i, const path& file) const;
+  std::string OutputPath(const std::string& save_path,
+                         size_t i,
+                         const path& file) const;
+  void RunPipeline(const std::vector<path>& files,
+                   const std::vector<size_t>& order,
+                   const std::function<void(size_t, const Mat&)>& sink,
+                   const PipelineOptions& options,
+                   const std::function<void(size_t)>& in_order = nullptr);
+  void EnterStream(size_t image, size_t op) const;
+  Mat ApplyAugmentations(size_t index,
+                         const Mat& img,
+                         Workspace& workspace) const;
   std::string directory_path_;
   std::vector<Mat> images_;
   bool in_memory_ = false;
   std::vector<std::function<Mat(const Mat&)>> augmentations_;
+  // Out-parameter form of each augmentation, empty for those added as
+  // functions returning a Mat.
+  std::vector<std::function<void(const Mat&, Mat&)>> into_augmentations_;
+  // A deque, so that the names' characters never move while tracer_ points
+  // at them.
+  std::deque<std::string> augmentation_names_;
+  uint64_t seed_ = 0;
+  uint32_t epoch_ = 0;
+  // Decoded images kept across epochs; null unless EnableImageCache was called.
+  std::unique_ptr<ImageCache> image_cache_;
+  // Size images may be decoded down to, empty to decode at full size.
+  Size decode_size_;
+  // Packed file images are read from instead of the directory, if any.
+  std::unique_ptr<PackedDataset> packed_;
+  std::string packed_path_;
+  // Tar shards images are read from instead of the directory, if any.
+  std::unique_ptr<TarShards> tar_shards_;
+
+  // Per-stage counters; null unless EnableStats was called. stats_mutex_
+  // guards the start time and adding recorders against GetStats, which the
+  // dump thread calls every interval until stop_stats_dump_ is set.
+  std::unique_ptr<StageRecorders> stats_;
+  mutable std::mutex stats_mutex_;
+  std::condition_variable stats_dump_cv_;
+  bool stop_stats_dump_ = false;
+  std::thread stats_dump_thread_;
+  // Spans of every stage and augmentation; null unless EnableTracing was
+  // called.
+  std::unique_ptr<Tracer> tracer_;
+
+  // Streaming state. The prefetch thread owns the pipeline for the current
+  // epoch and fills stream_queue_ with augmented images in stream_order_.
+  std::vector<path> stream_files_;
+  std::vector<size_t> stream_order_;
+  size_t stream_batch_size_ = 1;
+  std::unique_ptr<BoundedQueue<Mat>> stream_queue_;
+  std::thread stream_thread_;
+  std::exception_ptr stream_error_;
 };
 
 #endif
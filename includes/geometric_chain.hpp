@@ -0,0 +1,66 @@
+#ifndef GEOMETRIC_CHAIN_HPP
+#define GEOMETRIC_CHAIN_HPP
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <utility>
+#include <vector>
+
+using namespace cv;
+
+// Records a chain of geometric augmentations as coordinate transforms instead
+// of producing an image per augmentation. Apply() composes the transforms into
+// one sampling map and resamples the source once, so a chain of flips, slides,
+// deformations and rotations reads and writes the image a single time and is
+// interpolated at most once.
+//
+// The Random* members draw exactly the same values from rng as the Mat
+// augmentations of the same name, so a fused chain picks the same parameters
+// as the unfused one.
+class GeometricChain {
+public:
+  explicit GeometricChain(const Size& src_size);
+
+  void HorizontalFlip();
+  void VerticalFlip();
+  void Slide(int x_shift, int y_shift);
+  void Deform(int x_wave_amp, int x_wave_freq, int y_wave_amp, int y_wave_freq);
+  void Rotate(float yaw, float pitch, float roll, float Z = 1000);
+
+  void RandomHorizontalFlip(double hflip_ratio, RNG& rng);
+  void RandomVerticalFlip(double vflip_ratio, RNG& rng);
+  void RandomSlide(double slide_ratio, RNG& rng);
+  void RandomDeform(std::pair<double, double> x_amp,
+                    std::pair<double, double> y_amp,
+                    std::pair<double, double> x_freq,
+                    std::pair<double, double> y_freq,
+                    RNG& rng);
+  void RandomRotate(double yaw_sigma,
+                    double pitch_sigma,
+                    double roll_sigma,
+                    RNG& rng,
+                    double Z = 1000);
+
+  Size OutputSize() const;
+  bool Empty() const;
+  void BuildMaps(Mat& map_x, Mat& map_y) const;
+  Mat Apply(const Mat& src,
+            int interpolation = INTER_LINEAR,
+            const Scalar& border_color = Scalar(0, 0, 0)) const;
+
+private:
+  enum StepKind { HFLIP, VFLIP, SLIDE, DEFORM, ROTATE };
+  struct Step {
+    StepKind kind;
+    Size in_size;
+    int x_shift = 0, y_shift = 0;
+    std::vector<int> x_offsets, y_offsets;
+    Matx33d homography;
+  };
+
+  Size src_size_;
+  Size size_;
+  bool has_rotation_ = false;
+  std::vector<Step> steps_;
+};
+
+#endif
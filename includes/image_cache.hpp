@@ -0,0 +1,79 @@
+#ifndef IMAGE_CACHE_HPP
+#define IMAGE_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <opencv4/opencv2/core.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace cv;
+
+// How ImageCache stores pixels. kLz runs every row through a delta filter
+// (each byte minus the same byte of the pixel to its left) and compresses the
+// result with LzCompress: lossless, typically 1.5-3x smaller for photos, at
+// the cost of a decompression on every hit.
+enum class CacheCompression { kNone, kLz };
+
+struct ImageCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t entries = 0;
+  // Bytes held by the cache, after compression.
+  size_t bytes = 0;
+  // Decoded size of the images held by the cache.
+  size_t image_bytes = 0;
+};
+
+// Thread-safe least recently used cache of decoded images, bounded by a byte
+// budget. Images are decoded (or decompressed) outside the lock, so workers
+// only contend for the bookkeeping. Uncompressed hits share their pixels with
+// the cache and must be treated as read-only.
+class ImageCache {
+public:
+  explicit ImageCache(size_t budget_bytes,
+                      CacheCompression compression = CacheCompression::kNone);
+
+  // Returns the image cached under key, or loads, caches and returns it.
+  Mat GetOrLoad(const std::string& key, const std::function<Mat()>& load);
+
+  bool Get(const std::string& key, Mat& img);
+  void Put(const std::string& key, const Mat& img);
+  void Clear();
+
+  ImageCacheStats GetStats() const;
+  void ResetStats();
+
+private:
+  struct Entry {
+    std::string key;
+    // Exactly one of pixels and packed holds the image.
+    Mat pixels;
+    std::shared_ptr<const std::vector<uint8_t>> packed;
+    int rows = 0;
+    int cols = 0;
+    int type = 0;
+    size_t bytes = 0;
+    size_t image_bytes = 0;
+  };
+
+  Entry Pack(const std::string& key, const Mat& img) const;
+  static Mat Unpack(const Entry& entry);
+  void Insert(Entry entry);
+
+  size_t budget_bytes_;
+  CacheCompression compression_;
+  mutable std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  ImageCacheStats stats_;
+};
+
+#endif
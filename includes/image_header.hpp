@@ -0,0 +1,29 @@
+#ifndef IMAGE_HEADER_HPP
+#define IMAGE_HEADER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv4/opencv2/core.hpp>
+
+using namespace cv;
+
+enum class ImageFormat { kUnknown, kJpeg, kPng, kPnm };
+
+// What an encoded image's header says about it. size is the size imread
+// returns, after applying any EXIF orientation of JPEGs.
+struct ImageHeader {
+  ImageFormat format = ImageFormat::kUnknown;
+  Size size;
+};
+
+// Reads the header of an encoded image without decoding it. Returns false if
+// the format is not recognized or the header is truncated.
+bool ProbeImageHeader(const uint8_t* data, size_t size, ImageHeader& header);
+
+// imread/imdecode flag decoding an image at the smallest JPEG DCT scale
+// (1/2, 1/4 or 1/8) whose result still covers target in both dimensions, or
+// IMREAD_COLOR if no reduction fits, target is empty or the image is not a
+// JPEG, where a reduced decode would not save any work.
+int ReducedDecodeFlag(const ImageHeader& header, const Size& target);
+
+#endif
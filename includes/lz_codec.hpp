@@ -0,0 +1,25 @@
+#ifndef LZ_CODEC_HPP
+#define LZ_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Byte-oriented LZ77 codec writing the LZ4 block format: sequences of a
+// token, literals, a 16-bit back reference and a match length. It has no
+// entropy coding, so decompression is little more than memcpy and runs at
+// memory speed, cheap enough to sit between the image cache and the
+// augmentations.
+
+// Replaces dst with the compressed form of the size bytes at src.
+void LzCompress(const uint8_t* src, size_t size, std::vector<uint8_t>& dst);
+
+// Decompresses size bytes at src into exactly dst_size bytes at dst. Returns
+// false, with dst partially written, if the data is corrupt or does not
+// decompress to dst_size bytes.
+bool LzDecompress(const uint8_t* src,
+                  size_t size,
+                  uint8_t* dst,
+                  size_t dst_size);
+
+#endif
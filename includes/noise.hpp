@@ -0,0 +1,67 @@
+#ifndef NOISE_HPP
+#define NOISE_HPP
+
+#include <cstdint>
+#include <opencv4/opencv2/core.hpp>
+#include <vector>
+
+#include "philox.hpp"
+
+using namespace cv;
+
+// Row-at-a-time standard normal generator. Uniforms come from Philox4x32, so
+// stream s of a generator is fully determined by its seed and s and can be
+// produced on any thread; Box-Muller then runs over the whole row with
+// OpenCV's vectorized log/sqrt/polarToCart.
+class GaussianGenerator {
+public:
+  explicit GaussianGenerator(uint64_t seed);
+
+  // Switches to the streams of another seed, keeping the scratch buffers.
+  void Reseed(uint64_t seed);
+
+  // Writes n samples of N(0, 1) belonging to stream `stream` to out.
+  void Fill(uint32_t stream, float* out, int n);
+
+private:
+  Philox4x32::Key key_;
+  std::vector<float> radius_;
+  std::vector<float> angle_;
+  std::vector<float> x_;
+  std::vector<float> y_;
+};
+
+// Bank of pregenerated Gaussian noise tiles for one (mean, std_dev)
+// configuration. Add() sums the image with a window of a random tile at a
+// random offset, randomly mirrored, so noise costs one saturating add per
+// element instead of a generator call. More or larger tiles give more
+// independent noise at the price of memory and cache footprint.
+class NoiseBank {
+public:
+  // Tiles are stored with the given depth: CV_16S is enough for 8 and 16 bit
+  // images, float images need CV_32F. Every tile is also kept mirrored, so
+  // the bank takes 2 * num_tiles * tile area * channels elements.
+  NoiseBank(const std::vector<double>& mean,
+            const std::vector<double>& std_dev,
+            int channels,
+            int num_tiles = 4,
+            const Size& tile_size = Size(512, 512),
+            uint64_t seed = 0,
+            int depth = CV_16S);
+
+  // dst = saturate(src + noise window). src may be of any size and dst may
+  // alias it.
+  void Add(const Mat& src, Mat& dst, RNG& rng) const;
+
+  int Channels() const;
+  int NumTiles() const;
+  Size TileSize() const;
+
+private:
+  int channels_;
+  Size tile_size_;
+  std::vector<Mat> tiles_;
+  std::vector<Mat> mirrored_tiles_;
+};
+
+#endif
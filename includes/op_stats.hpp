@@ -0,0 +1,96 @@
+#ifndef OP_STATS_HPP
+#define OP_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Counters of one augmentation or pipeline stage. Latency percentiles are in
+// microseconds and accurate to about 3%.
+struct OpStats {
+  std::string name;
+  uint64_t calls = 0;
+  double total_ms = 0;
+  double p50_us = 0;
+  double p99_us = 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+};
+
+// Counters of every stage of a DataLoader over the elapsed_s seconds since
+// they were enabled or reset.
+struct LoaderStats {
+  double elapsed_s = 0;
+  OpStats decode;
+  std::vector<OpStats> augmentations;
+  OpStats encode;
+};
+
+// Formats stats as a single line of JSON, without the trailing newline.
+std::string StatsToJson(const LoaderStats& stats);
+
+// Appends s to out as a quoted and escaped JSON string.
+void AppendJsonString(std::string& out, const std::string& s);
+
+// Thread-safe accumulator behind an OpStats. Latencies are counted in a
+// log-linear histogram, 16 buckets per power of two nanoseconds, so recording
+// a call is a few relaxed atomic adds and percentiles are read off the
+// histogram.
+class OpStatsRecorder {
+public:
+  OpStatsRecorder();
+  void Record(uint64_t nanos, uint64_t bytes_in, uint64_t bytes_out);
+  OpStats Snapshot(const std::string& name) const;
+  void Reset();
+
+private:
+  static const int kBuckets = 976;
+  std::atomic<uint64_t> total_ns_;
+  std::atomic<uint64_t> bytes_in_;
+  std::atomic<uint64_t> bytes_out_;
+  std::atomic<uint64_t> buckets_[kBuckets];
+};
+
+// Times one call for a recorder. With a null recorder the clock is never
+// read, so disabled stats cost a branch per call.
+class OpTimer {
+public:
+  explicit OpTimer(OpStatsRecorder* recorder) : recorder_(recorder) {
+    if (recorder_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  void Stop(uint64_t bytes_in, uint64_t bytes_out) {
+    Stop();
+    Record(bytes_in, bytes_out);
+  }
+
+  // Stops the clock only, for byte counts that take work of their own, such
+  // as a stat, which should not count towards the call.
+  void Stop() {
+    if (recorder_) {
+      end_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  // Records the call timed up to Stop().
+  void Record(uint64_t bytes_in, uint64_t bytes_out) {
+    if (recorder_) {
+      recorder_->Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end_ - start_)
+              .count(),
+          bytes_in,
+          bytes_out);
+    }
+  }
+
+private:
+  OpStatsRecorder* recorder_;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::time_point end_;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef PACKED_DATASET_HPP
+#define PACKED_DATASET_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <opencv4/opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+/*
+PACKED FILE FORMAT
+
+A single file of decoded images, all integers little endian:
+
+  PackedFileHeader
+  pixels of image 0, 1, ..., each starting on a multiple of alignment
+  PackedFileEntry[count], at index_offset
+  the image names, concatenated, at names_offset
+*/
+
+struct PackedFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t alignment;
+  uint64_t count;
+  uint64_t index_offset;
+  uint64_t names_offset;
+  uint64_t names_size;
+};
+
+struct PackedFileEntry {
+  uint64_t offset;
+  uint64_t step;
+  int32_t rows;
+  int32_t cols;
+  int32_t type;
+  uint32_t name_length;
+  uint64_t name_offset;
+};
+
+// Writes a packed file one image at a time. Pixels go straight to disk; only
+// the index is kept in memory until Finish.
+class PackedDatasetWriter {
+public:
+  explicit PackedDatasetWriter(const std::string& path);
+  ~PackedDatasetWriter();
+  void Add(const std::string& name, const Mat& img);
+  void Finish();
+
+private:
+  void Pad();
+
+  std::ofstream out_;
+  std::vector<PackedFileEntry> entries_;
+  std::string names_;
+  uint64_t position_ = 0;
+  bool finished_ = false;
+};
+
+// Read-only view of a packed file mapped into memory. Images are Mat headers
+// pointing into the mapping: opening is instant whatever the size of the
+// dataset, pages are read from disk on first touch, and the page cache is
+// shared by every process mapping the file. The images must not be written
+// to and must not outlive the dataset.
+class PackedDataset {
+public:
+  explicit PackedDataset(const std::string& path);
+  ~PackedDataset();
+  PackedDataset(const PackedDataset&) = delete;
+  PackedDataset& operator=(const PackedDataset&) = delete;
+
+  size_t Size() const;
+  Mat Image(size_t i) const;
+  std::string Name(size_t i) const;
+
+private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  const PackedFileEntry* entries_ = nullptr;
+  const char* names_ = nullptr;
+  size_t count_ = 0;
+};
+
+#endif
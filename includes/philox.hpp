@@ -0,0 +1,37 @@
+#ifndef PHILOX_HPP
+#define PHILOX_HPP
+
+#include <array>
+#include <cstdint>
+
+// Philox4x32-10 counter-based random number generator (Salmon et al.,
+// "Parallel Random Numbers: As Easy as 1, 2, 3", SC 2011). Every (counter,
+// key) pair maps to four independent 32 bit words, so any element of a random
+// stream can be generated directly from its index, on any thread, in any
+// order.
+struct Philox4x32 {
+  typedef std::array<uint32_t, 4> Counter;
+  typedef std::array<uint32_t, 2> Key;
+
+  static Counter Generate(Counter counter, Key key) {
+    for (int round = 0; round < 10; ++round) {
+      if (round > 0) {
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
+      }
+      uint64_t product0 = (uint64_t)0xD2511F53 * counter[0];
+      uint64_t product1 = (uint64_t)0xCD9E8D57 * counter[2];
+      counter = {(uint32_t)(product1 >> 32) ^ counter[1] ^ key[0],
+                 (uint32_t)product1,
+                 (uint32_t)(product0 >> 32) ^ counter[3] ^ key[1],
+                 (uint32_t)product0};
+    }
+    return counter;
+  }
+
+  static Key MakeKey(uint64_t seed) {
+    return {(uint32_t)seed, (uint32_t)(seed >> 32)};
+  }
+};
+
+#endif
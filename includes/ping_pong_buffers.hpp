@@ -0,0 +1,33 @@
+#ifndef PING_PONG_BUFFERS_HPP
+#define PING_PONG_BUFFERS_HPP
+
+#include <opencv4/opencv2/core.hpp>
+
+using namespace cv;
+
+// Two reusable image buffers that a chain of out-parameter augmentations
+// alternates between: every op writes to the buffer that does not hold its
+// input. The buffers only ever grow, to the largest image asked for, so once
+// they have grown a chain runs without allocating.
+class PingPongBuffers {
+public:
+  // Returns a view of shape (size, type) into the buffer not holding input.
+  // The view does not own its memory; it stays valid until the buffer is
+  // grown or detached.
+  Mat Target(const Mat& input, const Size& size, int type);
+
+  // Whether image lives in one of the buffers.
+  bool Holds(const Mat& image) const;
+
+  // Hands the buffer holding image over to the caller, which keeps image
+  // valid after the buffers move on to the next image, and takes replacement
+  // (an empty Mat, or a buffer the consumer of an earlier image gave back) in
+  // its place.
+  Mat Detach(const Mat& image, const Mat& replacement = Mat());
+
+private:
+  int IndexOf(const Mat& image) const;
+  Mat storage_[2];
+};
+
+#endif
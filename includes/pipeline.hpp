@@ -0,0 +1,189 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <cassert>
+#include <functional>
+#include <opencv4/opencv2/core.hpp>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "augmentations.hpp"
+#include "noise.hpp"
+
+using namespace cv;
+
+// Augmentation pipeline composed at compile time. Every op is a functor
+//
+//   bool operator()(const Mat& src, Mat& dst, RNG& rng) const
+//
+// that writes its result to dst and returns true, or returns false without
+// touching dst when it decides to leave the image unchanged. The calls are
+// resolved statically, so probability checks inline into the pipeline, and
+// the ops ping-pong between the caller's output and a scratch buffer instead
+// of allocating an image per op.
+template <typename... Ops>
+class Pipeline {
+public:
+  explicit Pipeline(Ops... ops) : ops_(std::move(ops)...) {}
+
+  // Runs every op on src and leaves the result in dst. scratch is only used
+  // as intermediate storage; keeping both alive between calls lets the ops
+  // reuse their buffers. Neither may be src itself.
+  void operator()(const Mat& src, Mat& dst, Mat& scratch, RNG& rng) const {
+    assert(&dst != &src && &scratch != &src && &dst != &scratch);
+    if (dst.data == src.data) {
+      dst.release();
+    }
+    if (scratch.data == src.data) {
+      scratch.release();
+    }
+    const Mat* current = &src;
+    std::apply(
+        [&](const Ops&... ops) {
+          (Step(ops, current, dst, scratch, rng), ...);
+        },
+        ops_);
+    if (current == &src) {
+      src.copyTo(dst);
+    } else if (current == &scratch) {
+      std::swap(dst, scratch);
+    }
+  }
+
+  Mat operator()(const Mat& src, RNG& rng) const {
+    Mat dst, scratch;
+    (*this)(src, dst, scratch, rng);
+    return dst;
+  }
+
+private:
+  template <typename Op>
+  static void Step(const Op& op,
+                   const Mat*& current,
+                   Mat& dst,
+                   Mat& scratch,
+                   RNG& rng) {
+    Mat& target = current == &dst ? scratch : dst;
+    if (op(*current, target, rng)) {
+      current = &target;
+    }
+  }
+
+  std::tuple<Ops...> ops_;
+};
+
+// Wraps a pipeline for DataLoader::AddAugmentation. Each thread keeps its own
+// scratch buffer across calls.
+template <typename... Ops>
+std::function<Mat(const Mat&, RNG&)> AsAugmentation(
+    const Pipeline<Ops...>& pipeline) {
+  return [pipeline](const Mat& img, RNG& rng) {
+    thread_local Mat scratch;
+    Mat dst;
+    pipeline(img, dst, scratch, rng);
+    return dst;
+  };
+}
+
+/*
+OPS
+
+Each op draws from the RNG exactly like the matching Random* function, so a
+pipeline gives the same images as calling those functions in sequence.
+*/
+
+struct HorizontalFlipOp {
+  double ratio;
+  bool operator()(const Mat& src, Mat& dst, RNG& rng) const {
+    if (!(ratio > rng.uniform(0.0, 1.0))) {
+      return false;
+    }
+    HorizontalFlipTo(src, dst);
+    return true;
+  }
+};
+
+struct VerticalFlipOp {
+  double ratio;
+  bool operator()(const Mat& src, Mat& dst, RNG& rng) const {
+    if (!(ratio > rng.uniform(0.0, 1.0))) {
+      return false;
+    }
+    VerticalFlipTo(src, dst);
+    return true;
+  }
+};
+
+struct SlideOp {
+  double ratio;
+  bool operator()(const Mat& src, Mat& dst, RNG& rng) const {
+    if (!(ratio > rng.uniform(0.0, 1.0))) {
+      return false;
+    }
+    int x_slide = rng.uniform(-1 * src.cols, src.cols);
+    int y_slide = rng.uniform(-1 * src.rows, src.rows);
+    Slide(src, dst, x_slide, y_slide);
+    return true;
+  }
+};
+
+struct DeformOp {
+  std::pair<double, double> x_amp;
+  std::pair<double, double> y_amp;
+  std::pair<double, double> x_freq;
+  std::pair<double, double> y_freq;
+  bool operator()(const Mat& src, Mat& dst, RNG& rng) const {
+    RandomDeform(src, dst, x_amp, y_amp, x_freq, y_freq, rng);
+    return true;
+  }
+};
+
+struct NoiseOp {
+  std::vector<double> mean;
+  std::vector<double> std_dev;
+  bool operator()(const Mat& src, Mat& dst, RNG& rng) const {
+    RandomNoise(src, dst, mean, std_dev, rng);
+    return true;
+  }
+};
+
+struct NoiseBankOp {
+  const NoiseBank* bank;
+  bool operator()(const Mat& src, Mat& dst, RNG& rng) const {
+    bank->Add(src, dst, rng);
+    return true;
+  }
+};
+
+struct BlurOp {
+  Mat kernel;
+  bool operator()(const Mat& src, Mat& dst, RNG&) const {
+    Blur(src, dst, kernel);
+    return true;
+  }
+};
+
+struct RotateOp {
+  double yaw_sigma;
+  double pitch_sigma;
+  double roll_sigma;
+  RotationMapCache* cache = nullptr;
+  bool operator()(const Mat& src, Mat& dst, RNG& rng) const {
+    RandomRotateImage(src,
+                      dst,
+                      yaw_sigma,
+                      pitch_sigma,
+                      roll_sigma,
+                      rng,
+                      Rect(-1, -1, 0, 0),
+                      1000,
+                      INTER_LINEAR,
+                      BORDER_CONSTANT,
+                      Scalar(0, 0, 0),
+                      cache);
+    return true;
+  }
+};
+
+#endif
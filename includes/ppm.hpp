@@ -0,0 +1,25 @@
+#ifndef PPM_HPP
+#define PPM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv4/opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+// Decodes a binary (P6) or ASCII (P3) PPM with a maximum value of 255 into a
+// BGR image, the same image imdecode returns. ASCII samples are located with
+// SIMD compares 16 bytes at a time. Returns an empty Mat for other formats and
+// for malformed images, which imdecode can then try and report on.
+Mat DecodePpm(const uint8_t* data, size_t size);
+
+// Memory maps a PPM file and decodes it with DecodePpm. Returns an empty Mat
+// if the file cannot be read or decoded.
+Mat ReadPpm(const std::string& path);
+
+// Encodes an 8-bit image with 1, 3 or 4 channels as binary PPM (P6).
+void EncodePpm(const Mat& img, std::vector<uint8_t>& encoded);
+
+#endif
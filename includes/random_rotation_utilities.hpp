@@ -1,7 +1,14 @@
 #ifndef __RANDOM_ROTATION_UTILITIES__
 #define __RANDOM_ROTATION_UTILITIES__
 
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <tuple>
+#include <utility>
 
 using namespace cv;
 
@@ -13,6 +20,18 @@ void composeExternalMatrix(float yaw,
                            float trans_z,
                            Mat& external_matrix);
 
+void ComposeRotation(const Size& src_size,
+                     float yaw,
+                     float pitch,
+                     float roll,
+                     float Z,
+                     Mat& rotMat,
+                     Rect_<double>& CircumRect);
+
+Matx33d RotationHomography(const Size& src_size,
+                           const Rect_<double>& dst_rect,
+                           const Mat& transMat);
+
 void CreateMap(const Size& src_size,
                const Rect_<double>& dst_rect,
                const Mat& transMat,
@@ -29,6 +48,68 @@ void RotateImage(const Mat& src,
                  int border_mode = BORDER_CONSTANT,
                  const Scalar& border_color = Scalar(0, 0, 0));
 
+// LRU cache of the remap tables RotateImage needs for one image size and one
+// set of angles. Angles are rounded to multiples of angle_step degrees so that
+// a dataset of equally sized images only ever needs a bounded set of tables.
+class RotationMapCache {
+public:
+  struct Maps {
+    Mat map1;  // CV_16SC2 integer source positions
+    Mat map2;  // CV_16UC1 interpolation table indices (empty for nearest)
+    size_t bytes = 0;
+  };
+
+  RotationMapCache(size_t max_bytes, double angle_step = 0.5);
+  std::shared_ptr<const Maps> Get(const Size& src_size,
+                                  float yaw,
+                                  float pitch,
+                                  float roll,
+                                  float Z,
+                                  int interpolation);
+  size_t Hits() const;
+  size_t Misses() const;
+  size_t Bytes() const;
+
+private:
+  struct Key {
+    int width, height;
+    int yaw, pitch, roll;
+    float Z;
+    bool nearest;
+    bool operator<(const Key& other) const {
+      return std::tie(width, height, yaw, pitch, roll, Z, nearest) <
+             std::tie(other.width,
+                      other.height,
+                      other.yaw,
+                      other.pitch,
+                      other.roll,
+                      other.Z,
+                      other.nearest);
+    }
+  };
+
+  size_t max_bytes_;
+  double angle_step_;
+  size_t bytes_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  std::list<Key> lru_;
+  std::map<Key, std::pair<std::shared_ptr<Maps>, std::list<Key>::iterator>>
+      entries_;
+  mutable std::mutex mutex_;
+};
+
+void RotateImage(const Mat& src,
+                 Mat& dst,
+                 float yaw,
+                 float pitch,
+                 float roll,
+                 RotationMapCache& cache,
+                 float Z = 1000,
+                 int interpolation = INTER_LINEAR,
+                 int border_mode = BORDER_CONSTANT,
+                 const Scalar& border_color = Scalar(0, 0, 0));
+
 // Keep center and expand rectangle for rotation
 Rect ExpandRectForRotate(const Rect& area);
 
@@ -0,0 +1,26 @@
+#ifndef RNG_STREAMS_HPP
+#define RNG_STREAMS_HPP
+
+#include <cstdint>
+#include <opencv4/opencv2/core.hpp>
+
+using namespace cv;
+
+// Identifies the random stream of one augmentation call: augmentation `op` of
+// the pipeline applied to image `image` during epoch `epoch` of a run seeded
+// with `seed`.
+struct StreamId {
+  uint64_t seed = 0;
+  uint32_t epoch = 0;
+  uint32_t image = 0;
+  uint32_t op = 0;
+};
+
+RNG StreamRng(const StreamId& id);
+
+// Stream of the augmentation running on the calling thread. DataLoader sets it
+// before every call to an augmentation added with an RNG parameter.
+void SetCurrentStream(const StreamId& id);
+const StreamId& CurrentStream();
+
+#endif
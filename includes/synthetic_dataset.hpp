@@ -0,0 +1,47 @@
+#ifndef SYNTHETIC_DATASET_HPP
+#define SYNTHETIC_DATASET_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv4/opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+// Encoding of a synthetic image. kPpm is binary (P6) and kPpmAscii ASCII (P3);
+// both are saved with the .ppm extension.
+enum class SyntheticFormat { kJpeg, kPng, kPpm, kPpmAscii };
+
+// What GenerateSyntheticDataset writes. Every image draws its size from sizes
+// and its format from formats, with probabilities proportional to the
+// weights (equal if a weights vector is empty), and then scales each side by
+// a factor drawn uniformly from [1 - size_jitter, 1 + size_jitter]. With a
+// nonzero files_per_directory, the images are spread over subdirectories
+// 000000, 000001, ... of at most that many images each.
+struct SyntheticDatasetOptions {
+  size_t count = 100;
+  uint64_t seed = 0;
+  std::vector<Size> sizes = {Size(1920, 1080)};
+  std::vector<double> size_weights;
+  double size_jitter = 0;
+  std::vector<SyntheticFormat> formats = {SyntheticFormat::kJpeg};
+  std::vector<double> format_weights;
+  int jpeg_quality = 90;
+  int png_compression = 3;
+  size_t files_per_directory = 0;
+};
+
+// Draws an image of the given size: a gradient with filled rectangles and
+// ellipses and a little noise, so that it compresses and decodes more like a
+// photo than like random pixels.
+Mat SyntheticImage(const Size& size, RNG& rng);
+
+// Writes options.count images under directory, in parallel, and returns their
+// paths in index order. Image i is named after i, so names are unique across
+// subdirectories. Every image, its size, format and path depend only on the
+// options, never on the number of threads.
+std::vector<std::string> GenerateSyntheticDataset(
+    const std::string& directory, const SyntheticDatasetOptions& options);
+
+#endif
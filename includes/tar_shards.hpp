@@ -0,0 +1,74 @@
+#ifndef TAR_SHARDS_HPP
+#define TAR_SHARDS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A regular file stored in a tar shard.
+struct TarMember {
+  size_t shard = 0;
+  std::string name;
+  // Position of the file's data in the shard.
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+// Read-only set of tar shards (ustar, with GNU long names and pax path
+// records), indexed by reading each member header once when opened. Members
+// can be read one at a time from any thread, or in bulk with large
+// sequential reads that serve many members each.
+class TarShards {
+public:
+  explicit TarShards(const std::vector<std::string>& paths);
+  ~TarShards();
+  TarShards(const TarShards&) = delete;
+  TarShards& operator=(const TarShards&) = delete;
+
+  size_t Size() const;
+  size_t NumShards() const;
+  const TarMember& Member(size_t i) const;
+  const std::string& ShardPath(size_t shard) const;
+
+  void Read(size_t i, std::vector<uint8_t>& data) const;
+  void ReadSequential(
+      const std::vector<size_t>& members,
+      const std::function<bool(size_t, std::vector<uint8_t>&)>& fn,
+      size_t buffer_size = 8 << 20) const;
+
+private:
+  void Index(size_t shard);
+
+  std::vector<std::string> paths_;
+  std::vector<int> fds_;
+  std::vector<uint64_t> sizes_;
+  std::vector<TarMember> members_;
+};
+
+// Writes files to a sequence of tar shards named <prefix>-000000.tar,
+// <prefix>-000001.tar, ..., starting a new shard whenever the next file would
+// take the current one past shard_size bytes. Not thread-safe.
+class TarShardWriter {
+public:
+  TarShardWriter(const std::string& prefix, uint64_t shard_size);
+  ~TarShardWriter();
+  void Add(const std::string& name, const uint8_t* data, uint64_t size);
+  void Close();
+  const std::vector<std::string>& ShardPaths() const;
+
+private:
+  void FinishShard();
+  void WriteHeader(const std::string& name, char type, uint64_t size);
+  void Pad(uint64_t size);
+
+  std::string prefix_;
+  uint64_t shard_size_;
+  std::ofstream out_;
+  uint64_t shard_bytes_ = 0;
+  std::vector<std::string> shard_paths_;
+};
+
+#endif
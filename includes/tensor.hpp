@@ -0,0 +1,30 @@
+#ifndef TENSOR_HPP
+#define TENSOR_HPP
+
+#include <cstddef>
+#include <opencv4/opencv2/core.hpp>
+#include <vector>
+
+using namespace cv;
+
+// Layout and normalization of the tensors written by PackTensor. An image
+// becomes `channels` planes of size.height x size.width elements (CHW), where
+// plane c holds (pixel * scale - mean[c]) / std_dev[c] of the bilinearly
+// resized image. With swap_rb the planes are in RGB order, since images are
+// decoded as BGR. depth is CV_32F or CV_16F.
+struct TensorOptions {
+  Size size = Size(224, 224);
+  int channels = 3;
+  double scale = 1.0 / 255;
+  std::vector<double> mean = {0, 0, 0};
+  std::vector<double> std_dev = {1, 1, 1};
+  bool swap_rb = true;
+  int depth = CV_32F;
+};
+
+// Bytes of one image in a tensor; image i of a batch starts at i times this.
+size_t TensorImageBytes(const TensorOptions& options);
+
+void PackTensor(const Mat& img, const TensorOptions& options, void* dst);
+
+#endif
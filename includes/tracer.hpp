@@ -0,0 +1,116 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records spans of work, each with a category, a name, the thread that did it
+// and optionally the image it was done for, and writes them as Chrome
+// trace_event JSON to open in Perfetto or chrome://tracing. Every thread
+// records into its own ring buffer of spans_per_thread spans, without locks
+// or allocation; a full ring overwrites its oldest spans. When a thread
+// exits its ring goes to the next thread that starts recording, so memory is
+// bounded by the number of threads recording at once, however many pipelines
+// are started. Categories and names are kept as pointers and must outlive the
+// tracer.
+class Tracer {
+public:
+  explicit Tracer(size_t spans_per_thread = 1 << 16);
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  // Names the calling thread's track in the trace.
+  void NameThread(const std::string& name);
+  void Record(const char* category,
+              const char* name,
+              int64_t image,
+              std::chrono::steady_clock::time_point start,
+              std::chrono::steady_clock::time_point end);
+  // Number of spans held, at most spans_per_thread per ring.
+  size_t Size() const;
+  // Spans recorded while the trace is written may be torn, so write it once
+  // the traced work is done.
+  void WriteChromeTrace(const std::string& path) const;
+
+private:
+  struct Span {
+    const char* category;
+    const char* name;
+    int64_t image;
+    int64_t start_ns;
+    int64_t end_ns;
+  };
+  // A thread whose spans a ring may hold, from span number first on.
+  struct Track {
+    uint64_t first;
+    int tid;
+    std::string name;
+  };
+  // Written by one thread at a time; recorded is published with release so
+  // that a reader that acquires it sees the spans before it. tracks is
+  // guarded by the pool's mutex.
+  struct Ring {
+    std::unique_ptr<Span[]> spans;
+    std::atomic<uint64_t> recorded;
+    std::deque<Track> tracks;
+  };
+  // Shared with the recording threads, so that a thread can hand its ring
+  // back when it exits, even after the tracer is gone.
+  struct Pool {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring*> free;
+    int next_tid = 1;
+  };
+  struct ThreadRings;
+
+  Ring* ThreadRing();
+
+  const uint64_t id_;
+  const size_t capacity_;
+  const std::chrono::steady_clock::time_point start_;
+  const std::shared_ptr<Pool> pool_;
+};
+
+// Records a span from construction to destruction. With a null tracer the
+// clock is never read.
+class TraceSpan {
+public:
+  TraceSpan(Tracer* tracer,
+            const char* category,
+            const char* name,
+            int64_t image = -1)
+      : tracer_(tracer), category_(category), name_(name), image_(image) {
+    if (tracer_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  ~TraceSpan() {
+    if (tracer_) {
+      tracer_->Record(category_,
+                      name_,
+                      image_,
+                      start_,
+                      std::chrono::steady_clock::now());
+    }
+  }
+
+private:
+  Tracer* tracer_;
+  const char* category_;
+  const char* name_;
+  int64_t image_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif
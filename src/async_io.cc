@@ -0,0 +1,588 @@
+#include "async_io.hpp"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "bounded_queue.hpp"
+
+// Reads of files of unknown size start with this many bytes and double.
+static const size_t kInitialReadSize = 256 << 10;
+// The fallback does not need a thread per request to keep a device busy.
+static const unsigned kMaxFallbackThreads = 16;
+
+static std::string ErrorMessage(const char* what,
+                                const std::string& path,
+                                int error) {
+  return std::string(what) + " " + path + ": " + strerror(error);
+}
+
+/*
+RING
+
+Minimal io_uring driver on the raw syscalls, so no library is needed. Only the
+submitting thread touches the rings.
+*/
+
+struct AsyncFileIO::Ring {
+  int fd = -1;
+  void* sq_ptr = MAP_FAILED;
+  size_t sq_size = 0;
+  void* cq_ptr = MAP_FAILED;
+  size_t cq_size = 0;
+  io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+  size_t sqes_size = 0;
+
+  unsigned* sq_head = nullptr;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_mask = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned sq_entries = 0;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned* cq_mask = nullptr;
+  io_uring_cqe* cqes = nullptr;
+  unsigned to_submit = 0;
+
+  ~Ring() {
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+      munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != MAP_FAILED) {
+      munmap(sq_ptr, sq_size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  // Sets up a ring of at least entries entries. Returns false if the kernel
+  // does not allow io_uring or lacks one of the operations used.
+  bool Init(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+      return false;
+    }
+
+    std::vector<uint8_t> probe_buffer(sizeof(io_uring_probe) +
+                                      256 * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = (io_uring_probe*)probe_buffer.data();
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) <
+        0) {
+      return false;
+    }
+    for (int op : {IORING_OP_OPENAT,
+                   IORING_OP_READ,
+                   IORING_OP_WRITE,
+                   IORING_OP_CLOSE}) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        return false;
+      }
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    sq_ptr = mmap(nullptr,
+                  sq_size,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  fd,
+                  IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+      return false;
+    }
+    cq_ptr = single_mmap ? sq_ptr
+                         : mmap(nullptr,
+                                cq_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE,
+                                fd,
+                                IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) {
+      return false;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(nullptr,
+                               sqes_size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE,
+                               fd,
+                               IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+
+    uint8_t* sq = (uint8_t*)sq_ptr;
+    sq_head = (unsigned*)(sq + params.sq_off.head);
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    uint8_t* cq = (uint8_t*)cq_ptr;
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  // Queues a submission. The caller never has more requests in flight than
+  // the ring has entries, each with one operation at a time, so there is
+  // always room.
+  void Push(const io_uring_sqe& sqe) {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    sqes[index] = sqe;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+  }
+
+  // Submits everything queued and waits for min_complete completions.
+  void Enter(unsigned min_complete) {
+    while (to_submit > 0 || min_complete > 0) {
+      long submitted = syscall(__NR_io_uring_enter,
+                               fd,
+                               to_submit,
+                               min_complete,
+                               min_complete > 0 ? IORING_ENTER_GETEVENTS : 0,
+                               nullptr,
+                               0);
+      if (submitted < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+          continue;
+        }
+        throw std::runtime_error(std::string("io_uring_enter: ") +
+                                 strerror(errno));
+      }
+      to_submit -= (unsigned)submitted;
+      min_complete = 0;
+    }
+  }
+
+  bool Pop(io_uring_cqe& cqe) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    cqe = cqes[head & *cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+};
+
+// One file on its way through open -> read or write -> close.
+struct AsyncFileIO::Request {
+  enum Stage { kOpen, kTransfer, kClose };
+  bool write = false;
+  size_t index = 0;
+  std::string path;
+  std::vector<uint8_t> data;
+  size_t done = 0;
+  int fd = -1;
+  Stage stage = kOpen;
+  // errno of the first failure, reported once the file is closed
+  int error = 0;
+  const char* failed = nullptr;
+};
+
+AsyncFileIO::AsyncFileIO(unsigned queue_depth, bool use_io_uring)
+    : queue_depth_(std::max(1u, queue_depth)) {
+  if (use_io_uring) {
+    ring_.reset(new Ring());
+    if (!ring_->Init(queue_depth_)) {
+      ring_.reset();
+    }
+  }
+}
+
+AsyncFileIO::~AsyncFileIO() {}
+
+bool AsyncFileIO::UsesIoUring() const { return ring_ != nullptr; }
+
+/*
+  RunRing
+
+  Moves up to queue_depth requests through their stages on the ring. Every
+  completion immediately queues the request's next operation, and everything
+  queued is submitted with a single io_uring_enter, before next is asked for
+  more work. A request that fails is still closed, and the loop only returns
+  once nothing is in flight, since the kernel may be writing into the
+  requests' buffers until then.
+
+  @param const std::function<bool(Request&)>& next -> fills in a new request,
+  or returns false when there is no more work
+  @param const std::function<bool(Request&)>& done -> receives a finished
+  read; returning false stops taking new requests
+*/
+void AsyncFileIO::RunRing(const std::function<bool(Request&)>& next,
+                          const std::function<bool(Request&)>& done) {
+  Ring& ring = *ring_;
+  unsigned depth = std::min(queue_depth_, ring.sq_entries);
+  std::vector<Request> requests(depth);
+  std::vector<size_t> free_slots;
+  for (size_t i = depth; i > 0; --i) {
+    free_slots.push_back(i - 1);
+  }
+  unsigned in_flight = 0;
+  bool more = true;
+  bool stopped = false;
+  std::exception_ptr error;
+
+  auto queue = [&](size_t slot) {
+    Request& request = requests[slot];
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = slot;
+    switch (request.stage) {
+      case Request::kOpen:
+        sqe.opcode = IORING_OP_OPENAT;
+        sqe.fd = AT_FDCWD;
+        sqe.addr = (uint64_t)request.path.c_str();
+        sqe.open_flags = request.write ? O_WRONLY | O_CREAT | O_TRUNC
+                                       : O_RDONLY;
+        sqe.len = 0644;
+        break;
+      case Request::kTransfer:
+        if (!request.write && request.done == request.data.size()) {
+          request.data.resize(std::max(kInitialReadSize,
+                                       2 * request.data.size()));
+        }
+        sqe.opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = request.fd;
+        sqe.addr = (uint64_t)(request.data.data() + request.done);
+        sqe.len = (uint32_t)std::min<size_t>(
+            request.data.size() - request.done, 1u << 30);
+        sqe.off = request.done;
+        break;
+      case Request::kClose:
+        sqe.opcode = IORING_OP_CLOSE;
+        sqe.fd = request.fd;
+        break;
+    }
+    ring.Push(sqe);
+  };
+  auto fail = [&](Request& request, const char* what, int error_number) {
+    if (request.error == 0) {
+      request.error = error_number;
+      request.failed = what;
+    }
+  };
+
+  while (true) {
+    while (more && !error && !free_slots.empty()) {
+      size_t slot = free_slots.back();
+      Request& request = requests[slot];
+      request = Request();
+      try {
+        more = next(request);
+      } catch (...) {
+        error = std::current_exception();
+        break;
+      }
+      if (!more) {
+        break;
+      }
+      free_slots.pop_back();
+      ++in_flight;
+      queue(slot);
+    }
+    if (in_flight == 0) {
+      break;
+    }
+    ring.Enter(1);
+
+    io_uring_cqe cqe;
+    while (ring.Pop(cqe)) {
+      size_t slot = cqe.user_data;
+      Request& request = requests[slot];
+      int result = cqe.res;
+      switch (request.stage) {
+        case Request::kOpen:
+          if (result < 0) {
+            fail(request, "Cannot open", -result);
+            request.stage = Request::kClose;
+            // nothing to close
+            request.fd = -1;
+            break;
+          }
+          request.fd = result;
+          request.stage = request.write && request.data.empty()
+                              ? Request::kClose
+                              : Request::kTransfer;
+          break;
+        case Request::kTransfer:
+          if (result < 0 && result != -EINTR && result != -EAGAIN) {
+            fail(request,
+                 request.write ? "Cannot write" : "Cannot read",
+                 -result);
+            request.stage = Request::kClose;
+          } else if (result == 0 && request.write) {
+            fail(request, "Cannot write", EIO);
+            request.stage = Request::kClose;
+          } else if (result == 0) {
+            // end of file
+            request.data.resize(request.done);
+            request.stage = Request::kClose;
+          } else if (result > 0) {
+            request.done += result;
+            if (request.write && request.done == request.data.size()) {
+              request.stage = Request::kClose;
+            }
+          }
+          break;
+        case Request::kClose:
+          request.fd = -1;
+          if (result < 0) {
+            fail(request, "Cannot close", -result);
+          }
+          break;
+      }
+
+      if (request.stage == Request::kClose && request.fd >= 0) {
+        queue(slot);
+        continue;
+      }
+      if (request.stage != Request::kClose) {
+        queue(slot);
+        continue;
+      }
+      // closed
+      --in_flight;
+      free_slots.push_back(slot);
+      if (error) {
+        continue;
+      }
+      if (request.error != 0) {
+        error = std::make_exception_ptr(std::runtime_error(ErrorMessage(
+            request.failed, request.path, request.error)));
+        continue;
+      }
+      if (!request.write && !stopped) {
+        try {
+          if (!done(request)) {
+            more = false;
+            stopped = true;
+          }
+        } catch (...) {
+          error = std::current_exception();
+        }
+      }
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/*
+FALLBACK
+
+Blocking whole-file reads and writes for the thread pool.
+*/
+
+static void ReadWholeFile(const std::string& path, std::vector<uint8_t>& data) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(ErrorMessage("Cannot open", path, errno));
+  }
+  struct stat info;
+  size_t size = fstat(fd, &info) == 0 ? (size_t)info.st_size : 0;
+  data.resize(std::max(size + 1, kInitialReadSize));
+  size_t done = 0;
+  while (true) {
+    if (done == data.size()) {
+      data.resize(2 * data.size());
+    }
+    ssize_t n = pread(fd, data.data() + done, data.size() - done, done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error(ErrorMessage("Cannot read", path, error));
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+  data.resize(done);
+}
+
+static void WriteWholeFile(const std::string& path,
+                           const std::vector<uint8_t>& data) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error(ErrorMessage("Cannot open", path, errno));
+  }
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = pwrite(fd, data.data() + done, data.size() - done, done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      int error = n < 0 ? errno : EIO;
+      close(fd);
+      throw std::runtime_error(ErrorMessage("Cannot write", path, error));
+    }
+    done += n;
+  }
+  if (close(fd) != 0) {
+    throw std::runtime_error(ErrorMessage("Cannot close", path, errno));
+  }
+}
+
+void AsyncFileIO::ReadFiles(
+    const std::vector<std::string>& paths,
+    const std::function<bool(size_t, std::vector<uint8_t>&)>& done) {
+  if (ring_) {
+    size_t next_path = 0;
+    RunRing(
+        [&](Request& request) {
+          if (next_path == paths.size()) {
+            return false;
+          }
+          request.index = next_path;
+          request.path = paths[next_path++];
+          return true;
+        },
+        [&](Request& request) { return done(request.index, request.data); });
+    return;
+  }
+
+  typedef std::pair<size_t, std::vector<uint8_t>> File;
+  BoundedQueue<File> files(queue_depth_);
+  std::atomic<size_t> next_path(0);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  unsigned thread_count = std::min(
+      {queue_depth_, kMaxFallbackThreads, (unsigned)std::max<size_t>(
+                                              1, paths.size())});
+  std::atomic<unsigned> threads_left(thread_count);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&]() {
+      try {
+        for (size_t i = next_path++; i < paths.size(); i = next_path++) {
+          File file(i, std::vector<uint8_t>());
+          ReadWholeFile(paths[i], file.second);
+          if (!files.Push(std::move(file))) {
+            break;
+          }
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        files.Close();
+      }
+      if (--threads_left == 0) {
+        files.Close();
+      }
+    });
+  }
+  try {
+    File file;
+    while (files.Pop(file)) {
+      if (!done(file.first, file.second)) {
+        break;
+      }
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+  }
+  files.Close();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void AsyncFileIO::WriteFiles(
+    const std::function<bool(std::string&, std::vector<uint8_t>&)>& next) {
+  if (ring_) {
+    RunRing(
+        [&](Request& request) {
+          request.write = true;
+          return next(request.path, request.data);
+        },
+        [](Request&) { return true; });
+    return;
+  }
+
+  typedef std::pair<std::string, std::vector<uint8_t>> File;
+  BoundedQueue<File> files(queue_depth_);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < std::min(queue_depth_, kMaxFallbackThreads); ++t) {
+    threads.emplace_back([&]() {
+      try {
+        File file;
+        while (files.Pop(file)) {
+          WriteWholeFile(file.first, file.second);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        files.Close();
+      }
+    });
+  }
+  try {
+    File file;
+    while (next(file.first, file.second)) {
+      if (!files.Push(std::move(file))) {
+        break;
+      }
+      file = File();
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+  }
+  files.Close();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
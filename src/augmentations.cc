@@ -1,35 +1,252 @@
 #include "augmentations.hpp"
 
 #include <boost/filesystem/path.hpp>
+#include <cassert>
 #include <cmath>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <opencv2/core/hal/intrin.hpp>
 
+#include "noise.hpp"
 #include "random_rotation_utilities.hpp"
 #include "utilities.hpp"
 
 using namespace cv;
 
+// Vector type holding as many T lanes as the widest enabled SIMD extension.
+template <typename T>
+struct SimdVec;
+#if CV_SIMD
+template <>
+struct SimdVec<uchar> {
+  typedef v_uint8 type;
+};
+template <>
+struct SimdVec<ushort> {
+  typedef v_uint16 type;
+};
+template <>
+struct SimdVec<float> {
+  typedef v_float32 type;
+};
+#endif
+
+/*
+  FlipRow
+
+  Writes the cn-channel pixels of one row to dst in reverse order. Full
+  vectors of pixels are deinterleaved into one register per channel, reversed
+  with a lane shuffle and interleaved back at the mirrored position.
+
+  @param const T* src -> first element of the source row
+  @param T* dst -> first element of the destination row (must not alias src)
+  @param int cols -> number of pixels in the row
+*/
+template <typename T, int cn>
+static void FlipRow(const T* src, T* dst, int cols) {
+  int j = 0;
+#if CV_SIMD
+  typedef typename SimdVec<T>::type V;
+  const int lanes = V::nlanes;
+  for (; j + lanes <= cols; j += lanes) {
+    const T* s = src + j * cn;
+    T* d = dst + (cols - j - lanes) * cn;
+    if constexpr (cn == 1) {
+      v_store(d, v_reverse(vx_load(s)));
+    } else if constexpr (cn == 3) {
+      V a, b, c;
+      v_load_deinterleave(s, a, b, c);
+      v_store_interleave(d, v_reverse(a), v_reverse(b), v_reverse(c));
+    } else {
+      V a, b, c, e;
+      v_load_deinterleave(s, a, b, c, e);
+      v_store_interleave(
+          d, v_reverse(a), v_reverse(b), v_reverse(c), v_reverse(e));
+    }
+  }
+#endif
+  for (; j < cols; ++j) {
+    for (int k = 0; k < cn; ++k) {
+      dst[(cols - j - 1) * cn + k] = src[j * cn + k];
+    }
+  }
+}
+
+/*
+  FlipRowInPlace
+
+  Reverses the cn-channel pixels of one row in place by swapping mirrored
+  vectors of pixels from both ends of the row.
+
+  @param T* row -> first element of the row
+  @param int cols -> number of pixels in the row
+*/
+template <typename T, int cn>
+static void FlipRowInPlace(T* row, int cols) {
+  int left = 0;
+  int right = cols;  // exclusive
+#if CV_SIMD
+  typedef typename SimdVec<T>::type V;
+  const int lanes = V::nlanes;
+  for (; left + lanes <= right - lanes; left += lanes, right -= lanes) {
+    T* l = row + left * cn;
+    T* r = row + (right - lanes) * cn;
+    if constexpr (cn == 1) {
+      V a = vx_load(l);
+      V b = vx_load(r);
+      v_store(l, v_reverse(b));
+      v_store(r, v_reverse(a));
+    } else if constexpr (cn == 3) {
+      V a0, a1, a2, b0, b1, b2;
+      v_load_deinterleave(l, a0, a1, a2);
+      v_load_deinterleave(r, b0, b1, b2);
+      v_store_interleave(l, v_reverse(b0), v_reverse(b1), v_reverse(b2));
+      v_store_interleave(r, v_reverse(a0), v_reverse(a1), v_reverse(a2));
+    } else {
+      V a0, a1, a2, a3, b0, b1, b2, b3;
+      v_load_deinterleave(l, a0, a1, a2, a3);
+      v_load_deinterleave(r, b0, b1, b2, b3);
+      v_store_interleave(
+          l, v_reverse(b0), v_reverse(b1), v_reverse(b2), v_reverse(b3));
+      v_store_interleave(
+          r, v_reverse(a0), v_reverse(a1), v_reverse(a2), v_reverse(a3));
+    }
+  }
+#endif
+  for (--right; left < right; ++left, --right) {
+    for (int k = 0; k < cn; ++k) {
+      std::swap(row[left * cn + k], row[right * cn + k]);
+    }
+  }
+}
+
+template <typename T, int cn>
+static void FlipRows(const Mat& src, Mat& dst) {
+  for (int i = 0; i < src.rows; ++i) {
+    if (src.data == dst.data) {
+      FlipRowInPlace<T, cn>(dst.ptr<T>(i), src.cols);
+    } else {
+      FlipRow<T, cn>(src.ptr<T>(i), dst.ptr<T>(i), src.cols);
+    }
+  }
+}
+
+template <typename T>
+static bool FlipRowsForChannels(const Mat& src, Mat& dst) {
+  switch (src.channels()) {
+    case 1:
+      FlipRows<T, 1>(src, dst);
+      return true;
+    case 3:
+      FlipRows<T, 3>(src, dst);
+      return true;
+    case 4:
+      FlipRows<T, 4>(src, dst);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Flips src into dst (same size and type, possibly the same buffer) around
+// the vertical axis. 8U, 16U and 32F images with 1, 3 or 4 channels use the
+// vector kernels; any other type falls back to copying whole pixels.
+static void FlipHorizontalInto(const Mat& src, Mat& dst) {
+  bool done = false;
+  switch (src.depth()) {
+    case CV_8U:
+      done = FlipRowsForChannels<uchar>(src, dst);
+      break;
+    case CV_16U:
+      done = FlipRowsForChannels<ushort>(src, dst);
+      break;
+    case CV_32F:
+      done = FlipRowsForChannels<float>(src, dst);
+      break;
+  }
+#if CV_SIMD
+  vx_cleanup();
+#endif
+  if (done) {
+    return;
+  }
+
+  size_t pixel_size = src.elemSize();
+  std::vector<uchar> tmp(pixel_size);
+  for (int i = 0; i < src.rows; ++i) {
+    const uchar* s = src.ptr(i);
+    uchar* d = dst.ptr(i);
+    if (s == d) {
+      for (int l = 0, r = src.cols - 1; l < r; ++l, --r) {
+        std::memcpy(tmp.data(), d + l * pixel_size, pixel_size);
+        std::memcpy(d + l * pixel_size, d + r * pixel_size, pixel_size);
+        std::memcpy(d + r * pixel_size, tmp.data(), pixel_size);
+      }
+    } else {
+      for (int j = 0; j < src.cols; ++j) {
+        std::memcpy(d + (src.cols - j - 1) * pixel_size,
+                    s + j * pixel_size,
+                    pixel_size);
+      }
+    }
+  }
+}
+
+// Flips src into dst (same size and type, possibly the same buffer) around
+// the horizontal axis with one memcpy, or swap, per row.
+static void FlipVerticalInto(const Mat& src, Mat& dst) {
+  size_t row_size = src.cols * src.elemSize();
+  int num_rows = src.rows;
+  if (src.data == dst.data) {
+    for (int i = 0; i < num_rows / 2; ++i) {
+      std::swap_ranges(
+          dst.ptr(i), dst.ptr(i) + row_size, dst.ptr(num_rows - i - 1));
+    }
+  } else {
+    for (int i = 0; i < num_rows; ++i) {
+      std::memcpy(dst.ptr(num_rows - i - 1), src.ptr(i), row_size);
+    }
+  }
+}
+
 /*
   HorizontalFlip
 
   Flips an image horizontally
 
-  @param const cv::Mat& img -> the original image.
+  @param const cv::Mat& img -> the original image, of any type.
 
   @return cv::Mat -> adjusted image
 */
 Mat HorizontalFlip(const Mat& img) {
-  int num_cols = img.cols;
-  int num_rows = img.rows;
-  Mat dst(num_rows, num_cols, img.type());
+  Mat dst(img.rows, img.cols, img.type());
+  FlipHorizontalInto(img, dst);
+  return dst;
+}
 
-  for (int i = 0; i < num_rows; ++i) {
-    for (int j = 0; j < num_cols; ++j) {
-      dst.at<Vec3b>(i, j) = img.at<Vec3b>(i, num_cols - j - 1);
-    }
-  }
+/*
+  HorizontalFlipInPlace
 
-  return dst;
+  Flips an image horizontally without allocating a new image
+
+  @param cv::Mat& img -> the image to flip
+*/
+void HorizontalFlipInPlace(Mat& img) { FlipHorizontalInto(img, img); }
+
+/*
+  HorizontalFlipTo
+
+  Flips an image horizontally into dst, reusing its buffer when it already
+  has the right size and type
+
+  @param const cv::Mat& img -> the original image, of any type.
+  @param cv::Mat& dst -> the flipped image, may be img
+*/
+void HorizontalFlipTo(const Mat& img, Mat& dst) {
+  dst.create(img.size(), img.type());
+  FlipHorizontalInto(img, dst);
 }
 
 /*
@@ -44,8 +261,6 @@ Mat HorizontalFlip(const Mat& img) {
   @return cv::Mat -> adjusted image
 */
 Mat RandomHorizontalFlip(const Mat& img, double hflip_ratio, RNG& rng) {
-  assert(img.type() == CV_8UC1 || img.type() == CV_8UC3);
-
   // Random horizontal flip
   Mat dst;
   double flip_prob = rng.uniform(0.0, 1.0);
@@ -57,27 +272,63 @@ Mat RandomHorizontalFlip(const Mat& img, double hflip_ratio, RNG& rng) {
   return dst;
 }
 
+/*
+  RandomHorizontalFlip
+
+  same as RandomHorizontalFlip, but writes into a caller provided buffer.
+  When the image is not flipped it is copied into dst unchanged.
+
+  @param cv::Mat& dst -> output image; reused if it already has the size and
+                         type of img
+*/
+void RandomHorizontalFlip(const Mat& img,
+                          Mat& dst,
+                          double hflip_ratio,
+                          RNG& rng) {
+  double flip_prob = rng.uniform(0.0, 1.0);
+  if (hflip_ratio > flip_prob) {
+    HorizontalFlipTo(img, dst);
+  } else if (dst.data != img.data) {
+    img.copyTo(dst);
+  }
+}
+
 /*
   VerticalFlip
 
   Flips an image vertically
 
-  @param const cv::Mat& img -> the original image.
+  @param const cv::Mat& img -> the original image, of any type.
 
   @return cv::Mat -> adjusted image
 */
 Mat VerticalFlip(const Mat& img) {
-  int num_cols = img.cols;
-  int num_rows = img.rows;
-  Mat dst(num_rows, num_cols, img.type());
+  Mat dst(img.rows, img.cols, img.type());
+  FlipVerticalInto(img, dst);
+  return dst;
+}
 
-  for (int j = 0; j < num_cols; ++j) {
-    for (int i = 0; i < num_rows; ++i) {
-      dst.at<Vec3b>(i, j) = img.at<Vec3b>(num_rows - i - 1, j);
-    }
-  }
+/*
+  VerticalFlipInPlace
 
-  return dst;
+  Flips an image vertically without allocating a new image
+
+  @param cv::Mat& img -> the image to flip
+*/
+void VerticalFlipInPlace(Mat& img) { FlipVerticalInto(img, img); }
+
+/*
+  VerticalFlipTo
+
+  Flips an image vertically into dst, reusing its buffer when it already has
+  the right size and type
+
+  @param const cv::Mat& img -> the original image, of any type.
+  @param cv::Mat& dst -> the flipped image, may be img
+*/
+void VerticalFlipTo(const Mat& img, Mat& dst) {
+  dst.create(img.size(), img.type());
+  FlipVerticalInto(img, dst);
 }
 
 /*
@@ -92,8 +343,6 @@ Mat VerticalFlip(const Mat& img) {
   @return cv::Mat -> adjusted image
 */
 Mat RandomVerticalFlip(const Mat& img, double vflip_ratio, RNG& rng) {
-  assert(img.type() == CV_8UC1 || img.type() == CV_8UC3);
-
   // Random vertical flip
   Mat dst;
   double flip_prob = rng.uniform(0.0, 1.0);
@@ -105,6 +354,41 @@ Mat RandomVerticalFlip(const Mat& img, double vflip_ratio, RNG& rng) {
   return dst;
 }
 
+/*
+  RandomVerticalFlip
+
+  same as RandomVerticalFlip, but writes into a caller provided buffer.
+  When the image is not flipped it is copied into dst unchanged.
+
+  @param cv::Mat& dst -> output image; reused if it already has the size and
+                         type of img
+*/
+void RandomVerticalFlip(const Mat& img,
+                        Mat& dst,
+                        double vflip_ratio,
+                        RNG& rng) {
+  double flip_prob = rng.uniform(0.0, 1.0);
+  if (vflip_ratio > flip_prob) {
+    VerticalFlipTo(img, dst);
+  } else if (dst.data != img.data) {
+    img.copyTo(dst);
+  }
+}
+
+/*
+  RandomRotateImage
+
+  Rotates an image in 3D by random yaw, pitch and roll angles drawn from
+  gaussians and clamped to [-60, 60] degrees
+
+  @param const cv::Mat& src -> the original image
+  @param double yaw_sigma, pitch_sigma, roll_sigma -> angle standard deviations
+  @param RNG& rng -> opencv RNG object for generating the angles
+  @param RotationMapCache* cache -> optional cache of remap tables; when set,
+  the angles are rounded to the cache's angle step
+
+  @return Mat -> the rotated image
+*/
 Mat RandomRotateImage(const Mat& src,
                       double yaw_sigma,
                       double pitch_sigma,
@@ -114,7 +398,46 @@ Mat RandomRotateImage(const Mat& src,
                       double Z,
                       int interpolation,
                       int border_mode,
-                      const Scalar& border_color) {
+                      const Scalar& border_color,
+                      RotationMapCache* cache) {
+  Mat rot_img;
+  RandomRotateImage(src,
+                    rot_img,
+                    yaw_sigma,
+                    pitch_sigma,
+                    roll_sigma,
+                    rng,
+                    area,
+                    Z,
+                    interpolation,
+                    border_mode,
+                    border_color,
+                    cache);
+  return rot_img;
+}
+
+/*
+  RandomRotateImage
+
+  same as RandomRotateImage, but writes into a caller provided buffer. The
+  size of the result depends on the angles, so dst is only reused when it
+  already has the size of the rotated image.
+
+  @param cv::Mat& dst -> output image, must not be src
+*/
+void RandomRotateImage(const Mat& src,
+                       Mat& dst,
+                       double yaw_sigma,
+                       double pitch_sigma,
+                       double roll_sigma,
+                       RNG& rng,
+                       const Rect& area,
+                       double Z,
+                       int interpolation,
+                       int border_mode,
+                       const Scalar& border_color,
+                       RotationMapCache* cache) {
+  assert(dst.data != src.data);
   double yaw =
       std::min<double>(60, std::max<double>(-60, rng.gaussian(yaw_sigma)));
   double pitch =
@@ -127,9 +450,21 @@ Mat RandomRotateImage(const Mat& src,
                   : ExpandRectForRotate(area);
   rect = TruncateRectKeepCenter(rect, src.size());
 
-  Mat rot_img;
-  RotateImage(src(rect).clone(),
-              rot_img,
+  if (cache != nullptr) {
+    RotateImage(src(rect),
+                dst,
+                yaw,
+                pitch,
+                roll,
+                *cache,
+                Z,
+                interpolation,
+                border_mode,
+                border_color);
+    return;
+  }
+  RotateImage(src(rect),
+              dst,
               yaw,
               pitch,
               roll,
@@ -137,15 +472,6 @@ Mat RandomRotateImage(const Mat& src,
               interpolation,
               border_mode,
               border_color);
-  return rot_img;
-
-  Rect dst_area((rot_img.cols - area.width) / 2,
-                (rot_img.rows - area.height) / 2,
-                area.width,
-                area.height);
-  dst_area = TruncateRectKeepCenter(dst_area, rot_img.size());
-  Mat dst = rot_img(dst_area).clone();
-  return dst;
 }
 
 /*
@@ -161,24 +487,57 @@ Mat RandomRotateImage(const Mat& src,
   @return Mat -> adjusted image
 */
 Mat Slide(const Mat& img, int x_shift, int y_shift) {
-  assert(img.type() == CV_8UC1 || img.type() == CV_8UC3);
+  Mat to_return;
+  Slide(img, to_return, x_shift, y_shift);
+  return to_return;
+}
 
+/*
+  Slide
+
+  translates an image into a caller provided buffer. A cyclic shift moves at
+  most four rectangular blocks, so the image is copied block by block with one
+  memcpy per block row instead of one modulo per pixel. Works for any type and
+  channel count.
+
+  @param const cv::Mat& img -> the original image
+  @param cv::Mat& dst -> output image; reused if it already has the size and
+                         type of img
+  @param int x_shift -> pos or neg integer value to shift by in x direction
+  @param int y_shift -> pos or neg integer value to shift by in y direction
+*/
+void Slide(const Mat& img, Mat& dst, int x_shift, int y_shift) {
   int num_cols = img.cols;
   int num_rows = img.rows;
 
-  while (x_shift < 0) x_shift += num_cols;
-  while (y_shift < 0) y_shift += num_rows;
-
-  Mat to_return(num_rows, num_cols, CV_8UC3);
+  x_shift = ((x_shift % num_cols) + num_cols) % num_cols;
+  y_shift = ((y_shift % num_rows) + num_rows) % num_rows;
 
-  for (int i = 0; i < num_rows; i++) {
-    for (int j = 0; j < num_cols; j++) {
-      to_return.at<Vec3b>((i + y_shift) % num_rows, (j + x_shift) % num_cols) =
-          img.at<Vec3b>(i, j);
+  // Blocks cannot be moved in place
+  Mat src = img;
+  if (dst.data == img.data) {
+    src = img.clone();
+  }
+  dst.create(num_rows, num_cols, img.type());
+
+  // Column/row spans of the block that stays in view ([0]) and of the block
+  // that wraps around ([1]).
+  int widths[2] = {num_cols - x_shift, x_shift};
+  int src_x[2] = {0, num_cols - x_shift};
+  int dst_x[2] = {x_shift, 0};
+  int heights[2] = {num_rows - y_shift, y_shift};
+  int src_y[2] = {0, num_rows - y_shift};
+  int dst_y[2] = {y_shift, 0};
+
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < 2; j++) {
+      if (widths[j] == 0 || heights[i] == 0) {
+        continue;
+      }
+      src(Rect(src_x[j], src_y[i], widths[j], heights[i]))
+          .copyTo(dst(Rect(dst_x[j], dst_y[i], widths[j], heights[i])));
     }
   }
-
-  return to_return;
 }
 
 /*
@@ -213,6 +572,59 @@ Mat RandomSlide(const Mat& img, double slide_ratio, RNG& rng) {
   return to_return;
 }
 
+/*
+  RandomSlide
+
+  same as RandomSlide, but writes into a caller provided buffer. When the
+  image is not slid it is copied into dst unchanged.
+
+  @param cv::Mat& dst -> output image; reused if it already has the size and
+                         type of img
+*/
+void RandomSlide(const Mat& img, Mat& dst, double slide_ratio, RNG& rng) {
+  double slide_prob = rng.uniform(0.0, 1.0);
+
+  if (slide_ratio > slide_prob) {
+    int num_cols = img.cols;
+    int num_rows = img.rows;
+    int x_slide = rng.uniform(-1 * num_cols, num_cols);
+    int y_slide = rng.uniform(-1 * num_rows, num_rows);
+    Slide(img, dst, x_slide, y_slide);
+  } else if (dst.data != img.data) {
+    img.copyTo(dst);
+  }
+}
+
+/*
+  DeformOffsets
+
+  computes the per-row source offsets of a deformation. Both offsets only
+  depend on the row index, so they are evaluated once per row instead of once
+  per pixel.
+
+  @param int num_rows -> number of rows of the image
+  @param int x_wave_amp, x_wave_freq -> horizontal wave (sine over the rows)
+  @param int y_wave_amp, y_wave_freq -> vertical wave (cosine over the rows)
+  @param std::vector<int>& x_offsets -> column offset of each row
+  @param std::vector<int>& y_offsets -> row offset of each row
+*/
+void DeformOffsets(int num_rows,
+                   int x_wave_amp,
+                   int x_wave_freq,
+                   int y_wave_amp,
+                   int y_wave_freq,
+                   std::vector<int>& x_offsets,
+                   std::vector<int>& y_offsets) {
+  x_offsets.resize(num_rows);
+  y_offsets.resize(num_rows);
+  for (int i = 0; i < num_rows; i++) {
+    x_offsets[i] =
+        std::round(x_wave_amp * std::sin((2 * M_PI * i) / x_wave_freq));
+    y_offsets[i] =
+        std::round(y_wave_amp * std::cos((2 * M_PI * i) / y_wave_freq));
+  }
+}
+
 /*
   RandomDeform
 
@@ -235,9 +647,31 @@ Mat RandomDeform(const Mat& img,
                  std::pair<double, double> x_freq,
                  std::pair<double, double> y_freq,
                  RNG& rng) {
+  Mat to_return;
+  RandomDeform(img, to_return, x_amp, y_amp, x_freq, y_freq, rng);
+  return to_return;
+}
+
+/*
+  RandomDeform
+
+  same as RandomDeform, but writes into a caller provided buffer. Every row of
+  the result is a shifted copy of one source row, so each row is produced with
+  a single memcpy; pixels whose source falls outside the image are black.
+  Works for any type and channel count.
+
+  @param cv::Mat& dst -> output image; reused if it already has the size and
+                         type of img
+*/
+void RandomDeform(const Mat& img,
+                  Mat& dst,
+                  std::pair<double, double> x_amp,
+                  std::pair<double, double> y_amp,
+                  std::pair<double, double> x_freq,
+                  std::pair<double, double> y_freq,
+                  RNG& rng) {
   int num_cols = img.cols;
   int num_rows = img.rows;
-  Mat to_return(num_rows, num_cols, CV_8UC3, Scalar(0, 0, 0));
 
   int x_wave_amp = rng.uniform(x_amp.first * num_rows, x_amp.second * num_rows);
   int x_wave_freq =
@@ -246,26 +680,51 @@ Mat RandomDeform(const Mat& img,
   int y_wave_freq =
       rng.uniform(y_freq.first * num_cols, y_freq.second * num_cols);
 
+  static thread_local std::vector<int> x_offsets, y_offsets;
+  DeformOffsets(num_rows,
+                x_wave_amp,
+                x_wave_freq,
+                y_wave_amp,
+                y_wave_freq,
+                x_offsets,
+                y_offsets);
+
+  Mat src = img;
+  if (dst.data == img.data) {
+    src = img.clone();
+  }
+  dst.create(num_rows, num_cols, img.type());
+
+  size_t pixel_size = img.elemSize();
   for (int i = 0; i < num_rows; i++) {
-    for (int j = 0; j < num_cols; j++) {
-      int x_offset =
-          std::round(x_wave_amp * std::sin((2 * M_PI * i) / x_wave_freq));
-      int y_offset =
-          std::round(y_wave_amp * std::cos((2 * M_PI * i) / y_wave_freq));
-      if (i + y_offset < num_rows && j + x_offset < num_cols) {
-        to_return.at<Vec3b>(i, j) =
-            img.at<Vec3b>((i + y_offset) % num_rows, (j + x_offset) % num_cols);
-      }
+    uchar* d = dst.ptr(i);
+    int src_row = i + y_offsets[i];
+    int x_offset = x_offsets[i];
+    // destination columns [first, last) have a source pixel
+    int first = std::max(0, -x_offset);
+    int last = std::min(num_cols, num_cols - x_offset);
+    if (src_row < 0 || src_row >= num_rows || first >= last) {
+      std::memset(d, 0, num_cols * pixel_size);
+      continue;
     }
+    const uchar* s = src.ptr(src_row);
+    std::memset(d, 0, first * pixel_size);
+    std::memcpy(d + first * pixel_size,
+                s + (first + x_offset) * pixel_size,
+                (last - first) * pixel_size);
+    std::memset(d + last * pixel_size, 0, (num_cols - last) * pixel_size);
   }
-
-  return to_return;
 }
 
 /*
   Blur
 
-  Blurs the source image according to a kernel
+  Blurs the source image according to a kernel. Kernels whose coefficients
+  are all equal and sum to one are run as a box filter, whose cost does not
+  depend on the kernel size, and other rank one kernels (found through their
+  SVD) as two 1D passes. Everything else goes through filter2D. The box
+  filter rounds integer outputs in fixed point, so where a pixel lands on a
+  half it may differ from filter2D by one.
 
   @param const Mat& src -> the original image
   @param const Mat& kernel -> the kernel used to blur the source
@@ -284,14 +743,144 @@ Mat Blur(const Mat& src,
          double delta,
          int depth) {
   Mat dst;
+  Blur(src, dst, kernel, anchor, delta, depth);
+  return dst;
+}
+
+/*
+  Blur
+
+  same as Blur, but writes into a caller provided buffer.
+
+  @param cv::Mat& dst -> output image; reused if it already has the size and
+                         type of the result
+*/
+void Blur(const Mat& src,
+          Mat& dst,
+          const Mat& kernel,
+          const Point& anchor,
+          double delta,
+          int depth) {
+  if (kernel.total() <= 1 || kernel.channels() != 1) {
+    filter2D(src, dst, depth, kernel, anchor, delta, BORDER_DEFAULT);
+    return;
+  }
+
+  Mat coeffs;
+  kernel.convertTo(coeffs, CV_64F);
+  double min_coeff, max_coeff;
+  minMaxLoc(coeffs, &min_coeff, &max_coeff);
+  double sum = cv::sum(coeffs)[0];
+  if (delta == 0 && max_coeff - min_coeff <= 1e-7 * std::abs(max_coeff) &&
+      std::abs(sum - 1) <= 1e-5) {
+    boxFilter(src, dst, depth, kernel.size(), anchor, true, BORDER_DEFAULT);
+    return;
+  }
+
+  if (kernel.rows > 1 && kernel.cols > 1) {
+    Mat w, u, vt;
+    SVD::compute(coeffs, w, u, vt);
+    double s0 = w.at<double>(0);
+    if (s0 > 0 && w.at<double>(1) <= 1e-6 * s0) {
+      // kernel = (sqrt(s0) * u0) * (sqrt(s0) * v0)^T
+      Mat kernel_x, kernel_y;
+      Mat(vt.row(0).t() * std::sqrt(s0)).convertTo(kernel_x, CV_32F);
+      Mat(u.col(0) * std::sqrt(s0)).convertTo(kernel_y, CV_32F);
+      sepFilter2D(
+          src, dst, depth, kernel_x, kernel_y, anchor, delta, BORDER_DEFAULT);
+      return;
+    }
+  }
+
   filter2D(src, dst, depth, kernel, anchor, delta, BORDER_DEFAULT);
+}
+
+// Normalized 1D Gaussian kernels shared by every RandomGaussianBlur call,
+// keyed by (size, sigma in kGaussianSigmaStep steps).
+static const double kGaussianSigmaStep = 0.05;
+
+static Mat CachedGaussianKernel(int ksize, int sigma_steps) {
+  static std::mutex mutex;
+  static std::map<std::pair<int, int>, Mat> kernels;
+  std::lock_guard<std::mutex> lock(mutex);
+  Mat& kernel = kernels[std::make_pair(ksize, sigma_steps)];
+  if (kernel.empty()) {
+    kernel = getGaussianKernel(ksize, sigma_steps * kGaussianSigmaStep, CV_32F);
+  }
+  return kernel;
+}
+
+/*
+  RandomGaussianBlur
+
+  Blurs the source image with a Gaussian of random standard deviation, run as
+  two 1D passes. Sigma is rounded to a multiple of 0.05 so its kernels can be
+  cached, and the kernel covers three sigmas on each side.
+
+  @param const Mat& src -> the original image
+  @param std::pair<double, double> sigma -> range of the standard deviation
+  in pixels
+  @param RNG& rng -> opencv RNG object for generating a random number.
+
+  @return Mat -> the blurred image
+*/
+
+Mat RandomGaussianBlur(const Mat& src,
+                       std::pair<double, double> sigma,
+                       RNG& rng) {
+  Mat dst;
+  RandomGaussianBlur(src, dst, sigma, rng);
+  return dst;
+}
+
+void RandomGaussianBlur(const Mat& src,
+                        Mat& dst,
+                        std::pair<double, double> sigma,
+                        RNG& rng) {
+  double sampled_sigma = rng.uniform(sigma.first, sigma.second);
+  int sigma_steps = std::max(1, cvRound(sampled_sigma / kGaussianSigmaStep));
+  int ksize = 2 * cvCeil(3 * sigma_steps * kGaussianSigmaStep) + 1;
+  Mat kernel = CachedGaussianKernel(ksize, sigma_steps);
+  sepFilter2D(src, dst, -1, kernel, kernel, Point(-1, -1), 0, BORDER_DEFAULT);
+}
+
+/*
+  RandomBoxBlur
+
+  Blurs the source image with a normalized box filter of random size. The
+  filter keeps running sums, so its cost does not grow with the size.
+
+  @param const Mat& src -> the original image
+  @param std::pair<int, int> ksize -> inclusive range of the kernel side
+  @param RNG& rng -> opencv RNG object for generating a random number.
+
+  @return Mat -> the blurred image
+*/
+
+Mat RandomBoxBlur(const Mat& src, std::pair<int, int> ksize, RNG& rng) {
+  Mat dst;
+  RandomBoxBlur(src, dst, ksize, rng);
   return dst;
 }
 
+void RandomBoxBlur(const Mat& src,
+                   Mat& dst,
+                   std::pair<int, int> ksize,
+                   RNG& rng) {
+  int side = rng.uniform(ksize.first, ksize.second + 1);
+  boxFilter(
+      src, dst, -1, Size(side, side), Point(-1, -1), true, BORDER_DEFAULT);
+}
+
 /*
   RandomNoise
 
-  Adds random noise to the source image according to a gaussian distribution
+  Adds random noise to the source image according to a gaussian distribution.
+  Every row gets a whole row of samples from a counter-based generator seeded
+  from rng, which are scaled and shifted per channel and then added to the
+  pixels with saturation by a single vectorized cv::add. Works for any depth
+  and number of channels; channels without a mean and standard deviation are
+  left untouched.
 
   @param const Mat& src -> the original image
   @param const std::vector<double>& mean -> the mean of the distribution for
@@ -307,19 +896,71 @@ Mat RandomNoise(const Mat& src,
                 const std::vector<double>& mean,
                 const std::vector<double>& std_dev,
                 RNG& rng) {
-  Mat dst = src.clone();
-  int num_cols = src.cols;
+  Mat dst;
+  RandomNoise(src, dst, mean, std_dev, rng);
+  return dst;
+}
+
+void RandomNoise(const Mat& src,
+                 Mat& dst,
+                 const std::vector<double>& mean,
+                 const std::vector<double>& std_dev,
+                 RNG& rng) {
+  assert(mean.size() == std_dev.size());
+  uint64_t seed = rng.next();
+  seed = (seed << 32) | rng.next();
+  // per-thread scratch, so steady-state calls do not allocate
+  static thread_local GaussianGenerator gaussian(0);
+  static thread_local std::vector<float> scale, shift, noise;
+  gaussian.Reseed(seed);
+
   int num_rows = src.rows;
+  int cn = src.channels();
+  int row_size = src.cols * cn;
+  // per-element scale and shift, so the row transform is one flat loop
+  scale.resize(row_size);
+  shift.resize(row_size);
+  noise.resize(row_size);
+  for (int j = 0; j < row_size; ++j) {
+    size_t k = j % cn;
+    scale[j] = k < std_dev.size() ? (float)std_dev[k] : 0.f;
+    shift[j] = k < mean.size() ? (float)mean[k] : 0.f;
+  }
 
+  dst.create(src.size(), src.type());
+  Mat noise_row(1, row_size, CV_32F, noise.data());
   for (int i = 0; i < num_rows; ++i) {
-    for (int j = 0; j < num_cols; ++j) {
-      for (int k = 0; k < mean.size(); ++k) {
-        double noise = rng.gaussian(std_dev.at(k)) + mean.at(k);
-        noise = std::max<double>(0, noise + dst.at<Vec3b>(i, j)[k]);
-        noise = std::min<double>(255, noise);
-        dst.at<Vec3b>(i, j)[k] = noise;
-      }
+    gaussian.Fill(i, noise.data(), row_size);
+    for (int j = 0; j < row_size; ++j) {
+      noise[j] = noise[j] * scale[j] + shift[j];
     }
+    add(src.row(i).reshape(1),
+        noise_row,
+        dst.row(i).reshape(1),
+        noArray(),
+        src.depth());
   }
+}
+
+/*
+  RandomNoise
+
+  Adds pregenerated noise from a bank to the source image. Much cheaper than
+  generating fresh samples, at the price of noise that repeats across images.
+
+  @param const Mat& src -> the original image
+  @param const NoiseBank& bank -> noise tiles with the channels of src
+  @param RNG& rng -> opencv RNG object for generating a random number.
+
+  @return Mat -> the image with noise
+*/
+
+Mat RandomNoise(const Mat& src, const NoiseBank& bank, RNG& rng) {
+  Mat dst;
+  bank.Add(src, dst, rng);
   return dst;
 }
+
+void RandomNoise(const Mat& src, Mat& dst, const NoiseBank& bank, RNG& rng) {
+  bank.Add(src, dst, rng);
+}
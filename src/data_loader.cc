@@ -1,18 +1,37 @@
 #include "data_loader.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+// Thrown by the streaming sink to unwind the pipeline once the consumer
+// stopped the stream.
+struct StreamStopped {};
+
+static uint64_t MatBytes(const Mat& img) {
+  return img.total() * img.elemSize();
+}
+
+DataLoader::DataLoader() {}
 
 DataLoader::DataLoader(const std::string& path) { directory_path_ = path; }
 
+DataLoader::~DataLoader() {
+  StopStreaming();
+  StopStatsDump();
+}
+
 void DataLoader::LoadInMemory() {
-  for (auto image_path :
-       boost::make_iterator_range(directory_iterator(directory_path_), {})) {
-    std::string filename = image_path.path().string();
-    size_t pos = filename.find_last_of('/');
-    if (filename.at(pos + 1) == '.') {
-      continue;
-    }
-    images_.push_back(imread(filename));
+  std::vector<path> files = ListImageFiles();
+  for (size_t i = 0; i < files.size(); ++i) {
+    images_.push_back(DecodeImage(i, files[i]));
   }
   in_memory_ = true;
 }
@@ -22,15 +41,614 @@ Mat DataLoader::LoadImage(const std::string& path) {
   return img;
 }
 
-void DataLoader::AddAugmentation(std::function<Mat(const Mat&)> aug) {
+/*
+  DecodeImage
+
+  Decodes an image file, going through the image cache when it is enabled, or
+  returns the image from the packed dataset in use. PPM files are memory
+  mapped and decoded by ReadPpm. Members of tar shards, and other files when a
+  decode size is set, are read whole and decoded from memory with
+  DecodeBuffer. Images coming from the cache or the packed dataset are shared
+  with it and must not be modified.
+
+  @param size_t index -> index of the image in ListImageFiles
+  @param const path& file -> the image file
+
+  @return Mat -> the decoded image
+*/
+Mat DataLoader::DecodeImage(size_t index, const path& file) const {
+  if (packed_) {
+    return packed_->Image(index);
+  }
+  auto load = [this, index, &file]() {
+    if (!tar_shards_ && file.extension() == ".ppm") {
+      Mat img = ReadPpm(file.string());
+      if (!img.empty()) {
+        return img;
+      }
+    }
+    if (!tar_shards_ && decode_size_.empty()) {
+      return imread(file.string());
+    }
+    thread_local std::vector<uint8_t> data;
+    if (tar_shards_) {
+      tar_shards_->Read(index, data);
+    } else {
+      // one read of the whole file, into a buffer kept across images
+      std::ifstream in(file.string(), std::ios::binary | std::ios::ate);
+      data.resize(in ? (size_t)in.tellg() : 0);
+      in.seekg(0);
+      in.read((char*)data.data(), data.size());
+    }
+    return DecodeBuffer(data);
+  };
+  auto timed_load = [this, index, &file, &load]() {
+    TraceSpan span(tracer_.get(), "stage", "decode", index);
+    if (!stats_) {
+      return load();
+    }
+    OpTimer timer(&stats_->decode);
+    Mat img = load();
+    timer.Stop();
+    timer.Record(
+        tar_shards_ ? tar_shards_->Member(index).size : file_size(file),
+        MatBytes(img));
+    return img;
+  };
+  if (!image_cache_) {
+    return timed_load();
+  }
+  return image_cache_->GetOrLoad(file.string(), timed_load);
+}
+
+/*
+  DecodeBuffer
+
+  Decodes an encoded image held in memory, PPMs with DecodePpm and the other
+  formats with imdecode. With a decode size set, probes the header first and
+  lets the JPEG decoder skip the finest DCT scales when a 1/2, 1/4 or 1/8
+  size image still covers the decode size.
+
+  @param const std::vector<uint8_t>& data -> the encoded image
+
+  @return Mat -> the decoded image, empty if it could not be decoded
+*/
+Mat DataLoader::DecodeBuffer(const std::vector<uint8_t>& data) const {
+  if (data.empty()) {
+    return Mat();
+  }
+  Mat img = DecodePpm(data.data(), data.size());
+  if (!img.empty()) {
+    return img;
+  }
+  int flags = IMREAD_COLOR;
+  ImageHeader header;
+  if (!decode_size_.empty() &&
+      ProbeImageHeader(data.data(), data.size(), header)) {
+    flags = ReducedDecodeFlag(header, decode_size_);
+  }
+  return imdecode(data, flags);
+}
+
+/*
+  ListImageFiles
+
+  Lists the files of the input directory and its subdirectories in directory
+  iteration order, skipping hidden files and directories. Every load and save
+  path walks this list so that image i always refers to the same file; images
+  from subdirectories are saved under the same subdirectories, so files of
+  the same name in different ones stay apart. With a packed dataset or tar
+  shards in use, lists their images instead, as pack_path/name or
+  shard_path/name.
+
+  @return std::vector<path> -> the image files to process
+*/
+std::vector<path> DataLoader::ListImageFiles() const {
+  std::vector<path> files;
+  if (packed_) {
+    for (size_t i = 0; i < packed_->Size(); ++i) {
+      files.push_back(path(packed_path_) / packed_->Name(i));
+    }
+    return files;
+  }
+  if (tar_shards_) {
+    for (size_t i = 0; i < tar_shards_->Size(); ++i) {
+      const TarMember& member = tar_shards_->Member(i);
+      files.push_back(path(tar_shards_->ShardPath(member.shard)) / member.name);
+    }
+    return files;
+  }
+  for (recursive_directory_iterator it(directory_path_), end; it != end;
+       ++it) {
+    std::string filename = it->path().string();
+    size_t pos = filename.find_last_of('/');
+    if (filename.at(pos + 1) == '.') {
+      it.disable_recursion_pending();
+      continue;
+    }
+    if (!is_directory(it->status())) {
+      files.push_back(it->path());
+    }
+  }
+  return files;
+}
+
+/*
+  OutputName
+
+  Names image i of ListImageFiles when saving it: its path below the input
+  directory, or its name in the packed dataset or tar shards, with the
+  extension of file.
+
+  @param size_t i -> index of the image in ListImageFiles
+  @param const path& file -> the image, possibly with its extension replaced
+
+  @return std::string -> the relative name to save the image under
+*/
+std::string DataLoader::OutputName(size_t i, const path& file) const {
+  if (packed_ || tar_shards_) {
+    path name = packed_ ? packed_->Name(i) : tar_shards_->Member(i).name;
+    return name.replace_extension(file.extension()).string();
+  }
+  // ListImageFiles builds every path by appending to directory_path_
+  std::string filename = file.string();
+  size_t pos = directory_path_.size();
+  while (pos < filename.size() && filename[pos] == '/') {
+    ++pos;
+  }
+  return filename.substr(pos);
+}
+
+std::string DataLoader::OutputPath(const std::string& save_path,
+                                   size_t i,
+                                   const path& file) const {
+  path output = path(save_path) / OutputName(i, file);
+  if (output.parent_path() != path(save_path)) {
+    create_directories(output.parent_path());
+  }
+  return output.string();
+}
+
+void DataLoader::AddAugmentation(std::function<Mat(const Mat&)> aug,
+                                 const std::string& name) {
   augmentations_.push_back(aug);
+  into_augmentations_.push_back(nullptr);
+  AddAugmentationName(name);
+}
+
+/*
+  AddAugmentation
+
+  Adds an augmentation that draws its randomness from the RNG it is given.
+  Every call gets a fresh RNG derived from the seed, the epoch, the index of
+  the image and the position of the augmentation, so results are the same
+  whatever the number of threads and the order they process images in.
+
+  @param std::function<Mat(const Mat&, RNG&)> aug -> the augmentation
+  @param const std::string& name -> name of the augmentation in GetStats
+*/
+void DataLoader::AddAugmentation(std::function<Mat(const Mat&, RNG&)> aug,
+                                 const std::string& name) {
+  augmentations_.push_back([aug](const Mat& img) {
+    RNG rng = StreamRng(CurrentStream());
+    return aug(img, rng);
+  });
+  into_augmentations_.push_back(nullptr);
+  AddAugmentationName(name);
+}
+
+/*
+  AddAugmentation
+
+  Adds an augmentation that writes its result into a caller provided image,
+  seeded like the augmentations returning a Mat. The loader runs chains of
+  these through per-worker ping-pong buffers, so they do not allocate an image
+  per call once the buffers have grown to the largest image. dst never
+  aliases the input.
+
+  @param std::function<void(const Mat&, Mat&, RNG&)> aug -> the augmentation
+  @param const std::string& name -> name of the augmentation in GetStats
+*/
+void DataLoader::AddAugmentation(
+    std::function<void(const Mat&, Mat&, RNG&)> aug, const std::string& name) {
+  augmentations_.push_back([aug](const Mat& img) {
+    RNG rng = StreamRng(CurrentStream());
+    Mat dst;
+    aug(img, dst, rng);
+    return dst;
+  });
+  into_augmentations_.push_back([aug](const Mat& img, Mat& dst) {
+    RNG rng = StreamRng(CurrentStream());
+    aug(img, dst, rng);
+  });
+  AddAugmentationName(name);
+}
+
+// Names the augmentation just added, after its position if name is empty,
+// and gives it a recorder if stats are enabled.
+void DataLoader::AddAugmentationName(const std::string& name) {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  if (name.empty()) {
+    augmentation_names_.push_back("augmentation_" +
+                                  std::to_string(augmentation_names_.size()));
+  } else {
+    augmentation_names_.push_back(name);
+  }
+  if (stats_) {
+    stats_->augmentations.emplace_back();
+  }
+}
+
+const char* DataLoader::AugmentationName(size_t op) const {
+  return op < augmentation_names_.size() ? augmentation_names_[op].c_str()
+                                         : "augmentation";
+}
+
+OpStatsRecorder* DataLoader::AugmentationRecorder(size_t op) const {
+  if (!stats_ || op >= stats_->augmentations.size()) {
+    return nullptr;
+  }
+  return &stats_->augmentations[op];
+}
+
+void DataLoader::SetSeed(uint64_t seed) { seed_ = seed; }
+
+void DataLoader::SetEpoch(uint32_t epoch) { epoch_ = epoch; }
+
+/*
+  EnableImageCache
+
+  Keeps decoded images in memory, up to budget_bytes, so that every epoch
+  after the first skips decoding the images that fit. The least recently used
+  images are evicted first. Replaces any cache enabled before; a budget of 0
+  disables caching.
+
+  @param size_t budget_bytes -> memory the cache may hold
+  @param CacheCompression compression -> store raw or compressed pixels
+*/
+void DataLoader::EnableImageCache(size_t budget_bytes,
+                                  CacheCompression compression) {
+  if (budget_bytes == 0) {
+    image_cache_.reset();
+    return;
+  }
+  image_cache_.reset(new ImageCache(budget_bytes, compression));
+}
+
+/*
+  SetDecodeSize
+
+  Lets JPEGs be decoded at 1/2, 1/4 or 1/8 of their size, whichever is the
+  smallest that is still at least target in both dimensions, when the images
+  are resized to target anyway, e.g. by NextTensor. Decoding at 1/4 scale
+  does a fraction of the inverse DCT and color conversion work of a full
+  decode. Images of other formats, and those smaller than twice the target,
+  are decoded at full size; so are the images of a packed dataset, which are
+  stored decoded. An empty target, the default, turns reduced decoding off.
+  Cached images were decoded at the previous size, so the cache is cleared.
+
+  @param const Size& target -> the smallest size images are needed at
+*/
+void DataLoader::SetDecodeSize(const Size& target) {
+  if (target == decode_size_) {
+    return;
+  }
+  StopStreaming();
+  decode_size_ = target;
+  if (image_cache_) {
+    image_cache_->Clear();
+  }
+}
+
+ImageCacheStats DataLoader::GetImageCacheStats() const {
+  return image_cache_ ? image_cache_->GetStats() : ImageCacheStats();
+}
+
+/*
+  EnableStats
+
+  Starts counting calls, time, bytes in and bytes out of decoding, of every
+  augmentation and of encoding, for GetStats. Each call is timed with two
+  clock reads and recorded with a few atomic adds, well under 1% of the work
+  of an image-sized operation. Disabled stats are never timed. Disabling
+  drops the counters and stops any DumpStats.
+
+  @param bool enabled -> whether to count
+*/
+void DataLoader::EnableStats(bool enabled) {
+  if (enabled == (stats_ != nullptr)) {
+    return;
+  }
+  StopStreaming();
+  StopStatsDump();
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  if (!enabled) {
+    stats_.reset();
+    return;
+  }
+  stats_.reset(new StageRecorders());
+  stats_->start = std::chrono::steady_clock::now();
+  for (size_t op = 0; op < augmentation_names_.size(); ++op) {
+    stats_->augmentations.emplace_back();
+  }
+}
+
+/*
+  GetStats
+
+  Reads the counters of every stage since EnableStats or ResetStats. Safe to
+  call while images are being processed.
+
+  @return LoaderStats -> the counters, all zero if stats are disabled
+*/
+LoaderStats DataLoader::GetStats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  LoaderStats stats;
+  if (!stats_) {
+    return stats;
+  }
+  stats.elapsed_s = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - stats_->start)
+                        .count();
+  stats.decode = stats_->decode.Snapshot("decode");
+  for (size_t op = 0; op < stats_->augmentations.size(); ++op) {
+    stats.augmentations.push_back(
+        stats_->augmentations[op].Snapshot(augmentation_names_[op]));
+  }
+  stats.encode = stats_->encode.Snapshot("encode");
+  return stats;
+}
+
+void DataLoader::ResetStats() {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  if (!stats_) {
+    return;
+  }
+  stats_->start = std::chrono::steady_clock::now();
+  stats_->decode.Reset();
+  for (OpStatsRecorder& recorder : stats_->augmentations) {
+    recorder.Reset();
+  }
+  stats_->encode.Reset();
+}
+
+/*
+  DumpStats
+
+  Enables stats and appends GetStats to a file as one line of JSON every
+  interval, from a background thread, plus a last line when the dump is
+  stopped: by another DumpStats, a zero interval, disabling stats or
+  destroying the loader. Counters are cumulative, so rates come from the
+  differences between lines.
+
+  @param const std::string& json_path -> the JSON lines file to append to
+  @param double interval_seconds -> time between lines; 0 stops dumping
+*/
+void DataLoader::DumpStats(const std::string& json_path,
+                           double interval_seconds) {
+  StopStatsDump();
+  if (interval_seconds <= 0) {
+    return;
+  }
+  EnableStats();
+  auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(interval_seconds));
+  stop_stats_dump_ = false;
+  stats_dump_thread_ = std::thread([this, json_path, interval]() {
+    std::ofstream out(json_path, std::ios::app);
+    std::unique_lock<std::mutex> lock(stats_mutex_);
+    bool stopping = false;
+    while (!stopping) {
+      stopping = stats_dump_cv_.wait_for(
+          lock, interval, [this] { return stop_stats_dump_; });
+      lock.unlock();
+      out << StatsToJson(GetStats()) << std::endl;
+      lock.lock();
+    }
+  });
+}
+
+/*
+  EnableTracing
+
+  Starts recording a span for every image in every pipeline stage (read
+  queue waits, decode, augment, encode) and for every augmentation, on the
+  thread that ran it, for WriteTrace. Recording a span reads the clock twice
+  and writes to the thread's own ring buffer, which keeps the last 65536
+  spans. Disabling drops the spans.
+
+  @param bool enabled -> whether to record
+*/
+void DataLoader::EnableTracing(bool enabled) {
+  if (enabled == (tracer_ != nullptr)) {
+    return;
+  }
+  StopStreaming();
+  tracer_.reset(enabled ? new Tracer() : nullptr);
+}
+
+/*
+  WriteTrace
+
+  Writes the spans recorded since EnableTracing as Chrome trace_event JSON,
+  to open in Perfetto (ui.perfetto.dev) or chrome://tracing. Call it once
+  the pipeline has finished.
+
+  @param const std::string& json_path -> the trace file to write
+*/
+void DataLoader::WriteTrace(const std::string& json_path) const {
+  if (!tracer_) {
+    throw std::runtime_error("Tracing is not enabled");
+  }
+  tracer_->WriteChromeTrace(json_path);
+}
+
+void DataLoader::StopStatsDump() {
+  if (!stats_dump_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stop_stats_dump_ = true;
+  }
+  stats_dump_cv_.notify_all();
+  stats_dump_thread_.join();
+}
+
+/*
+  UsePackedDataset
+
+  Reads images from a packed file written by SavePacked instead of decoding
+  the input directory. The file is memory mapped and images are handed to the
+  augmentations without decoding or copying. Images loaded in memory from the
+  previous source are dropped, as they may point into its mapping.
+
+  @param const std::string& pack_path -> the packed file
+*/
+void DataLoader::UsePackedDataset(const std::string& pack_path) {
+  StopStreaming();
+  images_.clear();
+  in_memory_ = false;
+  tar_shards_.reset();
+  packed_.reset(new PackedDataset(pack_path));
+  packed_path_ = pack_path;
+}
+
+/*
+  UseTarShards
+
+  Reads images from tar shards instead of the input directory, e.g. the
+  shards written by AugmentAndSaveToDirectory with a shard size. The parallel
+  pipeline and streaming read the shards with large sequential reads and
+  decode the images from memory, so a dataset of millions of images costs a
+  handful of open files instead of millions of file system lookups. Images
+  loaded in memory from the previous source are dropped, like with
+  UsePackedDataset.
+
+  @param const std::vector<std::string>& shard_paths -> the shards, in order
+*/
+void DataLoader::UseTarShards(const std::vector<std::string>& shard_paths) {
+  StopStreaming();
+  images_.clear();
+  in_memory_ = false;
+  packed_.reset();
+  tar_shards_.reset(new TarShards(shard_paths));
+}
+
+/*
+  SavePacked
+
+  Decodes every image of the dataset and writes them, unaugmented, to a
+  packed file for UsePackedDataset. Images are decoded in parallel, a chunk
+  at a time, and written in ListImageFiles order under their paths below the
+  input directory.
+
+  @param const std::string& pack_path -> the packed file to write
+*/
+void DataLoader::SavePacked(const std::string& pack_path) {
+  std::vector<path> files = ListImageFiles();
+  PackedDatasetWriter writer(pack_path);
+  const size_t chunk = 64;
+  std::vector<Mat> decoded(chunk);
+  for (size_t first = 0; first < files.size(); first += chunk) {
+    size_t count = std::min(chunk, files.size() - first);
+    parallel_for_(Range(0, (int)count), [&](const Range& range) {
+      for (int i = range.start; i < range.end; ++i) {
+        decoded[i] = DecodeImage(first + i, files[first + i]);
+      }
+    });
+    for (size_t i = 0; i < count; ++i) {
+      if (decoded[i].empty()) {
+        throw std::runtime_error("Cannot decode " + files[first + i].string());
+      }
+      writer.Add(OutputName(first + i, files[first + i]), decoded[i]);
+    }
+  }
+  writer.Finish();
+}
+
+void DataLoader::EnterStream(size_t image, size_t op) const {
+  StreamId id;
+  id.seed = seed_;
+  id.epoch = epoch_;
+  id.image = image;
+  id.op = op;
+  SetCurrentStream(id);
+}
+
+/*
+  ApplyAugmentations
+
+  Runs every augmentation on one image. Out-parameter augmentations write into
+  the worker's ping-pong buffers, viewed with the shape the augmentation
+  produced last time for an input of the same shape, so steady-state images
+  cause no allocation. Augmentations returning a Mat are called as is.
+
+  @param size_t index -> index of the image, for its RNG streams
+  @param const Mat& img -> the decoded image
+  @param Workspace& workspace -> the calling worker's buffers
+
+  @return Mat -> the augmented image; may live in workspace.buffers
+*/
+Mat DataLoader::ApplyAugmentations(size_t index,
+                                   const Mat& img,
+                                   Workspace& workspace) const {
+  Mat current = img;
+  workspace.shapes.resize(augmentations_.size());
+  for (size_t op = 0; op < augmentations_.size(); ++op) {
+    EnterStream(index, op);
+    TraceSpan span(tracer_.get(), "augmentation", AugmentationName(op), index);
+    OpTimer timer(AugmentationRecorder(op));
+    if (op >= into_augmentations_.size() || !into_augmentations_[op]) {
+      Mat out = augmentations_[op](current);
+      timer.Stop(MatBytes(current), MatBytes(out));
+      current = out;
+      continue;
+    }
+    OpShape& shape = workspace.shapes[op];
+    Size size = current.size();
+    int type = current.type();
+    if (shape.in_size == size && shape.in_type == type) {
+      size = shape.out_size;
+      type = shape.out_type;
+    }
+    Mat target = workspace.buffers.Target(current, size, type);
+    into_augmentations_[op](current, target);
+    timer.Stop(MatBytes(current), MatBytes(target));
+    shape.in_size = current.size();
+    shape.in_type = current.type();
+    shape.out_size = target.size();
+    shape.out_type = target.type();
+    current = target;
+  }
+  return current;
 }
 
 void DataLoader::PerformAugmentations() {
   if (in_memory_) {
-    for (auto aug : augmentations_) {
-      for (Mat& img : images_) {
-        img = aug(img);
+    Mat scratch;
+    for (size_t op = 0; op < augmentations_.size(); ++op) {
+      bool into = op < into_augmentations_.size() && into_augmentations_[op];
+      OpStatsRecorder* recorder = AugmentationRecorder(op);
+      for (size_t i = 0; i < images_.size(); ++i) {
+        EnterStream(i, op);
+        TraceSpan span(tracer_.get(), "augmentation", AugmentationName(op), i);
+        OpTimer timer(recorder);
+        if (!into) {
+          Mat out = augmentations_[op](images_[i]);
+          timer.Stop(MatBytes(images_[i]), MatBytes(out));
+          images_[i] = out;
+          continue;
+        }
+        // the previous image's buffer becomes the next output, unless
+        // something outside the loader still refers to it or the loader does
+        // not own it (a view into a packed dataset)
+        if (scratch.u == nullptr || scratch.u->refcount > 1) {
+          scratch.release();
+        }
+        into_augmentations_[op](images_[i], scratch);
+        timer.Stop(MatBytes(images_[i]), MatBytes(scratch));
+        std::swap(images_[i], scratch);
       }
     }
   } else {
@@ -40,19 +658,450 @@ void DataLoader::PerformAugmentations() {
 
 void DataLoader::AugmentAndSaveToDirectory(const std::string& save_path) {
   create_directories(save_path);
-  for (auto image_path :
-       boost::make_iterator_range(directory_iterator(directory_path_), {})) {
-    std::string filename = image_path.path().string();
-    size_t pos = filename.find_last_of('/');
-    if (filename.at(pos + 1) == '.') {
-      continue;
+  std::vector<path> files = ListImageFiles();
+  Workspace workspace;
+  for (size_t i = 0; i < files.size(); ++i) {
+    Mat img = DecodeImage(i, files[i]);
+    Mat augmented = ApplyAugmentations(i, img, workspace);
+    TraceSpan span(tracer_.get(), "stage", "encode", i);
+    WriteImage(OutputPath(save_path, i, files[i]), augmented);
+  }
+}
+
+// Encodes an image in memory in the format given by the extension of file.
+std::vector<uchar> DataLoader::EncodeImage(const path& file,
+                                           const Mat& img) const {
+  OpTimer timer(stats_ ? &stats_->encode : nullptr);
+  std::string extension = file.extension().string();
+  std::vector<uchar> encoded;
+  if (extension == ".ppm" && img.depth() == CV_8U) {
+    EncodePpm(img, encoded);
+  } else if (!imencode(extension.empty() ? ".png" : extension, img, encoded)) {
+    throw std::runtime_error("Cannot encode " + file.string());
+  }
+  timer.Stop(MatBytes(img), encoded.size());
+  return encoded;
+}
+
+// Encodes and writes an image with imwrite, counted as encoding.
+void DataLoader::WriteImage(const std::string& file, const Mat& img) const {
+  if (!stats_) {
+    imwrite(file, img);
+    return;
+  }
+  OpTimer timer(&stats_->encode);
+  imwrite(file, img);
+  timer.Stop();
+  timer.Record(MatBytes(img), exists(file) ? file_size(file) : 0);
+}
+
+/*
+  AugmentAndSaveToDirectory
+
+  Parallel version of AugmentAndSaveToDirectory. Images are decoded, augmented
+  and encoded by separate pools of worker threads joined by bounded queues, so
+  at most a few queues' worth of images are held in memory at once.
+
+  Images enter the augment stage in the same order as in the serial version.
+  With a single augment worker, augmentations that share one seeded RNG
+  therefore produce exactly the serial output. With several augment workers
+  the augmentations must be safe to call concurrently; augmentations added
+  with an RNG parameter are, and match the serial output for any number of
+  workers.
+
+  @param const std::string& save_path -> directory to write the images to
+  @param const PipelineOptions& options -> worker counts, queue capacity,
+  shard size, I/O backend and output format
+*/
+void DataLoader::AugmentAndSaveToDirectory(const std::string& save_path,
+                                           const PipelineOptions& options) {
+  create_directories(save_path);
+  std::vector<path> files = ListImageFiles();
+  // The file each image is saved as, which decides its format.
+  std::vector<path> output_files = files;
+  if (options.ppm_output) {
+    for (path& output_file : output_files) {
+      output_file.replace_extension(".ppm");
     }
-    Mat img = imread(image_path.path().string());
-    filename = save_path + filename.substr(pos, filename.size() - pos);
-    for (auto aug : augmentations_) {
-      img = aug(img);
+  }
+  std::vector<size_t> order(files.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (options.shard_size > 0) {
+    // Encoders compress in parallel; only appending to the shard is serial.
+    // They finish out of order, so members wait in a reorder buffer and are
+    // appended by index, which keeps the shards the same from run to run.
+    TarShardWriter writer((path(save_path) / "shard").string(),
+                          options.shard_size);
+    std::mutex pending_mutex;
+    std::map<size_t, std::vector<uchar>> pending;
+    RunPipeline(
+        files,
+        order,
+        [&](size_t index, const Mat& img) {
+          std::vector<uchar> encoded = EncodeImage(output_files[index], img);
+          std::lock_guard<std::mutex> lock(pending_mutex);
+          pending.emplace(index, std::move(encoded));
+        },
+        options,
+        [&](size_t index) {
+          std::vector<uchar> encoded;
+          {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto it = pending.find(index);
+            encoded = std::move(it->second);
+            pending.erase(it);
+          }
+          writer.Add(OutputName(index, output_files[index]),
+                     encoded.data(),
+                     encoded.size());
+        });
+    writer.Close();
+    return;
+  }
+  if (!options.async_io) {
+    RunPipeline(
+        files,
+        order,
+        [&](size_t index, const Mat& img) {
+          WriteImage(OutputPath(save_path, index, output_files[index]), img);
+        },
+        options);
+    return;
+  }
+
+  // Encoders compress in parallel and hand the bytes to one thread that keeps
+  // many writes in flight.
+  typedef std::pair<std::string, std::vector<uint8_t>> Output;
+  BoundedQueue<Output> outputs(options.queue_capacity);
+  std::exception_ptr write_error;
+  std::thread writer([&]() {
+    try {
+      AsyncFileIO(options.io_queue_depth)
+          .WriteFiles([&](std::string& file, std::vector<uint8_t>& data) {
+            Output output;
+            if (!outputs.Pop(output)) {
+              return false;
+            }
+            file = std::move(output.first);
+            data = std::move(output.second);
+            return true;
+          });
+    } catch (...) {
+      write_error = std::current_exception();
     }
-    imwrite(filename, img);
+    outputs.Close();
+  });
+  std::exception_ptr error;
+  try {
+    RunPipeline(
+        files,
+        order,
+        [&](size_t index, const Mat& img) {
+          Output output(OutputPath(save_path, index, output_files[index]),
+                        EncodeImage(output_files[index], img));
+          if (!outputs.Push(std::move(output))) {
+            throw std::runtime_error("Writing images failed");
+          }
+        },
+        options);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  outputs.Close();
+  writer.join();
+  if (write_error) {
+    std::rethrow_exception(write_error);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/*
+  RunPipeline
+
+  Runs the decode -> augment -> sink pipeline over a list of files, visiting
+  them in the given order. The sink is called from options.encode_workers
+  threads with the index of the file in files and the augmented image, which
+  is only valid during the call. If given, in_order is then called with the
+  same indices, one at a time and in order; the pipeline runs at most
+  options.queue_capacity images ahead of it. The first exception thrown by
+  any stage stops the pipeline and is rethrown once every worker has exited.
+
+  @param const std::vector<path>& files -> the images to process
+  @param const std::vector<size_t>& order -> indices into files, in the order
+  the images enter the augment stage
+  @param const std::function<void(size_t, const Mat&)>& sink -> final stage
+  @param const PipelineOptions& options -> worker counts and queue capacity
+  @param const std::function<void(size_t)>& in_order -> called in order after
+  the sink, or empty
+*/
+void DataLoader::RunPipeline(
+    const std::vector<path>& files,
+    const std::vector<size_t>& order,
+    const std::function<void(size_t, const Mat&)>& sink,
+    const PipelineOptions& options,
+    const std::function<void(size_t)>& in_order) {
+  typedef std::pair<size_t, Mat> Item;
+  // An augmented image and, if it lives in one, the ping-pong buffer it
+  // was written to. Encoders give buffers back once the image is written.
+  struct Augmented {
+    size_t position = 0;
+    size_t index = 0;
+    Mat image;
+    Mat buffer;
+  };
+  typedef std::pair<size_t, std::vector<uint8_t>> Encoded;
+  BoundedQueue<Encoded> encoded(options.queue_capacity);
+  BoundedQueue<Item> decoded(options.queue_capacity);
+  BoundedQueue<Augmented> augmented(options.queue_capacity);
+  // Tar shards, and files when async_io is set, are read by one thread, with
+  // large sequential reads or many asynchronous reads in flight, leaving the
+  // decode workers only DecodeBuffer. Cached images skip reading altogether,
+  // so with a cache the decode workers read the images one by one instead.
+  bool read_ahead =
+      !packed_ && !image_cache_ && (tar_shards_ || options.async_io);
+  std::mutex free_mutex;
+  std::vector<Mat> free_buffers;
+
+  int decode_workers = std::max(1, options.decode_workers);
+  int augment_workers = std::max(1, options.augment_workers);
+  int encode_workers = std::max(1, options.encode_workers);
+  std::atomic<int> decoders_left(decode_workers);
+  std::atomic<int> augmenters_left(augment_workers);
+
+  // Images wait in reorder buffers for an earlier, slower one. To keep those
+  // buffers at most window images, decoders only start positions below
+  // decode_end, window past the next image to augment, and with an in_order
+  // callback augmenters only take positions below augment_end, window past
+  // the next image to hand to it.
+  size_t window = std::max<size_t>(1, options.queue_capacity);
+  std::mutex window_mutex;
+  std::condition_variable window_cv;
+  size_t decode_end = window;
+  size_t augment_end = window;
+  bool stopped = false;
+  // Waits until position k is below end; false if the pipeline stopped.
+  auto wait_for_window = [&](size_t k, const size_t& end) {
+    std::unique_lock<std::mutex> lock(window_mutex);
+    window_cv.wait(lock, [&] { return stopped || k < end; });
+    return !stopped;
+  };
+  auto move_window = [&](size_t& end, size_t value) {
+    {
+      std::lock_guard<std::mutex> lock(window_mutex);
+      end = value;
+    }
+    window_cv.notify_all();
+  };
+
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto fail = [&](std::exception_ptr e) {
+    {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = e;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(window_mutex);
+      stopped = true;
+    }
+    window_cv.notify_all();
+    encoded.Close();
+    decoded.Close();
+    augmented.Close();
+  };
+
+  // Items carry their position in order until the sink.
+  std::atomic<size_t> next_file(0);
+  auto read = [&]() {
+    try {
+      // spans of the reader are the time it waits for room in the queue;
+      // the gaps between them are reads
+      auto push = [&](size_t k, std::vector<uint8_t>& data) {
+        TraceSpan span(tracer_.get(), "stage", "enqueue", order[k]);
+        return encoded.Push(Encoded(k, std::move(data)));
+      };
+      if (tar_shards_) {
+        tar_shards_->ReadSequential(order, push);
+      } else {
+        std::vector<std::string> paths;
+        for (size_t index : order) {
+          paths.push_back(files[index].string());
+        }
+        AsyncFileIO(options.io_queue_depth).ReadFiles(paths, push);
+      }
+    } catch (...) {
+      fail(std::current_exception());
+    }
+    encoded.Close();
+  };
+  auto decode = [&]() {
+    try {
+      if (read_ahead) {
+        Encoded item;
+        while (encoded.Pop(item)) {
+          if (!wait_for_window(item.first, decode_end)) {
+            break;
+          }
+          Mat img;
+          {
+            TraceSpan span(tracer_.get(), "stage", "decode", order[item.first]);
+            OpTimer timer(stats_ ? &stats_->decode : nullptr);
+            img = DecodeBuffer(item.second);
+            timer.Stop(item.second.size(), MatBytes(img));
+          }
+          if (!decoded.Push(Item(item.first, img))) {
+            break;
+          }
+        }
+      } else {
+        for (size_t k = next_file++; k < order.size(); k = next_file++) {
+          if (!wait_for_window(k, decode_end) ||
+              !decoded.Push(
+                  Item(k, DecodeImage(order[k], files[order[k]])))) {
+            break;
+          }
+        }
+      }
+    } catch (...) {
+      fail(std::current_exception());
+    }
+    if (--decoders_left == 0) {
+      decoded.Close();
+    }
+  };
+
+  // Decoders finish out of order, so augment workers take images strictly by
+  // index through a reorder buffer of at most window images. This keeps the
+  // order in which augmentations (and any RNG they share) see the images
+  // identical to the serial path.
+  std::mutex reorder_mutex;
+  std::map<size_t, Mat> pending;
+  size_t next_to_augment = 0;
+  auto augment = [&]() {
+    try {
+      Workspace workspace;
+      while (true) {
+        Item item;
+        {
+          std::lock_guard<std::mutex> lock(reorder_mutex);
+          if (in_order && !wait_for_window(next_to_augment, augment_end)) {
+            break;
+          }
+          while (pending.count(next_to_augment) == 0) {
+            Item popped;
+            if (!decoded.Pop(popped)) {
+              break;
+            }
+            pending.emplace(popped.first, std::move(popped.second));
+          }
+          auto it = pending.find(next_to_augment);
+          if (it == pending.end()) {
+            break;
+          }
+          item = Item(it->first, std::move(it->second));
+          pending.erase(it);
+          ++next_to_augment;
+          move_window(decode_end, next_to_augment + window);
+        }
+        Augmented result;
+        result.position = item.first;
+        result.index = order[item.first];
+        {
+          TraceSpan span(tracer_.get(), "stage", "augment", result.index);
+          result.image =
+              ApplyAugmentations(result.index, item.second, workspace);
+        }
+        if (workspace.buffers.Holds(result.image)) {
+          Mat replacement;
+          {
+            std::lock_guard<std::mutex> lock(free_mutex);
+            if (!free_buffers.empty()) {
+              replacement = std::move(free_buffers.back());
+              free_buffers.pop_back();
+            }
+          }
+          result.buffer = workspace.buffers.Detach(result.image, replacement);
+        }
+        if (!augmented.Push(std::move(result))) {
+          break;
+        }
+      }
+    } catch (...) {
+      fail(std::current_exception());
+    }
+    if (--augmenters_left == 0) {
+      augmented.Close();
+    }
+  };
+
+  // Positions the sink has finished, so in_order sees them in order.
+  std::mutex done_mutex;
+  std::vector<bool> done(in_order ? order.size() : 0);
+  size_t next_done = 0;
+  auto encode = [&]() {
+    try {
+      Augmented item;
+      while (augmented.Pop(item)) {
+        {
+          TraceSpan span(tracer_.get(), "stage", "encode", item.index);
+          sink(item.index, item.image);
+        }
+        if (!item.buffer.empty()) {
+          item.image.release();
+          std::lock_guard<std::mutex> lock(free_mutex);
+          free_buffers.push_back(std::move(item.buffer));
+        }
+        if (in_order) {
+          std::lock_guard<std::mutex> lock(done_mutex);
+          done[item.position] = true;
+          size_t first = next_done;
+          while (next_done < order.size() && done[next_done]) {
+            in_order(order[next_done]);
+            ++next_done;
+          }
+          if (next_done != first) {
+            move_window(augment_end, next_done + window);
+          }
+        }
+      }
+    } catch (...) {
+      fail(std::current_exception());
+    }
+  };
+
+  // Runs a stage on a thread named after it in traces.
+  auto named = [this](const std::string& name,
+                      const std::function<void()>& stage) {
+    return [this, name, stage]() {
+      if (tracer_) {
+        tracer_->NameThread(name);
+      }
+      stage();
+    };
+  };
+  std::vector<std::thread> workers;
+  if (read_ahead) {
+    workers.emplace_back(named("read", read));
+  }
+  for (int i = 0; i < decode_workers; ++i) {
+    workers.emplace_back(named("decode " + std::to_string(i), decode));
+  }
+  for (int i = 0; i < augment_workers; ++i) {
+    workers.emplace_back(named("augment " + std::to_string(i), augment));
+  }
+  for (int i = 0; i < encode_workers; ++i) {
+    workers.emplace_back(named("encode " + std::to_string(i), encode));
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
   }
 }
 
@@ -61,17 +1110,9 @@ void DataLoader::SaveImagesToDirectory(const std::string& save_path) {
     throw std::runtime_error("Must load in memory first");
   }
   create_directories(save_path);
-  auto img_ptr = images_.begin();
-  for (auto image_path :
-       boost::make_iterator_range(directory_iterator(directory_path_), {})) {
-    std::string filename = image_path.path().string();
-    size_t pos = filename.find_last_of('/');
-    if (filename.at(pos + 1) == '.') {
-      continue;
-    }
-    filename = save_path + filename.substr(pos, filename.size() - pos);
-    imwrite(filename, *img_ptr);
-    ++img_ptr;
+  std::vector<path> files = ListImageFiles();
+  for (size_t i = 0; i < files.size(); ++i) {
+    WriteImage(OutputPath(save_path, i, files[i]), images_[i]);
   }
 }
 
@@ -79,4 +1120,187 @@ std::vector<Mat>& DataLoader::GetImages() { return images_; }
 
 std::vector<std::function<Mat(const Mat&)>>& DataLoader::GetAugmentations() {
   return augmentations_;
-}
\ No newline at end of file
+}
+
+/*
+  StartEpoch
+
+  Starts streaming one epoch of augmented images, stopping any stream still
+  running. A background thread runs the parallel pipeline over the dataset,
+  visited in an order shuffled from the seed and the epoch, and keeps up to
+  options.prefetch_batches batches ready for Next. Tar shards are read
+  sequentially, so whole shards are shuffled and their members then go
+  through a shuffle buffer: once it holds options.shuffle_buffer images, each
+  new image sends out a random one of them. Augmentations draw from
+  the streams of this epoch and of each image's index in the directory, so the
+  images do not depend on the shuffle.
+
+  @param uint32_t epoch -> the epoch, for the shuffle and the RNG streams
+  @param const StreamOptions& options -> batch size, prefetch depth, shuffling
+  and pipeline workers
+*/
+void DataLoader::StartEpoch(uint32_t epoch, const StreamOptions& options) {
+  StopStreaming();
+  epoch_ = epoch;
+  stream_files_ = ListImageFiles();
+  stream_order_.resize(stream_files_.size());
+  std::iota(stream_order_.begin(), stream_order_.end(), 0);
+  if (options.shuffle) {
+    StreamId id;
+    id.seed = seed_;
+    id.epoch = epoch;
+    id.image = UINT32_MAX;
+    id.op = UINT32_MAX;
+    RNG rng = StreamRng(id);
+    if (tar_shards_) {
+      // Shuffle whole shards, keeping the members of each shard in order, so
+      // the shards are still read sequentially.
+      std::vector<std::vector<size_t>> shards(tar_shards_->NumShards());
+      for (size_t i = 0; i < tar_shards_->Size(); ++i) {
+        shards[tar_shards_->Member(i).shard].push_back(i);
+      }
+      for (size_t i = shards.size(); i > 1; --i) {
+        std::swap(shards[i - 1], shards[rng.uniform(0, (int)i)]);
+      }
+      stream_order_.clear();
+      for (const std::vector<size_t>& members : shards) {
+        stream_order_.insert(
+            stream_order_.end(), members.begin(), members.end());
+      }
+    } else {
+      for (size_t i = stream_order_.size(); i > 1; --i) {
+        std::swap(stream_order_[i - 1], stream_order_[rng.uniform(0, (int)i)]);
+      }
+    }
+  }
+
+  stream_batch_size_ = std::max<size_t>(1, options.batch_size);
+  stream_queue_.reset(new BoundedQueue<Mat>(
+      stream_batch_size_ * std::max<size_t>(1, options.prefetch_batches)));
+  stream_error_ = nullptr;
+  stream_thread_ = std::thread([this, options]() {
+    // The sink sees images in completion order; they wait in a reorder
+    // buffer until the pipeline hands them on in stream order.
+    std::mutex pending_mutex;
+    std::map<size_t, Mat> pending;
+    // Images enter the shuffle buffer in stream order, so the shuffled order
+    // only depends on the seed and the epoch.
+    size_t buffer_size = tar_shards_ && options.shuffle
+                             ? std::max<size_t>(1, options.shuffle_buffer)
+                             : 1;
+    StreamId id;
+    id.seed = seed_;
+    id.epoch = epoch_;
+    id.image = UINT32_MAX;
+    id.op = UINT32_MAX - 1;
+    RNG buffer_rng = StreamRng(id);
+    std::vector<Mat> buffer;
+    auto send_random = [&]() {
+      std::swap(buffer[buffer_rng.uniform(0, (int)buffer.size())],
+                buffer.back());
+      if (!stream_queue_->Push(std::move(buffer.back()))) {
+        throw StreamStopped();
+      }
+      buffer.pop_back();
+    };
+    try {
+      RunPipeline(
+          stream_files_,
+          stream_order_,
+          [&](size_t index, const Mat& img) {
+            Mat copy = img.clone();
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending.emplace(index, std::move(copy));
+          },
+          options.pipeline,
+          [&](size_t index) {
+            {
+              std::lock_guard<std::mutex> lock(pending_mutex);
+              auto it = pending.find(index);
+              buffer.push_back(std::move(it->second));
+              pending.erase(it);
+            }
+            if (buffer.size() == buffer_size) {
+              send_random();
+            }
+          });
+      while (!buffer.empty()) {
+        send_random();
+      }
+    } catch (const StreamStopped&) {
+    } catch (...) {
+      stream_error_ = std::current_exception();
+    }
+    stream_queue_->Close();
+  });
+}
+
+/*
+  Next
+
+  Takes the next batch of the epoch started by StartEpoch, blocking until it
+  is ready. The last batch may be smaller than the batch size.
+
+  @param std::vector<Mat>& batch -> replaced with the images of the batch
+
+  @return bool -> false once the epoch is exhausted
+*/
+bool DataLoader::Next(std::vector<Mat>& batch) {
+  if (!stream_queue_) {
+    throw std::runtime_error("Must start an epoch before streaming");
+  }
+  batch.clear();
+  Mat img;
+  while (batch.size() < stream_batch_size_ && stream_queue_->Pop(img)) {
+    batch.push_back(std::move(img));
+  }
+  if (!batch.empty()) {
+    return true;
+  }
+  if (stream_thread_.joinable()) {
+    stream_thread_.join();
+  }
+  if (stream_error_) {
+    std::exception_ptr error = stream_error_;
+    stream_error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+  return false;
+}
+
+/*
+  NextTensor
+
+  Takes the next batch like Next and packs it into a caller provided tensor
+  of NCHW floats. The images of the batch are packed in parallel, straight
+  from the augmented images into data, without intermediate copies.
+
+  @param const TensorOptions& options -> size, normalization and layout of
+  each image
+  @param void* data -> room for batch_size * TensorImageBytes(options) bytes
+
+  @return size_t -> images written, 0 once the epoch is exhausted
+*/
+size_t DataLoader::NextTensor(const TensorOptions& options, void* data) {
+  std::vector<Mat> batch;
+  if (!Next(batch)) {
+    return 0;
+  }
+  size_t image_bytes = TensorImageBytes(options);
+  parallel_for_(Range(0, (int)batch.size()), [&](const Range& range) {
+    for (int i = range.start; i < range.end; ++i) {
+      PackTensor(batch[i], options, (uchar*)data + i * image_bytes);
+    }
+  });
+  return batch.size();
+}
+
+void DataLoader::StopStreaming() {
+  if (stream_queue_) {
+    stream_queue_->Close();
+  }
+  if (stream_thread_.joinable()) {
+    stream_thread_.join();
+  }
+  stream_queue_.reset();
+}
@@ -11,31 +11,36 @@ using namespace cv;
 int main() {
   // Load in dataset
   DataLoader dataset("/home/vagrant/src/final-project-rijuka/sampleinputs");
-  RNG rng = RNG();
+  // Every augmentation gets its own RNG stream derived from this seed
+  dataset.SetSeed(2021);
 
   // Add augmentations
-  dataset.AddAugmentation(
-      [&rng](const Mat& img) { return RandomHorizontalFlip(img, 0.5, rng); });
-  dataset.AddAugmentation(
-      [&rng](const Mat& img) { return RandomVerticalFlip(img, 0.5, rng); });
-  dataset.AddAugmentation(
-      [&rng](const Mat& img) { return RandomSlide(img, 0.5, rng); });
-  dataset.AddAugmentation([&rng](const Mat& img) {
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomHorizontalFlip(img, 0.5, rng);
+  });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomVerticalFlip(img, 0.5, rng);
+  });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomSlide(img, 0.5, rng);
+  });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
     return RandomDeform(
         img, {0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4}, rng);
   });
-  dataset.AddAugmentation(
-      [&rng](const Mat& img) { return RandomSlide(img, 1, rng); });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomSlide(img, 1, rng);
+  });
   dataset.AddAugmentation([](const Mat& img) {
     int kernel_size = 3;
     Mat kernel = Mat::ones(kernel_size, kernel_size, CV_32F) /
                  (float)(kernel_size * kernel_size);
     return Blur(img, kernel);
   });
-  dataset.AddAugmentation([&rng](const Mat& img) {
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
     return RandomNoise(img, {10, 12, 34}, {8, 16, 24}, rng);
   });
-  dataset.AddAugmentation([&rng](const Mat& img) {
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
     double yaw = 15;
     double pitch = 15;
     double roll = 15;
@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "synthetic_dataset.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Splits "value:weight" into value and weight, which is 1 without a colon.
+static string SplitWeight(const string& arg, double& weight) {
+  size_t colon = arg.find(':');
+  weight = colon == string::npos ? 1 : atof(arg.c_str() + colon + 1);
+  return arg.substr(0, colon);
+}
+
+static void Usage(const char* name) {
+  cerr << "usage: " << name << " <output directory> <count> [--seed N]"
+       << " [--size WxH[:weight]]... [--jitter F]"
+       << " [--format jpg|png|ppm|ppm-ascii[:weight]]... [--jpeg-quality Q]"
+       << " [--png-compression C] [--files-per-directory N]" << endl;
+}
+
+// Writes a reproducible dataset of synthetic images, to benchmark and test
+// the loader on without a real dataset at hand.
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    Usage(argv[0]);
+    return 1;
+  }
+  SyntheticDatasetOptions options;
+  options.count = strtoull(argv[2], nullptr, 10);
+  options.sizes.clear();
+  options.formats.clear();
+  for (int i = 3; i < argc; ++i) {
+    if (i + 1 == argc) {
+      Usage(argv[0]);
+      return 1;
+    }
+    string flag = argv[i];
+    string arg = argv[++i];
+    double weight;
+    if (flag == "--seed") {
+      options.seed = strtoull(arg.c_str(), nullptr, 10);
+    } else if (flag == "--size") {
+      int width = 0, height = 0;
+      string size = SplitWeight(arg, weight);
+      sscanf(size.c_str(), "%dx%d", &width, &height);
+      if (width <= 0 || height <= 0) {
+        cerr << "bad size " << arg << endl;
+        return 1;
+      }
+      options.sizes.push_back(Size(width, height));
+      options.size_weights.push_back(weight);
+    } else if (flag == "--jitter") {
+      options.size_jitter = atof(arg.c_str());
+    } else if (flag == "--format") {
+      string format = SplitWeight(arg, weight);
+      if (format == "jpg") {
+        options.formats.push_back(SyntheticFormat::kJpeg);
+      } else if (format == "png") {
+        options.formats.push_back(SyntheticFormat::kPng);
+      } else if (format == "ppm") {
+        options.formats.push_back(SyntheticFormat::kPpm);
+      } else if (format == "ppm-ascii") {
+        options.formats.push_back(SyntheticFormat::kPpmAscii);
+      } else {
+        cerr << "bad format " << arg << endl;
+        return 1;
+      }
+      options.format_weights.push_back(weight);
+    } else if (flag == "--jpeg-quality") {
+      options.jpeg_quality = atoi(arg.c_str());
+    } else if (flag == "--png-compression") {
+      options.png_compression = atoi(arg.c_str());
+    } else if (flag == "--files-per-directory") {
+      options.files_per_directory = strtoull(arg.c_str(), nullptr, 10);
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.sizes.empty()) {
+    options.sizes = SyntheticDatasetOptions().sizes;
+  }
+  if (options.formats.empty()) {
+    options.formats = SyntheticDatasetOptions().formats;
+  }
+  try {
+    vector<string> paths = GenerateSyntheticDataset(argv[1], options);
+    cout << "generated " << paths.size() << " images in " << argv[1] << endl;
+  } catch (const std::exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
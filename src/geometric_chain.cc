@@ -0,0 +1,231 @@
+#include "geometric_chain.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "augmentations.hpp"
+#include "random_rotation_utilities.hpp"
+
+using namespace cv;
+
+// Map value for destination pixels that fall outside the source; remap fills
+// them with the border color.
+static const float kOutside = -100000.f;
+
+GeometricChain::GeometricChain(const Size& src_size)
+    : src_size_(src_size), size_(src_size) {}
+
+void GeometricChain::HorizontalFlip() {
+  Step step;
+  step.kind = HFLIP;
+  step.in_size = size_;
+  steps_.push_back(step);
+}
+
+void GeometricChain::VerticalFlip() {
+  Step step;
+  step.kind = VFLIP;
+  step.in_size = size_;
+  steps_.push_back(step);
+}
+
+void GeometricChain::Slide(int x_shift, int y_shift) {
+  Step step;
+  step.kind = SLIDE;
+  step.in_size = size_;
+  step.x_shift = ((x_shift % size_.width) + size_.width) % size_.width;
+  step.y_shift = ((y_shift % size_.height) + size_.height) % size_.height;
+  steps_.push_back(step);
+}
+
+void GeometricChain::Deform(int x_wave_amp,
+                            int x_wave_freq,
+                            int y_wave_amp,
+                            int y_wave_freq) {
+  Step step;
+  step.kind = DEFORM;
+  step.in_size = size_;
+  DeformOffsets(size_.height,
+                x_wave_amp,
+                x_wave_freq,
+                y_wave_amp,
+                y_wave_freq,
+                step.x_offsets,
+                step.y_offsets);
+  steps_.push_back(step);
+}
+
+void GeometricChain::Rotate(float yaw, float pitch, float roll, float Z) {
+  Mat rotMat;
+  Rect_<double> CircumRect;
+  ComposeRotation(size_, yaw, pitch, roll, Z, rotMat, CircumRect);
+
+  Step step;
+  step.kind = ROTATE;
+  step.in_size = size_;
+  step.homography = RotationHomography(size_, CircumRect, rotMat);
+  steps_.push_back(step);
+
+  size_ = CircumRect.size();
+  has_rotation_ = true;
+}
+
+void GeometricChain::RandomHorizontalFlip(double hflip_ratio, RNG& rng) {
+  double flip_prob = rng.uniform(0.0, 1.0);
+  if (hflip_ratio > flip_prob) {
+    HorizontalFlip();
+  }
+}
+
+void GeometricChain::RandomVerticalFlip(double vflip_ratio, RNG& rng) {
+  double flip_prob = rng.uniform(0.0, 1.0);
+  if (vflip_ratio > flip_prob) {
+    VerticalFlip();
+  }
+}
+
+void GeometricChain::RandomSlide(double slide_ratio, RNG& rng) {
+  double slide_prob = rng.uniform(0.0, 1.0);
+  if (slide_ratio > slide_prob) {
+    int x_slide = rng.uniform(-1 * size_.width, size_.width);
+    int y_slide = rng.uniform(-1 * size_.height, size_.height);
+    Slide(x_slide, y_slide);
+  }
+}
+
+void GeometricChain::RandomDeform(std::pair<double, double> x_amp,
+                                  std::pair<double, double> y_amp,
+                                  std::pair<double, double> x_freq,
+                                  std::pair<double, double> y_freq,
+                                  RNG& rng) {
+  int num_cols = size_.width;
+  int num_rows = size_.height;
+  int x_wave_amp = rng.uniform(x_amp.first * num_rows, x_amp.second * num_rows);
+  int x_wave_freq =
+      rng.uniform(x_freq.first * num_rows, x_freq.second * num_rows);
+  int y_wave_amp = rng.uniform(y_amp.first * num_cols, y_amp.second * num_cols);
+  int y_wave_freq =
+      rng.uniform(y_freq.first * num_cols, y_freq.second * num_cols);
+  Deform(x_wave_amp, x_wave_freq, y_wave_amp, y_wave_freq);
+}
+
+void GeometricChain::RandomRotate(double yaw_sigma,
+                                  double pitch_sigma,
+                                  double roll_sigma,
+                                  RNG& rng,
+                                  double Z) {
+  double yaw =
+      std::min<double>(60, std::max<double>(-60, rng.gaussian(yaw_sigma)));
+  double pitch =
+      std::min<double>(60, std::max<double>(-60, rng.gaussian(pitch_sigma)));
+  double roll =
+      std::min<double>(60, std::max<double>(-60, rng.gaussian(roll_sigma)));
+  Rotate(yaw, pitch, roll, Z);
+}
+
+Size GeometricChain::OutputSize() const { return size_; }
+
+bool GeometricChain::Empty() const { return steps_.empty(); }
+
+/*
+  BuildMaps
+
+  Builds the remap tables of the whole chain. Every destination pixel is
+  walked back through the recorded steps, last to first, until it lands in
+  the source image. Pixels that leave the input of an intermediate step (the
+  black area of a deformation or around a rotation) are marked as outside.
+
+  @param Mat& map_x -> CV_32FC1 source x position of every output pixel
+  @param Mat& map_y -> CV_32FC1 source y position of every output pixel
+*/
+void GeometricChain::BuildMaps(Mat& map_x, Mat& map_y) const {
+  map_x.create(size_, CV_32FC1);
+  map_y.create(size_, CV_32FC1);
+
+  for (int y = 0; y < size_.height; y++) {
+    float* row_x = map_x.ptr<float>(y);
+    float* row_y = map_y.ptr<float>(y);
+    for (int x = 0; x < size_.width; x++) {
+      double px = x;
+      double py = y;
+      bool inside = true;
+      for (size_t k = steps_.size(); k-- > 0 && inside;) {
+        const Step& step = steps_[k];
+        int w = step.in_size.width;
+        int h = step.in_size.height;
+        switch (step.kind) {
+          case HFLIP:
+            px = w - 1 - px;
+            break;
+          case VFLIP:
+            py = h - 1 - py;
+            break;
+          case SLIDE:
+            px -= step.x_shift;
+            py -= step.y_shift;
+            px -= std::floor(px / w) * w;
+            py -= std::floor(py / h) * h;
+            break;
+          case DEFORM: {
+            int row = std::min(h - 1, std::max(0, cvRound(py)));
+            px += step.x_offsets[row];
+            py += step.y_offsets[row];
+            inside = px > -0.5 && px < w - 0.5 && py > -0.5 && py < h - 0.5;
+            break;
+          }
+          case ROTATE: {
+            const Matx33d& H = step.homography;
+            double iw = 1.0 / (H(2, 0) * px + H(2, 1) * py + H(2, 2));
+            double sx = (H(0, 0) * px + H(0, 1) * py + H(0, 2)) * iw;
+            double sy = (H(1, 0) * px + H(1, 1) * py + H(1, 2)) * iw;
+            px = sx;
+            py = sy;
+            // The first step samples the source itself, so remap handles its
+            // border. Later rotations see the output of earlier steps.
+            if (k > 0) {
+              inside = px > -0.5 && px < w - 0.5 && py > -0.5 && py < h - 0.5;
+            }
+            break;
+          }
+        }
+      }
+      row_x[x] = inside ? (float)px : kOutside;
+      row_y[x] = inside ? (float)py : kOutside;
+    }
+  }
+}
+
+/*
+  Apply
+
+  Resamples src once through the composed transform of the chain. Chains
+  without a rotation only move whole pixels and are sampled with
+  INTER_NEAREST, which makes them exact.
+
+  @param const cv::Mat& src -> image of the size the chain was created with
+  @param int interpolation -> interpolation used when the chain rotates
+  @param const Scalar& border_color -> color of pixels with no source
+
+  @return Mat -> the transformed image
+*/
+Mat GeometricChain::Apply(const Mat& src,
+                          int interpolation,
+                          const Scalar& border_color) const {
+  assert(src.size() == src_size_);
+  if (steps_.empty()) {
+    return src;
+  }
+
+  Mat map_x, map_y;
+  BuildMaps(map_x, map_y);
+  Mat dst;
+  remap(src,
+        dst,
+        map_x,
+        map_y,
+        has_rotation_ ? interpolation : INTER_NEAREST,
+        BORDER_CONSTANT,
+        border_color);
+  return dst;
+}
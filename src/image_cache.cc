@@ -0,0 +1,192 @@
+#include "image_cache.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "lz_codec.hpp"
+
+using namespace cv;
+
+ImageCache::ImageCache(size_t budget_bytes, CacheCompression compression)
+    : budget_bytes_(budget_bytes), compression_(compression) {}
+
+/*
+  GetOrLoad
+
+  Looks key up and, on a miss, calls load without holding the lock and caches
+  what it returns. Two threads missing the same key at once both load it; the
+  second insert replaces the first.
+
+  @param const std::string& key -> identifies the image, e.g. its path
+  @param const std::function<Mat()>& load -> decodes the image on a miss
+
+  @return Mat -> the image
+*/
+Mat ImageCache::GetOrLoad(const std::string& key,
+                          const std::function<Mat()>& load) {
+  Mat img;
+  if (Get(key, img)) {
+    return img;
+  }
+  img = load();
+  Put(key, img);
+  return img;
+}
+
+bool ImageCache::Get(const std::string& key, Mat& img) {
+  Entry hit;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(key);
+    if (found == index_.end()) {
+      ++stats_.misses;
+      return false;
+    }
+    ++stats_.hits;
+    entries_.splice(entries_.begin(), entries_, found->second);
+    hit.pixels = found->second->pixels;
+    hit.packed = found->second->packed;
+    hit.rows = found->second->rows;
+    hit.cols = found->second->cols;
+    hit.type = found->second->type;
+  }
+  img = Unpack(hit);
+  return true;
+}
+
+/*
+  Put
+
+  Caches img under key, replacing any image already there, and evicts least
+  recently used images until the cache fits its budget again. Empty images and
+  images that alone exceed the budget are not cached.
+
+  @param const std::string& key -> identifies the image
+  @param const Mat& img -> the decoded image
+*/
+void ImageCache::Put(const std::string& key, const Mat& img) {
+  if (img.empty()) {
+    return;
+  }
+  Entry entry = Pack(key, img);
+  if (entry.bytes > budget_bytes_) {
+    return;
+  }
+  Insert(std::move(entry));
+}
+
+void ImageCache::Insert(Entry entry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto found = index_.find(entry.key);
+  if (found != index_.end()) {
+    stats_.bytes -= found->second->bytes;
+    stats_.image_bytes -= found->second->image_bytes;
+    entries_.erase(found->second);
+    index_.erase(found);
+  }
+  while (!entries_.empty() && stats_.bytes + entry.bytes > budget_bytes_) {
+    const Entry& victim = entries_.back();
+    stats_.bytes -= victim.bytes;
+    stats_.image_bytes -= victim.image_bytes;
+    index_.erase(victim.key);
+    entries_.pop_back();
+    ++stats_.evictions;
+  }
+  stats_.bytes += entry.bytes;
+  stats_.image_bytes += entry.image_bytes;
+  entries_.push_front(std::move(entry));
+  index_[entries_.front().key] = entries_.begin();
+  stats_.entries = entries_.size();
+}
+
+void ImageCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  stats_.entries = 0;
+  stats_.bytes = 0;
+  stats_.image_bytes = 0;
+}
+
+ImageCacheStats ImageCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+// Clears the counters, keeping the cached images and their sizes.
+void ImageCache::ResetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.hits = 0;
+  stats_.misses = 0;
+  stats_.evictions = 0;
+}
+
+/*
+  Pack
+
+  Builds the cache entry of an image: the image itself, or its delta filtered
+  rows compressed into one block.
+
+  @param const std::string& key -> the key of the entry
+  @param const Mat& img -> the image
+
+  @return Entry -> the entry, with its size in bytes
+*/
+ImageCache::Entry ImageCache::Pack(const std::string& key,
+                                   const Mat& img) const {
+  Entry entry;
+  entry.key = key;
+  entry.rows = img.rows;
+  entry.cols = img.cols;
+  entry.type = img.type();
+  size_t row_bytes = img.cols * img.elemSize();
+  entry.image_bytes = row_bytes * img.rows;
+  if (compression_ == CacheCompression::kNone) {
+    entry.pixels = img.isContinuous() ? img : img.clone();
+    entry.bytes = entry.image_bytes;
+    return entry;
+  }
+
+  thread_local std::vector<uint8_t> filtered;
+  filtered.resize(row_bytes * img.rows);
+  size_t step = img.elemSize();
+  for (int i = 0; i < img.rows; ++i) {
+    const uint8_t* row = img.ptr<uint8_t>(i);
+    uint8_t* out = filtered.data() + i * row_bytes;
+    for (size_t b = 0; b < std::min(step, row_bytes); ++b) {
+      out[b] = row[b];
+    }
+    for (size_t b = step; b < row_bytes; ++b) {
+      out[b] = (uint8_t)(row[b] - row[b - step]);
+    }
+  }
+  auto packed = std::make_shared<std::vector<uint8_t>>();
+  LzCompress(filtered.data(), filtered.size(), *packed);
+  packed->shrink_to_fit();
+  entry.bytes = packed->size();
+  entry.packed = std::move(packed);
+  return entry;
+}
+
+Mat ImageCache::Unpack(const Entry& entry) {
+  if (!entry.packed) {
+    return entry.pixels;
+  }
+  Mat img(entry.rows, entry.cols, entry.type);
+  size_t row_bytes = img.cols * img.elemSize();
+  if (!LzDecompress(entry.packed->data(),
+                    entry.packed->size(),
+                    img.data,
+                    row_bytes * img.rows)) {
+    throw std::runtime_error("Corrupt image in cache");
+  }
+  size_t step = img.elemSize();
+  for (int i = 0; i < img.rows; ++i) {
+    uint8_t* row = img.ptr<uint8_t>(i);
+    for (size_t b = step; b < row_bytes; ++b) {
+      row[b] = (uint8_t)(row[b] + row[b - step]);
+    }
+  }
+  return img;
+}
@@ -0,0 +1,178 @@
+#include "image_header.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <opencv2/imgcodecs.hpp>
+#include <utility>
+
+using namespace cv;
+
+static uint32_t ReadBig16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t ReadBig32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+  ExifOrientation
+
+  Finds the orientation tag in the first IFD of an EXIF block.
+
+  @param const uint8_t* tiff -> the TIFF header following "Exif\0\0"
+  @param size_t size -> bytes available at tiff
+
+  @return int -> the orientation, 1 to 8, or 1 if there is none
+*/
+static int ExifOrientation(const uint8_t* tiff, size_t size) {
+  if (size < 8) {
+    return 1;
+  }
+  bool little = tiff[0] == 'I' && tiff[1] == 'I';
+  if (!little && !(tiff[0] == 'M' && tiff[1] == 'M')) {
+    return 1;
+  }
+  auto read16 = [&](size_t at) -> uint32_t {
+    return little ? tiff[at] | (tiff[at + 1] << 8) : ReadBig16(tiff + at);
+  };
+  auto read32 = [&](size_t at) -> uint32_t {
+    return little ? tiff[at] | (tiff[at + 1] << 8) | (tiff[at + 2] << 16) |
+                        ((uint32_t)tiff[at + 3] << 24)
+                  : ReadBig32(tiff + at);
+  };
+  size_t ifd = read32(4);
+  if (ifd > size - 2) {
+    return 1;
+  }
+  size_t entries = read16(ifd);
+  for (size_t i = 0; i < entries; ++i) {
+    size_t entry = ifd + 2 + 12 * i;
+    if (entry + 12 > size) {
+      break;
+    }
+    if (read16(entry) == 0x0112) {
+      int orientation = (int)read16(entry + 8);
+      return orientation >= 1 && orientation <= 8 ? orientation : 1;
+    }
+  }
+  return 1;
+}
+
+// Walks the JPEG markers up to the first frame header (SOF), noting the EXIF
+// orientation on the way.
+static bool ProbeJpeg(const uint8_t* data, size_t size, ImageHeader& header) {
+  int orientation = 1;
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (data[pos] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = data[pos + 1];
+    if (marker == 0xFF) {
+      // fill byte
+      ++pos;
+      continue;
+    }
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+      // no segment
+      pos += 2;
+      continue;
+    }
+    size_t length = ReadBig16(data + pos + 2);
+    const uint8_t* segment = data + pos + 4;
+    if (length < 2) {
+      return false;
+    }
+    bool frame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+                 marker != 0xC8 && marker != 0xCC;
+    if (frame) {
+      if (pos + 9 > size) {
+        return false;
+      }
+      header.format = ImageFormat::kJpeg;
+      header.size = Size(ReadBig16(segment + 3), ReadBig16(segment + 1));
+      if (orientation >= 5) {
+        // rotated by 90 degrees
+        std::swap(header.size.width, header.size.height);
+      }
+      return true;
+    }
+    if (marker == 0xDA || marker == 0xD9) {
+      // scan data or end of image before any frame header
+      return false;
+    }
+    if (marker == 0xE1 && length >= 8 && pos + 2 + length <= size &&
+        memcmp(segment, "Exif\0\0", 6) == 0) {
+      orientation = ExifOrientation(segment + 6, length - 8);
+    }
+    pos += 2 + length;
+  }
+  return false;
+}
+
+// Reads one decimal number of a PNM header, skipping whitespace and comments.
+static bool ReadPnmNumber(const uint8_t* data,
+                          size_t size,
+                          size_t& pos,
+                          int& value) {
+  while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+    if (data[pos] == '#') {
+      while (pos < size && data[pos] != '\n') {
+        ++pos;
+      }
+    } else {
+      ++pos;
+    }
+  }
+  if (pos == size || !isdigit(data[pos])) {
+    return false;
+  }
+  value = 0;
+  while (pos < size && isdigit(data[pos]) && value < (1 << 24)) {
+    value = value * 10 + (data[pos++] - '0');
+  }
+  return true;
+}
+
+bool ProbeImageHeader(const uint8_t* data, size_t size, ImageHeader& header) {
+  header = ImageHeader();
+  if (size >= 4 && data[0] == 0xFF && data[1] == 0xD8) {
+    return ProbeJpeg(data, size, header);
+  }
+  static const uint8_t kPngSignature[8] = {
+      0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  if (size >= 24 && memcmp(data, kPngSignature, 8) == 0 &&
+      memcmp(data + 12, "IHDR", 4) == 0) {
+    header.format = ImageFormat::kPng;
+    header.size = Size(ReadBig32(data + 16), ReadBig32(data + 20));
+    return true;
+  }
+  if (size >= 3 && data[0] == 'P' && data[1] >= '1' && data[1] <= '6') {
+    size_t pos = 2;
+    int width, height;
+    if (ReadPnmNumber(data, size, pos, width) &&
+        ReadPnmNumber(data, size, pos, height)) {
+      header.format = ImageFormat::kPnm;
+      header.size = Size(width, height);
+      return true;
+    }
+  }
+  return false;
+}
+
+int ReducedDecodeFlag(const ImageHeader& header, const Size& target) {
+  if (header.format != ImageFormat::kJpeg || target.empty()) {
+    return IMREAD_COLOR;
+  }
+  static const int kFactors[3] = {8, 4, 2};
+  static const int kFlags[3] = {
+      IMREAD_REDUCED_COLOR_8, IMREAD_REDUCED_COLOR_4, IMREAD_REDUCED_COLOR_2};
+  for (int i = 0; i < 3; ++i) {
+    int f = kFactors[i];
+    // libjpeg rounds scaled dimensions up
+    if ((header.size.width + f - 1) / f >= target.width &&
+        (header.size.height + f - 1) / f >= target.height) {
+      return kFlags[i];
+    }
+  }
+  return IMREAD_COLOR;
+}
@@ -0,0 +1,189 @@
+#include "lz_codec.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+static const size_t kMinMatch = 4;
+static const size_t kMaxOffset = 65535;
+static const int kHashBits = 14;
+// The format ends every block with at least kLastLiterals literals, and no
+// match may start within kMatchStartLimit bytes of the end.
+static const size_t kLastLiterals = 5;
+static const size_t kMatchStartLimit = 12;
+
+static uint32_t Read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t Hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - kHashBits);
+}
+
+// Writes the part of a length that does not fit in its 4-bit token field.
+static void WriteLength(std::vector<uint8_t>& dst, size_t length) {
+  for (; length >= 255; length -= 255) {
+    dst.push_back(255);
+  }
+  dst.push_back((uint8_t)length);
+}
+
+static bool ReadLength(const uint8_t*& in, const uint8_t* end, size_t& length) {
+  uint8_t byte;
+  do {
+    if (in == end) {
+      return false;
+    }
+    byte = *in++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Appends literal_length literals followed by a match, or by nothing when
+// match_length is 0, which only the last sequence of a block may do.
+static void EmitSequence(std::vector<uint8_t>& dst,
+                         const uint8_t* literals,
+                         size_t literal_length,
+                         size_t match_length,
+                         size_t offset) {
+  size_t token_pos = dst.size();
+  dst.push_back(0);
+  uint8_t token = (uint8_t)(std::min<size_t>(literal_length, 15) << 4);
+  if (literal_length >= 15) {
+    WriteLength(dst, literal_length - 15);
+  }
+  dst.insert(dst.end(), literals, literals + literal_length);
+  if (match_length > 0) {
+    dst.push_back((uint8_t)(offset & 0xff));
+    dst.push_back((uint8_t)(offset >> 8));
+    size_t extra = match_length - kMinMatch;
+    token |= (uint8_t)std::min<size_t>(extra, 15);
+    if (extra >= 15) {
+      WriteLength(dst, extra - 15);
+    }
+  }
+  dst[token_pos] = token;
+}
+
+/*
+  LzCompress
+
+  Greedy single-pass compressor. A hash of the next 4 bytes indexes the last
+  position they were seen at; a confirmed candidate is extended in both
+  directions and emitted as one sequence. Positions without a match are
+  skipped faster and faster, so incompressible data costs little more than a
+  copy.
+
+  @param const uint8_t* src -> the data to compress
+  @param size_t size -> number of bytes at src, below 4 GiB
+  @param std::vector<uint8_t>& dst -> replaced with the compressed block
+*/
+void LzCompress(const uint8_t* src, size_t size, std::vector<uint8_t>& dst) {
+  assert(size <= UINT32_MAX);
+  dst.clear();
+  dst.reserve(size + size / 255 + 16);
+  size_t anchor = 0;
+  if (size > kMatchStartLimit) {
+    std::vector<uint32_t> table((size_t)1 << kHashBits, 0);
+    size_t search_limit = size - kMatchStartLimit;
+    size_t match_limit = size - kLastLiterals;
+    size_t pos = 0;
+    size_t misses = 0;
+    while (pos < search_limit) {
+      uint32_t sequence = Read32(src + pos);
+      uint32_t& slot = table[Hash(sequence)];
+      size_t candidate = slot;
+      slot = (uint32_t)pos;
+      if (candidate >= pos || pos - candidate > kMaxOffset ||
+          Read32(src + candidate) != sequence) {
+        pos += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+      size_t length = kMinMatch;
+      while (pos + length < match_limit &&
+             src[candidate + length] == src[pos + length]) {
+        ++length;
+      }
+      while (pos > anchor && candidate > 0 &&
+             src[pos - 1] == src[candidate - 1]) {
+        --pos;
+        --candidate;
+        ++length;
+      }
+      EmitSequence(dst, src + anchor, pos - anchor, length, pos - candidate);
+      pos += length;
+      anchor = pos;
+    }
+  }
+  EmitSequence(dst, src + anchor, size - anchor, 0, 0);
+}
+
+/*
+  LzDecompress
+
+  Decodes a block written by LzCompress, checking every length and offset
+  against both buffers, so corrupt input cannot read or write out of bounds.
+
+  @param const uint8_t* src -> the compressed block
+  @param size_t size -> number of bytes at src
+  @param uint8_t* dst -> buffer for the decompressed data
+  @param size_t dst_size -> the exact decompressed size
+
+  @return bool -> whether the block decoded to exactly dst_size bytes
+*/
+bool LzDecompress(const uint8_t* src,
+                  size_t size,
+                  uint8_t* dst,
+                  size_t dst_size) {
+  const uint8_t* in = src;
+  const uint8_t* in_end = src + size;
+  uint8_t* out = dst;
+  uint8_t* out_end = dst + dst_size;
+  while (in < in_end) {
+    uint8_t token = *in++;
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !ReadLength(in, in_end, literal_length)) {
+      return false;
+    }
+    if ((size_t)(in_end - in) < literal_length ||
+        (size_t)(out_end - out) < literal_length) {
+      return false;
+    }
+    memcpy(out, in, literal_length);
+    in += literal_length;
+    out += literal_length;
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      return false;
+    }
+    size_t offset = in[0] | ((size_t)in[1] << 8);
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && !ReadLength(in, in_end, match_length)) {
+      return false;
+    }
+    match_length += kMinMatch;
+    if (offset == 0 || offset > (size_t)(out - dst) ||
+        (size_t)(out_end - out) < match_length) {
+      return false;
+    }
+    const uint8_t* match = out - offset;
+    if (offset >= match_length) {
+      memcpy(out, match, match_length);
+    } else {
+      // overlapping match: repeats the last offset bytes
+      for (size_t i = 0; i < match_length; ++i) {
+        out[i] = match[i];
+      }
+    }
+    out += match_length;
+  }
+  return out == out_end;
+}
@@ -11,15 +11,18 @@ using namespace cv;
 int main() {
   // Load in dataset
   DataLoader dataset(/* YOUR INPUT IMAGE DIRECTORY PATH */);
-  RNG rng();
+  dataset.SetSeed(/* ANY SEED */ 0);
 
   // Add augmentations
-  dataset.AddAugmentation(
-      [&rng](const Mat& img) { return RandomHorizontalFlip(img, 0.5, rng); });
-  dataset.AddAugmentation(
-      [&rng](const Mat& img) { return RandomVerticalFlip(img, 0.5, rng); });
-  dataset.AddAugmentation(
-      [&rng](const Mat& img) { return RandomSlide(img, 0.5, rng); });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomHorizontalFlip(img, 0.5, rng);
+  });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomVerticalFlip(img, 0.5, rng);
+  });
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomSlide(img, 0.5, rng);
+  });
 
   // Save augmented images on the fly
   dataset.AugmentAndSaveToDirectory(/* YOUR OUTPUT IMAGE DIRECTORY PATH */);
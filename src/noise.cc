@@ -0,0 +1,172 @@
+#include "noise.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace cv;
+
+// Maps 32 random bits to a float in (0, 1). Zero is excluded so the log of
+// Box-Muller stays finite.
+static inline float ToUnitInterval(uint32_t bits) {
+  return ((bits >> 9) + 0.5f) * (1.f / 8388608.f);
+}
+
+GaussianGenerator::GaussianGenerator(uint64_t seed)
+    : key_(Philox4x32::MakeKey(seed)) {}
+
+void GaussianGenerator::Reseed(uint64_t seed) {
+  key_ = Philox4x32::MakeKey(seed);
+}
+
+/*
+  Fill
+
+  Generates n standard normal samples. Each Philox block gives two
+  (radius, angle) uniform pairs and Box-Muller turns every pair into two
+  samples: the cosines fill the front of out and the sines the back.
+
+  @param uint32_t stream -> index of the stream, e.g. the image row
+  @param float* out -> buffer of at least n floats
+  @param int n -> number of samples
+*/
+void GaussianGenerator::Fill(uint32_t stream, float* out, int n) {
+  if (n <= 0) {
+    return;
+  }
+  int pairs = (n + 1) / 2;
+  int blocks = (pairs + 1) / 2;
+  radius_.resize(2 * blocks);
+  angle_.resize(2 * blocks);
+  for (int b = 0; b < blocks; ++b) {
+    Philox4x32::Counter bits =
+        Philox4x32::Generate({(uint32_t)b, stream, 0, 0}, key_);
+    radius_[2 * b] = ToUnitInterval(bits[0]);
+    angle_[2 * b] = ToUnitInterval(bits[1]);
+    radius_[2 * b + 1] = ToUnitInterval(bits[2]);
+    angle_[2 * b + 1] = ToUnitInterval(bits[3]);
+  }
+
+  Mat radius(1, pairs, CV_32F, radius_.data());
+  Mat angle(1, pairs, CV_32F, angle_.data());
+  cv::log(radius, radius);
+  radius.convertTo(radius, CV_32F, -2.0);
+  cv::sqrt(radius, radius);
+  angle.convertTo(angle, CV_32F, 2 * CV_PI);
+
+  // An odd n has no room for the last sine, so go through scratch rows.
+  if (n % 2 == 0) {
+    Mat x(1, pairs, CV_32F, out);
+    Mat y(1, pairs, CV_32F, out + pairs);
+    polarToCart(radius, angle, x, y);
+    return;
+  }
+  x_.resize(pairs);
+  y_.resize(pairs);
+  Mat x(1, pairs, CV_32F, x_.data());
+  Mat y(1, pairs, CV_32F, y_.data());
+  polarToCart(radius, angle, x, y);
+  std::memcpy(out, x_.data(), pairs * sizeof(float));
+  std::memcpy(out + pairs, y_.data(), (n - pairs) * sizeof(float));
+}
+
+/*
+  NoiseBank
+
+  Generates the tiles row by row with a GaussianGenerator, one stream per
+  tile row, and converts them to the storage depth with saturation.
+
+  @param const std::vector<double>& mean -> mean of the noise per channel
+  @param const std::vector<double>& std_dev -> standard deviation per channel
+  @param int channels -> channels of the images the bank is used with;
+  channels without a mean and standard deviation get no noise
+  @param int num_tiles -> number of independent tiles
+  @param const Size& tile_size -> size of every tile
+  @param uint64_t seed -> seed of the generator
+  @param int depth -> depth the tiles are stored with
+*/
+NoiseBank::NoiseBank(const std::vector<double>& mean,
+                     const std::vector<double>& std_dev,
+                     int channels,
+                     int num_tiles,
+                     const Size& tile_size,
+                     uint64_t seed,
+                     int depth)
+    : channels_(channels), tile_size_(tile_size) {
+  assert(mean.size() == std_dev.size());
+  assert(num_tiles > 0 && !tile_size.empty());
+
+  int row_size = tile_size.width * channels;
+  std::vector<float> scale(row_size);
+  std::vector<float> shift(row_size);
+  for (int j = 0; j < row_size; ++j) {
+    size_t k = j % channels;
+    scale[j] = k < std_dev.size() ? (float)std_dev[k] : 0.f;
+    shift[j] = k < mean.size() ? (float)mean[k] : 0.f;
+  }
+
+  GaussianGenerator gaussian(seed);
+  std::vector<float> noise(row_size);
+  Mat noise_row(1, row_size, CV_32F, noise.data());
+  for (int t = 0; t < num_tiles; ++t) {
+    Mat tile(tile_size, CV_MAKETYPE(depth, channels));
+    for (int i = 0; i < tile.rows; ++i) {
+      gaussian.Fill(t * tile.rows + i, noise.data(), row_size);
+      for (int j = 0; j < row_size; ++j) {
+        noise[j] = noise[j] * scale[j] + shift[j];
+      }
+      noise_row.convertTo(tile.row(i).reshape(1), depth);
+    }
+    Mat mirrored;
+    flip(tile, mirrored, 1);
+    tiles_.push_back(tile);
+    mirrored_tiles_.push_back(mirrored);
+  }
+}
+
+/*
+  Add
+
+  Adds a window of a random tile to src. The window starts at a random offset
+  and wraps around the tile edges, so images larger than a tile are covered
+  too; its rows are walked up or down at random and the tile is used as is or
+  mirrored at random, which gives every tile four distinct orientations.
+
+  @param const Mat& src -> the original image
+  @param Mat& dst -> the image with noise, may be src
+  @param RNG& rng -> opencv RNG object for generating a random number.
+*/
+void NoiseBank::Add(const Mat& src, Mat& dst, RNG& rng) const {
+  assert(src.channels() == channels_);
+  int tile_index = rng.uniform(0, (int)tiles_.size());
+  int x_offset = rng.uniform(0, tile_size_.width);
+  int y_offset = rng.uniform(0, tile_size_.height);
+  bool mirror = rng.uniform(0, 2) == 1;
+  bool upside_down = rng.uniform(0, 2) == 1;
+  const Mat& tile = mirror ? mirrored_tiles_[tile_index] : tiles_[tile_index];
+
+  dst.create(src.size(), src.type());
+  int tile_rows = tile_size_.height;
+  int tile_cols = tile_size_.width;
+  for (int i = 0; i < src.rows; ++i) {
+    int tile_row = upside_down ? y_offset - i % tile_rows : y_offset + i;
+    tile_row = (tile_row + tile_rows) % tile_rows;
+    // one add per contiguous run of the tile row
+    for (int x = 0; x < src.cols;) {
+      int tile_col = (x_offset + x) % tile_cols;
+      int run = std::min(tile_cols - tile_col, src.cols - x);
+      add(src.row(i).colRange(x, x + run),
+          tile.row(tile_row).colRange(tile_col, tile_col + run),
+          dst.row(i).colRange(x, x + run),
+          noArray(),
+          src.depth());
+      x += run;
+    }
+  }
+}
+
+int NoiseBank::Channels() const { return channels_; }
+
+int NoiseBank::NumTiles() const { return tiles_.size(); }
+
+Size NoiseBank::TileSize() const { return tile_size_; }
@@ -0,0 +1,133 @@
+#include "op_stats.hpp"
+
+#include <cstdio>
+
+// Values below 16 ns get a bucket each; above, every power of two [2^e,
+// 2^(e+1)) is split into 16 buckets of width 2^(e-4).
+static int Bucket(uint64_t nanos) {
+  if (nanos < 16) {
+    return (int)nanos;
+  }
+  int e = 63 - __builtin_clzll(nanos);
+  return (e - 3) * 16 + (int)((nanos >> (e - 4)) & 15);
+}
+
+// Middle of a bucket, in nanoseconds.
+static double BucketValue(int bucket) {
+  if (bucket < 16) {
+    return bucket;
+  }
+  int e = bucket / 16 + 3;
+  double width = (double)(1ull << (e - 4));
+  return (16 + bucket % 16) * width + width / 2;
+}
+
+OpStatsRecorder::OpStatsRecorder() { Reset(); }
+
+void OpStatsRecorder::Record(uint64_t nanos,
+                             uint64_t bytes_in,
+                             uint64_t bytes_out) {
+  total_ns_.fetch_add(nanos, std::memory_order_relaxed);
+  bytes_in_.fetch_add(bytes_in, std::memory_order_relaxed);
+  bytes_out_.fetch_add(bytes_out, std::memory_order_relaxed);
+  buckets_[Bucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+  Snapshot
+
+  Reads the counters. Calls recorded concurrently may be counted in some
+  fields and not yet in others.
+
+  @param const std::string& name -> name to give the result
+
+  @return OpStats -> the counters, with the p50 and p99 latencies
+*/
+OpStats OpStatsRecorder::Snapshot(const std::string& name) const {
+  OpStats stats;
+  stats.name = name;
+  stats.total_ms = total_ns_.load(std::memory_order_relaxed) / 1e6;
+  stats.bytes_in = bytes_in_.load(std::memory_order_relaxed);
+  stats.bytes_out = bytes_out_.load(std::memory_order_relaxed);
+  std::vector<uint64_t> counts(kBuckets);
+  for (int i = 0; i < kBuckets; ++i) {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    stats.calls += counts[i];
+  }
+  // percentiles are ranks among the calls the histogram holds
+  uint64_t p50_rank = (stats.calls + 1) / 2;
+  uint64_t p99_rank = stats.calls - stats.calls / 100;
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets && seen < p99_rank; ++i) {
+    if (seen < p50_rank && seen + counts[i] >= p50_rank) {
+      stats.p50_us = BucketValue(i) / 1e3;
+    }
+    seen += counts[i];
+    if (seen >= p99_rank) {
+      stats.p99_us = BucketValue(i) / 1e3;
+    }
+  }
+  return stats;
+}
+
+void OpStatsRecorder::Reset() {
+  total_ns_ = 0;
+  bytes_in_ = 0;
+  bytes_out_ = 0;
+  for (std::atomic<uint64_t>& bucket : buckets_) {
+    bucket = 0;
+  }
+}
+
+void AppendJsonString(std::string& out, const std::string& s) {
+  out += '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out += escape;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+static void AppendJson(std::string& out, const OpStats& stats) {
+  char numbers[256];
+  out += "{\"name\":";
+  AppendJsonString(out, stats.name);
+  snprintf(numbers,
+           sizeof(numbers),
+           ",\"calls\":%llu,\"total_ms\":%.3f,\"p50_us\":%.1f,"
+           "\"p99_us\":%.1f,\"bytes_in\":%llu,\"bytes_out\":%llu}",
+           (unsigned long long)stats.calls,
+           stats.total_ms,
+           stats.p50_us,
+           stats.p99_us,
+           (unsigned long long)stats.bytes_in,
+           (unsigned long long)stats.bytes_out);
+  out += numbers;
+}
+
+std::string StatsToJson(const LoaderStats& stats) {
+  char elapsed[64];
+  snprintf(elapsed, sizeof(elapsed), "{\"elapsed_s\":%.3f", stats.elapsed_s);
+  std::string out = elapsed;
+  out += ",\"decode\":";
+  AppendJson(out, stats.decode);
+  out += ",\"augmentations\":[";
+  for (size_t i = 0; i < stats.augmentations.size(); ++i) {
+    if (i > 0) {
+      out += ',';
+    }
+    AppendJson(out, stats.augmentations[i]);
+  }
+  out += "],\"encode\":";
+  AppendJson(out, stats.encode);
+  out += '}';
+  return out;
+}
@@ -0,0 +1,26 @@
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+#include "data_loader.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Decodes every image of a directory into a packed file that DataLoader can
+// memory map with UsePackedDataset.
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    cerr << "usage: " << argv[0] << " <image directory> <packed file>" << endl;
+    return 1;
+  }
+  try {
+    DataLoader dataset(argv[1]);
+    dataset.SavePacked(argv[2]);
+    PackedDataset packed(argv[2]);
+    cout << "packed " << packed.Size() << " images into " << argv[2] << endl;
+  } catch (const std::exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,178 @@
+#include "packed_dataset.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace cv;
+
+static const char kMagic[8] = {'R', 'J', 'K', 'P', 'A', 'C', 'K', '\0'};
+static const uint32_t kVersion = 1;
+// Every image starts on a cache line, so rows of images whose width is a
+// multiple of the line are aligned for vector loads.
+static const uint32_t kAlignment = 64;
+
+PackedDatasetWriter::PackedDatasetWriter(const std::string& path)
+    : out_(path, std::ios::binary | std::ios::trunc) {
+  if (!out_) {
+    throw std::runtime_error("Cannot create packed dataset " + path);
+  }
+  // placeholder, rewritten by Finish
+  PackedFileHeader header = {};
+  out_.write((const char*)&header, sizeof(header));
+  position_ = sizeof(header);
+}
+
+PackedDatasetWriter::~PackedDatasetWriter() {
+  if (!finished_) {
+    try {
+      Finish();
+    } catch (...) {
+    }
+  }
+}
+
+void PackedDatasetWriter::Pad() {
+  static const char zeros[kAlignment] = {};
+  uint64_t padding = (kAlignment - position_ % kAlignment) % kAlignment;
+  out_.write(zeros, padding);
+  position_ += padding;
+}
+
+/*
+  Add
+
+  Appends an image to the file. Non-continuous images are written row by
+  row, so ROIs can be packed without copying them first.
+
+  @param const std::string& name -> name of the image, e.g. its file name
+  @param const Mat& img -> the decoded image
+*/
+void PackedDatasetWriter::Add(const std::string& name, const Mat& img) {
+  Pad();
+  PackedFileEntry entry = {};
+  entry.offset = position_;
+  entry.step = img.cols * img.elemSize();
+  entry.rows = img.rows;
+  entry.cols = img.cols;
+  entry.type = img.type();
+  entry.name_offset = names_.size();
+  entry.name_length = (uint32_t)name.size();
+  for (int i = 0; i < img.rows; ++i) {
+    out_.write((const char*)img.ptr(i), entry.step);
+  }
+  if (!out_) {
+    throw std::runtime_error("Failed to write packed dataset");
+  }
+  position_ += entry.step * img.rows;
+  names_ += name;
+  entries_.push_back(entry);
+}
+
+/*
+  Finish
+
+  Writes the index and the names after the pixels and fills in the header.
+  Called by the destructor if needed, but only an explicit call reports
+  errors.
+*/
+void PackedDatasetWriter::Finish() {
+  finished_ = true;
+  Pad();
+  PackedFileHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.alignment = kAlignment;
+  header.count = entries_.size();
+  header.index_offset = position_;
+  header.names_offset = position_ + entries_.size() * sizeof(PackedFileEntry);
+  header.names_size = names_.size();
+  out_.write((const char*)entries_.data(),
+             entries_.size() * sizeof(PackedFileEntry));
+  out_.write(names_.data(), names_.size());
+  out_.seekp(0);
+  out_.write((const char*)&header, sizeof(header));
+  out_.close();
+  if (out_.fail()) {
+    throw std::runtime_error("Failed to write packed dataset");
+  }
+}
+
+/*
+  PackedDataset
+
+  Maps a packed file and checks that its header, index and names all lie
+  within the file, so a truncated or foreign file is rejected up front
+  instead of faulting on access.
+
+  @param const std::string& path -> the packed file
+*/
+PackedDataset::PackedDataset(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open packed dataset " + path);
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(PackedFileHeader)) {
+    close(fd);
+    throw std::runtime_error("Not a packed dataset: " + path);
+  }
+  size_ = info.st_size;
+  void* mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Cannot map packed dataset " + path);
+  }
+  data_ = (const uint8_t*)mapping;
+
+  const PackedFileHeader* header = (const PackedFileHeader*)data_;
+  bool valid = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+               header->version == kVersion &&
+               header->index_offset <= size_ &&
+               header->count <= (size_ - header->index_offset) /
+                                    sizeof(PackedFileEntry) &&
+               header->names_offset <= size_ &&
+               header->names_size <= size_ - header->names_offset;
+  for (uint64_t i = 0; valid && i < header->count; ++i) {
+    const PackedFileEntry& entry =
+        ((const PackedFileEntry*)(data_ + header->index_offset))[i];
+    // rows are bounded by dividing, as step * rows could overflow
+    valid = entry.rows >= 0 && entry.cols >= 0 && entry.type >= 0 &&
+            entry.type == CV_MAT_TYPE(entry.type) &&
+            entry.step == entry.cols * (uint64_t)CV_ELEM_SIZE(entry.type) &&
+            entry.offset <= size_ &&
+            (entry.step == 0 ||
+             (uint64_t)entry.rows <= (size_ - entry.offset) / entry.step) &&
+            entry.name_offset <= header->names_size &&
+            entry.name_length <= header->names_size - entry.name_offset;
+  }
+  if (!valid) {
+    munmap(mapping, size_);
+    throw std::runtime_error("Corrupt packed dataset " + path);
+  }
+  count_ = header->count;
+  entries_ = (const PackedFileEntry*)(data_ + header->index_offset);
+  names_ = (const char*)(data_ + header->names_offset);
+}
+
+PackedDataset::~PackedDataset() { munmap((void*)data_, size_); }
+
+size_t PackedDataset::Size() const { return count_; }
+
+Mat PackedDataset::Image(size_t i) const {
+  const PackedFileEntry& entry = entries_[i];
+  return Mat(entry.rows,
+             entry.cols,
+             entry.type,
+             (void*)(data_ + entry.offset),
+             entry.step);
+}
+
+std::string PackedDataset::Name(size_t i) const {
+  return std::string(names_ + entries_[i].name_offset,
+                     entries_[i].name_length);
+}
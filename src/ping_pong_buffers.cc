@@ -0,0 +1,49 @@
+#include "ping_pong_buffers.hpp"
+
+using namespace cv;
+
+int PingPongBuffers::IndexOf(const Mat& image) const {
+  for (int i = 0; i < 2; ++i) {
+    const uchar* begin = storage_[i].data;
+    if (begin != nullptr && image.data >= begin &&
+        image.data < begin + storage_[i].total()) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+  Target
+
+  Picks the buffer that does not hold input, grows it if it is smaller than
+  the requested image and returns a view of it with the requested shape.
+
+  @param const Mat& input -> the image the next op reads
+  @param const Size& size -> size the op is expected to write
+  @param int type -> type the op is expected to write
+
+  @return Mat -> view to pass to the op as its output
+*/
+Mat PingPongBuffers::Target(const Mat& input, const Size& size, int type) {
+  int i = IndexOf(input) == 0 ? 1 : 0;
+  size_t bytes = size.area() * CV_ELEM_SIZE(type);
+  if (storage_[i].total() < bytes) {
+    storage_[i].create(1, (int)bytes, CV_8UC1);
+  }
+  return Mat(size, type, storage_[i].data);
+}
+
+bool PingPongBuffers::Holds(const Mat& image) const {
+  return IndexOf(image) >= 0;
+}
+
+Mat PingPongBuffers::Detach(const Mat& image, const Mat& replacement) {
+  int i = IndexOf(image);
+  if (i < 0) {
+    return Mat();
+  }
+  Mat buffer = storage_[i];
+  storage_[i] = replacement;
+  return buffer;
+}
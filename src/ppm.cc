@@ -0,0 +1,218 @@
+#include "ppm.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstring>
+#include <opencv2/imgproc.hpp>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace cv;
+
+// Reads one decimal number of a PPM header, skipping whitespace and comments.
+static bool ReadHeaderNumber(const uint8_t* data,
+                             size_t size,
+                             size_t& pos,
+                             int& value) {
+  while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+    if (data[pos] == '#') {
+      while (pos < size && data[pos] != '\n') {
+        ++pos;
+      }
+    } else {
+      ++pos;
+    }
+  }
+  if (pos == size || !isdigit(data[pos])) {
+    return false;
+  }
+  value = 0;
+  while (pos < size && isdigit(data[pos]) && value < (1 << 24)) {
+    value = value * 10 + (data[pos++] - '0');
+  }
+  return true;
+}
+
+/*
+  ClassifyBlock
+
+  Classifies 16 bytes of an ASCII PPM body at once.
+
+  @param const uint8_t* p -> the 16 bytes
+  @param uint32_t& other -> set to a mask of the bytes that are neither digits
+  nor whitespace
+
+  @return uint32_t -> a mask with bit i set if byte i is a digit
+*/
+static inline uint32_t ClassifyBlock(const uint8_t* p, uint32_t& other) {
+#if defined(__SSE2__)
+  __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+  __m128i digit =
+      _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                    _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+  // ' ' and '\t' through '\r'
+  __m128i space = _mm_or_si128(
+      _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+      _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)),
+                    _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1))));
+  uint32_t digits = _mm_movemask_epi8(digit);
+  other = ~(digits | (uint32_t)_mm_movemask_epi8(space)) & 0xFFFF;
+  return digits;
+#else
+  uint32_t digits = 0;
+  uint32_t spaces = 0;
+  for (int i = 0; i < 16; ++i) {
+    digits |= (uint32_t)(p[i] >= '0' && p[i] <= '9') << i;
+    spaces |= (uint32_t)(p[i] == ' ' || (p[i] >= '\t' && p[i] <= '\r')) << i;
+  }
+  other = ~(digits | spaces) & 0xFFFF;
+  return digits;
+#endif
+}
+
+/*
+  ParseAsciiSamples
+
+  Parses the whitespace separated samples of a P3 body. Each block of 16
+  bytes is classified with ClassifyBlock; the digits that follow a
+  non-digit start a sample, so only those are visited, and the whitespace in
+  between costs nothing per byte.
+
+  @param const uint8_t* begin -> the first byte after the header
+  @param const uint8_t* end -> the end of the file
+  @param uint8_t* samples -> receives count samples
+  @param size_t count -> the number of samples the header announces
+
+  @return bool -> true if the body holds exactly count samples of at most 255
+  and nothing but whitespace between them
+*/
+static bool ParseAsciiSamples(const uint8_t* begin,
+                              const uint8_t* end,
+                              uint8_t* samples,
+                              size_t count) {
+  size_t n = 0;
+  // 1 if the byte before the current block is a digit
+  uint32_t carry = 0;
+  uint8_t tail[16];
+  for (const uint8_t* block = begin; block < end; block += 16) {
+    const uint8_t* bytes = block;
+    if (end - block < 16) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, block, end - block);
+      bytes = tail;
+    }
+    uint32_t other;
+    uint32_t digits = ClassifyBlock(bytes, other);
+    if (other != 0) {
+      return false;
+    }
+    uint32_t starts = digits & ~((digits << 1) | carry);
+    carry = digits >> 15;
+    while (starts != 0) {
+      const uint8_t* p = block + __builtin_ctz(starts);
+      starts &= starts - 1;
+      if (n == count) {
+        return false;
+      }
+      uint32_t value = *p++ - '0';
+      while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+        if (value > 255) {
+          return false;
+        }
+      }
+      samples[n++] = value;
+    }
+  }
+  return n == count;
+}
+
+Mat DecodePpm(const uint8_t* data, size_t size) {
+  if (size < 3 || data[0] != 'P' || (data[1] != '3' && data[1] != '6')) {
+    return Mat();
+  }
+  bool ascii = data[1] == '3';
+  size_t pos = 2;
+  int width, height, max_value;
+  if (!ReadHeaderNumber(data, size, pos, width) ||
+      !ReadHeaderNumber(data, size, pos, height) ||
+      !ReadHeaderNumber(data, size, pos, max_value) || width == 0 ||
+      height == 0 || max_value != 255 || pos == size || !isspace(data[pos])) {
+    return Mat();
+  }
+  // a single whitespace byte ends the header
+  ++pos;
+  // every sample takes at least one byte, which also bounds the allocation
+  size_t count = (size_t)width * height * 3;
+  if (count > size - pos) {
+    return Mat();
+  }
+
+  Mat img(height, width, CV_8UC3);
+  if (ascii) {
+    if (!ParseAsciiSamples(data + pos, data + size, img.data, count)) {
+      return Mat();
+    }
+    cvtColor(img, img, COLOR_RGB2BGR);
+  } else {
+    Mat rgb(height, width, CV_8UC3, (void*)(data + pos));
+    cvtColor(rgb, img, COLOR_RGB2BGR);
+  }
+  return img;
+}
+
+Mat ReadPpm(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Mat();
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return Mat();
+  }
+  size_t size = info.st_size;
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return Mat();
+  }
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  Mat img = DecodePpm((const uint8_t*)mapping, size);
+  munmap(mapping, size);
+  return img;
+}
+
+void EncodePpm(const Mat& img, std::vector<uint8_t>& encoded) {
+  int code;
+  switch (img.channels()) {
+    case 1:
+      code = COLOR_GRAY2RGB;
+      break;
+    case 3:
+      code = COLOR_BGR2RGB;
+      break;
+    case 4:
+      code = COLOR_BGRA2RGB;
+      break;
+    default:
+      code = -1;
+  }
+  if (img.depth() != CV_8U || code < 0) {
+    throw std::runtime_error("PPM needs 8-bit images with 1, 3 or 4 channels");
+  }
+  std::string header = "P6\n" + std::to_string(img.cols) + " " +
+                       std::to_string(img.rows) + "\n255\n";
+  encoded.resize(header.size() + img.total() * 3);
+  memcpy(encoded.data(), header.data(), header.size());
+  // cvtColor writes straight into the buffer
+  Mat rgb(img.rows, img.cols, CV_8UC3, encoded.data() + header.size());
+  cvtColor(img, rgb, code);
+}
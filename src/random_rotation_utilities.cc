@@ -1,3 +1,5 @@
+#include "random_rotation_utilities.hpp"
+
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
@@ -80,6 +82,51 @@ void CircumTransImgRect(const Size& img_size,
   CircumRect.height = max_y - min_y;
 }
 
+/*
+  RotationHomography
+
+  Collapses the per-pixel back projection of CreateMap into a single 3x3
+  homography. transMat is the 4x4 rotation/translation matrix used by
+  RotateImage. The returned matrix maps a destination pixel (dx, dy, 1),
+  relative to the top left corner of dst_rect, to the homogeneous source pixel
+  position.
+
+  @param const Size& src_size -> size of the source image
+  @param const Rect_<double>& dst_rect -> area of the rotated image to map
+  @param const Mat& transMat -> 4x4 CV_64FC1 rotation matrix
+
+  @return Matx33d -> destination to source homography
+*/
+Matx33d RotationHomography(const Size& src_size,
+                           const Rect_<double>& dst_rect,
+                           const Mat& transMat) {
+  double Z = transMat.at<double>(2, 3);
+  Mat invTransMat = transMat.inv();
+  const double* r0 = invTransMat.ptr<double>(0);
+  const double* r1 = invTransMat.ptr<double>(1);
+  const double* r2 = invTransMat.ptr<double>(2);
+
+  // For dst_pos = (x, y, Z) the source position is
+  //   src = inv(0:2, 0:3) * dst_pos * (-inv(2, 3) / (inv(2, 0:3) * dst_pos))
+  //         + inv(0:2, 3)
+  // which is a ratio of two linear forms in dst_pos.
+  double cx = r0[3] + (double)src_size.width / 2;
+  double cy = r1[3] + (double)src_size.height / 2;
+  Matx33d to_src(-r2[3] * r0[0] + cx * r2[0],
+                 -r2[3] * r0[1] + cx * r2[1],
+                 -r2[3] * r0[2] + cx * r2[2],
+                 -r2[3] * r1[0] + cy * r2[0],
+                 -r2[3] * r1[1] + cy * r2[1],
+                 -r2[3] * r1[2] + cy * r2[2],
+                 r2[0],
+                 r2[1],
+                 r2[2]);
+
+  // dst_pos = (dst_rect.x + dx, dst_rect.y + dy, Z)
+  Matx33d from_dst(1, 0, dst_rect.x, 0, 1, dst_rect.y, 0, 0, Z);
+  return to_src * from_dst;
+}
+
 void CreateMap(const Size& src_size,
                const Rect_<double>& dst_rect,
                const Mat& transMat,
@@ -88,41 +135,35 @@ void CreateMap(const Size& src_size,
   map_x.create(dst_rect.size(), CV_32FC1);
   map_y.create(dst_rect.size(), CV_32FC1);
 
-  double Z = transMat.at<double>(2, 3);
-
-  Mat invTransMat = transMat.inv();
-  Mat dst_pos(3, 1, CV_64FC1);
-  dst_pos.at<double>(2, 0) = Z;
+  Matx33d H = RotationHomography(src_size, dst_rect, transMat);
   for (int dy = 0; dy < map_x.rows; dy++) {
-    dst_pos.at<double>(1, 0) = dst_rect.y + dy;
+    float* row_x = map_x.ptr<float>(dy);
+    float* row_y = map_y.ptr<float>(dy);
+    double x0 = H(0, 1) * dy + H(0, 2);
+    double y0 = H(1, 1) * dy + H(1, 2);
+    double w0 = H(2, 1) * dy + H(2, 2);
     for (int dx = 0; dx < map_x.cols; dx++) {
-      dst_pos.at<double>(0, 0) = dst_rect.x + dx;
-      Mat rMat = -invTransMat(Rect(3, 2, 1, 1)) /
-                 (invTransMat(Rect(0, 2, 3, 1)) * dst_pos);
-      Mat src_pos = invTransMat(Rect(0, 0, 3, 2)) * dst_pos * rMat +
-                    invTransMat(Rect(3, 0, 1, 2));
-      map_x.at<float>(dy, dx) =
-          src_pos.at<double>(0, 0) + (float)src_size.width / 2;
-      map_y.at<float>(dy, dx) =
-          src_pos.at<double>(1, 0) + (float)src_size.height / 2;
+      double w = 1.0 / (w0 + H(2, 0) * dx);
+      row_x[dx] = (float)((x0 + H(0, 0) * dx) * w);
+      row_y[dx] = (float)((y0 + H(1, 0) * dx) * w);
     }
   }
 }
 
-void RotateImage(const Mat& src,
-                 Mat& dst,
-                 float yaw,
-                 float pitch,
-                 float roll,
-                 float Z = 1000,
-                 int interpolation = INTER_LINEAR,
-                 int border_mode = BORDER_CONSTANT,
-                 const Scalar& border_color = Scalar(0, 0, 0)) {
+// Builds the 4x4 rotation matrix used by CreateMap and the bounding box of the
+// rotated image for the given angles.
+void ComposeRotation(const Size& src_size,
+                     float yaw,
+                     float pitch,
+                     float roll,
+                     float Z,
+                     Mat& rotMat,
+                     Rect_<double>& CircumRect) {
   // rotation matrix
   Mat rotMat_3x4;
   composeExternalMatrix(yaw, pitch, roll, 0, 0, Z, rotMat_3x4);
 
-  Mat rotMat = Mat::eye(4, 4, rotMat_3x4.type());
+  rotMat = Mat::eye(4, 4, rotMat_3x4.type());
   rotMat_3x4.copyTo(rotMat(Rect(0, 0, 4, 3)));
 
   // From 2D coordinates to 3D coordinates
@@ -131,8 +172,8 @@ void RotateImage(const Mat& src,
   invPerspMat.at<double>(0, 0) = 1;
   invPerspMat.at<double>(1, 1) = 1;
   invPerspMat.at<double>(3, 2) = 1;
-  invPerspMat.at<double>(0, 2) = -(double)src.cols / 2;
-  invPerspMat.at<double>(1, 2) = -(double)src.rows / 2;
+  invPerspMat.at<double>(0, 2) = -(double)src_size.width / 2;
+  invPerspMat.at<double>(1, 2) = -(double)src_size.height / 2;
 
   Mat perspMat = Mat::zeros(3, 4, CV_64FC1);
   perspMat.at<double>(0, 0) = Z;
@@ -140,12 +181,154 @@ void RotateImage(const Mat& src,
   perspMat.at<double>(2, 2) = 1;
 
   Mat transMat = perspMat * rotMat * invPerspMat;
+  CircumTransImgRect(src_size, transMat, CircumRect);
+}
+
+void RotateImage(const Mat& src,
+                 Mat& dst,
+                 float yaw,
+                 float pitch,
+                 float roll,
+                 float Z,
+                 int interpolation,
+                 int border_mode,
+                 const Scalar& border_color) {
+  Mat rotMat;
   Rect_<double> CircumRect;
-  CircumTransImgRect(src.size(), transMat, CircumRect);
+  ComposeRotation(src.size(), yaw, pitch, roll, Z, rotMat, CircumRect);
+
+  // warpPerspective builds the same sampling grid as CreateMap block by block,
+  // so no full size map has to be allocated.
+  Matx33d H = RotationHomography(src.size(), CircumRect, rotMat);
+  Size dst_size = CircumRect.size();
+  warpPerspective(src,
+                  dst,
+                  H,
+                  dst_size,
+                  interpolation | WARP_INVERSE_MAP,
+                  border_mode,
+                  border_color);
+}
 
+/*
+  RotateImage
+
+  Same as RotateImage, but the angles are rounded to the cache's angle step and
+  the fixed-point remap tables for them are taken from (or added to) cache.
+  On a cache hit the rotation costs a single remap.
+
+  @param RotationMapCache& cache -> cache to look the remap tables up in
+*/
+void RotateImage(const Mat& src,
+                 Mat& dst,
+                 float yaw,
+                 float pitch,
+                 float roll,
+                 RotationMapCache& cache,
+                 float Z,
+                 int interpolation,
+                 int border_mode,
+                 const Scalar& border_color) {
+  std::shared_ptr<const RotationMapCache::Maps> maps =
+      cache.Get(src.size(), yaw, pitch, roll, Z, interpolation);
+  remap(src,
+        dst,
+        maps->map1,
+        maps->map2,
+        interpolation,
+        border_mode,
+        border_color);
+}
+
+RotationMapCache::RotationMapCache(size_t max_bytes, double angle_step)
+    : max_bytes_(max_bytes), angle_step_(angle_step) {}
+
+/*
+  Get
+
+  Returns the fixed-point (CV_16SC2 + interpolation table) remap tables that
+  rotate an image of src_size by the quantized angles, building them on a miss.
+  Least recently used tables are evicted once the cache exceeds its byte
+  budget. Safe to call from several threads.
+
+  @return std::shared_ptr<const Maps> -> the remap tables, valid even if they
+  are evicted while in use
+*/
+std::shared_ptr<const RotationMapCache::Maps> RotationMapCache::Get(
+    const Size& src_size,
+    float yaw,
+    float pitch,
+    float roll,
+    float Z,
+    int interpolation) {
+  Key key;
+  key.width = src_size.width;
+  key.height = src_size.height;
+  key.yaw = cvRound(yaw / angle_step_);
+  key.pitch = cvRound(pitch / angle_step_);
+  key.roll = cvRound(roll / angle_step_);
+  key.Z = Z;
+  key.nearest = interpolation == INTER_NEAREST;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, it->second.second);
+      return it->second.first;
+    }
+    ++misses_;
+  }
+
+  // Build outside the lock; two threads missing on the same key both build it
+  // and the second insert is dropped.
+  Mat rotMat;
+  Rect_<double> CircumRect;
+  ComposeRotation(src_size,
+                  key.yaw * angle_step_,
+                  key.pitch * angle_step_,
+                  key.roll * angle_step_,
+                  Z,
+                  rotMat,
+                  CircumRect);
   Mat map_x, map_y;
-  CreateMap(src.size(), CircumRect, rotMat, map_x, map_y);
-  remap(src, dst, map_x, map_y, interpolation, border_mode, border_color);
+  CreateMap(src_size, CircumRect, rotMat, map_x, map_y);
+
+  auto maps = std::make_shared<Maps>();
+  convertMaps(map_x, map_y, maps->map1, maps->map2, CV_16SC2, key.nearest);
+  maps->bytes = maps->map1.total() * maps->map1.elemSize() +
+                maps->map2.total() * maps->map2.elemSize();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (maps->bytes > max_bytes_ || entries_.count(key) != 0) {
+    return maps;
+  }
+  lru_.push_front(key);
+  entries_[key] = std::make_pair(maps, lru_.begin());
+  bytes_ += maps->bytes;
+  while (bytes_ > max_bytes_) {
+    auto oldest = entries_.find(lru_.back());
+    bytes_ -= oldest->second.first->bytes;
+    entries_.erase(oldest);
+    lru_.pop_back();
+  }
+  return maps;
+}
+
+size_t RotationMapCache::Hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+size_t RotationMapCache::Misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+size_t RotationMapCache::Bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
 }
 
 // Keep center and expand rectangle for rotation
@@ -0,0 +1,28 @@
+#include "rng_streams.hpp"
+
+#include "philox.hpp"
+
+using namespace cv;
+
+static thread_local StreamId current_stream;
+
+/*
+  StreamRng
+
+  Derives the state of an RNG from its stream id with one Philox block, so
+  every (epoch, image, op) gets an independent sequence that does not depend
+  on which thread runs it or in which order.
+
+  @param const StreamId& id -> the stream
+
+  @return RNG -> generator seeded for the stream
+*/
+RNG StreamRng(const StreamId& id) {
+  Philox4x32::Counter bits = Philox4x32::Generate(
+      {id.image, id.op, id.epoch, 0}, Philox4x32::MakeKey(id.seed));
+  return RNG(((uint64)bits[1] << 32) | bits[0]);
+}
+
+void SetCurrentStream(const StreamId& id) { current_stream = id; }
+
+const StreamId& CurrentStream() { return current_stream; }
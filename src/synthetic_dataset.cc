@@ -0,0 +1,208 @@
+#include "synthetic_dataset.hpp"
+
+#include <boost/filesystem.hpp>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stdexcept>
+
+#include "rng_streams.hpp"
+
+using namespace cv;
+
+// Checks that weights is empty or holds one nonnegative weight per choice,
+// not all zero.
+static void CheckWeights(const std::vector<double>& weights,
+                         size_t choices,
+                         const std::string& what) {
+  if (choices == 0) {
+    throw std::runtime_error("Synthetic datasets need at least one " + what);
+  }
+  if (weights.empty()) {
+    return;
+  }
+  double total = 0;
+  for (double weight : weights) {
+    if (weight < 0) {
+      throw std::runtime_error("Negative " + what + " weight");
+    }
+    total += weight;
+  }
+  if (weights.size() != choices || total <= 0) {
+    throw std::runtime_error("Need one " + what + " weight per " + what +
+                             ", not all zero");
+  }
+}
+
+// Index of a choice drawn with probabilities proportional to weights, or
+// uniformly if weights is empty.
+static size_t DrawWeighted(const std::vector<double>& weights,
+                           size_t choices,
+                           RNG& rng) {
+  if (weights.empty()) {
+    return rng.uniform(0, (int)choices);
+  }
+  double x = rng.uniform(
+      0.0, std::accumulate(weights.begin(), weights.end(), 0.0));
+  for (size_t i = 0; i + 1 < choices; ++i) {
+    if (x < weights[i]) {
+      return i;
+    }
+    x -= weights[i];
+  }
+  return choices - 1;
+}
+
+static Scalar RandomColor(RNG& rng) {
+  return Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+}
+
+Mat SyntheticImage(const Size& size, RNG& rng) {
+  Mat img(size, CV_8UC3);
+  // gradient from color a to color b along a random direction
+  Scalar a = RandomColor(rng);
+  Scalar b = RandomColor(rng);
+  double angle = rng.uniform(0.0, 2 * CV_PI);
+  double cx = std::cos(angle);
+  double cy = std::sin(angle);
+  // cx * x + cy * y, shifted and scaled to [0, 1] over the image
+  double t0 = std::min(0.0, cx * (size.width - 1)) +
+              std::min(0.0, cy * (size.height - 1));
+  double span = std::abs(cx) * (size.width - 1) +
+                std::abs(cy) * (size.height - 1);
+  span = std::max(span, 1.0);
+  for (int y = 0; y < size.height; ++y) {
+    uchar* row = img.ptr<uchar>(y);
+    for (int x = 0; x < size.width; ++x) {
+      double t = (cx * x + cy * y - t0) / span;
+      for (int c = 0; c < 3; ++c) {
+        row[3 * x + c] = saturate_cast<uchar>(a[c] + (b[c] - a[c]) * t);
+      }
+    }
+  }
+
+  int shapes = rng.uniform(4, 16);
+  for (int i = 0; i < shapes; ++i) {
+    Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+    Size axes(rng.uniform(1, size.width / 4 + 2),
+              rng.uniform(1, size.height / 4 + 2));
+    if (rng.uniform(0, 2) == 0) {
+      rectangle(img,
+                Rect(center - Point(axes.width, axes.height),
+                     Size(2 * axes.width, 2 * axes.height)),
+                RandomColor(rng),
+                FILLED);
+    } else {
+      ellipse(img,
+              center,
+              axes,
+              rng.uniform(0.0, 180.0),
+              0,
+              360,
+              RandomColor(rng),
+              FILLED,
+              LINE_AA);
+    }
+  }
+
+  // sensor-like noise, drawn around 128 and added back around 0
+  Mat noise(size, CV_8UC3);
+  rng.fill(noise, RNG::NORMAL, 128, 4);
+  addWeighted(img, 1, noise, 1, -128, img);
+  return img;
+}
+
+std::vector<std::string> GenerateSyntheticDataset(
+    const std::string& directory, const SyntheticDatasetOptions& options) {
+  CheckWeights(options.size_weights, options.sizes.size(), "size");
+  CheckWeights(options.format_weights, options.formats.size(), "format");
+  if (options.size_jitter < 0 || options.size_jitter >= 1) {
+    throw std::runtime_error("Size jitter must be in [0, 1)");
+  }
+
+  // Sizes, formats and paths are drawn up front, so that they do not depend
+  // on the order the images are written in.
+  struct Plan {
+    Size size;
+    SyntheticFormat format;
+    std::string path;
+  };
+  std::vector<Plan> plans(options.count);
+  boost::filesystem::create_directories(directory);
+  for (size_t i = 0; i < options.count; ++i) {
+    StreamId id;
+    id.seed = options.seed;
+    id.image = i;
+    RNG rng = StreamRng(id);
+    Size size = options.sizes[DrawWeighted(
+        options.size_weights, options.sizes.size(), rng)];
+    double jitter_x = rng.uniform(-options.size_jitter, options.size_jitter);
+    double jitter_y = rng.uniform(-options.size_jitter, options.size_jitter);
+    plans[i].size = Size(std::max(1, cvRound(size.width * (1 + jitter_x))),
+                         std::max(1, cvRound(size.height * (1 + jitter_y))));
+    plans[i].format = options.formats[DrawWeighted(
+        options.format_weights, options.formats.size(), rng)];
+
+    std::string parent = directory;
+    if (options.files_per_directory > 0) {
+      char subdirectory[32];
+      snprintf(subdirectory,
+               sizeof(subdirectory),
+               "/%06zu",
+               i / options.files_per_directory);
+      parent += subdirectory;
+      if (i % options.files_per_directory == 0) {
+        boost::filesystem::create_directories(parent);
+      }
+    }
+    char name[32];
+    snprintf(name,
+             sizeof(name),
+             "/%08zu.%s",
+             i,
+             plans[i].format == SyntheticFormat::kJpeg  ? "jpg"
+             : plans[i].format == SyntheticFormat::kPng ? "png"
+                                                        : "ppm");
+    plans[i].path = parent + name;
+  }
+
+  std::vector<char> written(options.count, 0);
+  parallel_for_(Range(0, (int)options.count), [&](const Range& range) {
+    for (int i = range.start; i < range.end; ++i) {
+      // the pixels come from a stream of their own, after the plan's
+      StreamId id;
+      id.seed = options.seed;
+      id.image = i;
+      id.op = 1;
+      RNG rng = StreamRng(id);
+      Mat img = SyntheticImage(plans[i].size, rng);
+      std::vector<int> params;
+      switch (plans[i].format) {
+        case SyntheticFormat::kJpeg:
+          params = {IMWRITE_JPEG_QUALITY, options.jpeg_quality};
+          break;
+        case SyntheticFormat::kPng:
+          params = {IMWRITE_PNG_COMPRESSION, options.png_compression};
+          break;
+        case SyntheticFormat::kPpm:
+          params = {IMWRITE_PXM_BINARY, 1};
+          break;
+        case SyntheticFormat::kPpmAscii:
+          params = {IMWRITE_PXM_BINARY, 0};
+          break;
+      }
+      written[i] = imwrite(plans[i].path, img, params);
+    }
+  });
+
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < options.count; ++i) {
+    if (!written[i]) {
+      throw std::runtime_error("Cannot write " + plans[i].path);
+    }
+    paths.push_back(plans[i].path);
+  }
+  return paths;
+}
@@ -0,0 +1,395 @@
+#include "tar_shards.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+static const uint64_t kBlock = 512;
+
+static uint64_t Padded(uint64_t size) {
+  return (size + kBlock - 1) / kBlock * kBlock;
+}
+
+// Numeric header field: octal text, or base-256 when the top bit of the first
+// byte is set (GNU, for values that do not fit in octal).
+static uint64_t ParseNumber(const char* field, size_t length) {
+  uint64_t value = 0;
+  if ((uint8_t)field[0] & 0x80) {
+    value = field[0] & 0x7f;
+    for (size_t i = 1; i < length; ++i) {
+      value = (value << 8) | (uint8_t)field[i];
+    }
+    return value;
+  }
+  for (size_t i = 0; i < length && field[i] != '\0'; ++i) {
+    if (field[i] >= '0' && field[i] <= '7') {
+      value = value * 8 + (field[i] - '0');
+    } else if (field[i] != ' ') {
+      break;
+    }
+  }
+  return value;
+}
+
+static std::string ParseString(const char* field, size_t length) {
+  return std::string(field, strnlen(field, length));
+}
+
+static bool ChecksumMatches(const uint8_t* header) {
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < kBlock; ++i) {
+    sum += (i >= 148 && i < 156) ? ' ' : header[i];
+  }
+  return sum == ParseNumber((const char*)header + 148, 8);
+}
+
+// Value of the path record of a pax extended header, or "" if it has none.
+// Records look like "<length> <key>=<value>\n", length counting the record.
+static std::string PaxPath(const std::string& records) {
+  size_t pos = 0;
+  while (pos < records.size()) {
+    size_t space = records.find(' ', pos);
+    size_t length = strtoull(records.c_str() + pos, nullptr, 10);
+    if (space == std::string::npos || length == 0 ||
+        pos + length > records.size() || space + 1 >= pos + length) {
+      break;
+    }
+    std::string record = records.substr(space + 1, pos + length - space - 2);
+    if (record.compare(0, 5, "path=") == 0) {
+      return record.substr(5);
+    }
+    pos += length;
+  }
+  return "";
+}
+
+static void ReadFully(int fd,
+                      uint8_t* dst,
+                      uint64_t size,
+                      uint64_t offset,
+                      const std::string& path) {
+  while (size > 0) {
+    ssize_t n = pread(fd, dst, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      throw std::runtime_error("Cannot read tar shard " + path);
+    }
+    dst += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+/*
+  TarShards
+
+  Opens every shard and indexes its regular files. Indexing reads one header
+  block per member and skips over the data, so it costs one small read per
+  file rather than a full pass over the shard.
+
+  @param const std::vector<std::string>& paths -> the shards, in the order
+  their members are numbered
+*/
+TarShards::TarShards(const std::vector<std::string>& paths) : paths_(paths) {
+  for (size_t shard = 0; shard < paths_.size(); ++shard) {
+    int fd = open(paths_[shard].c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      for (int opened : fds_) {
+        close(opened);
+      }
+      throw std::runtime_error("Cannot open tar shard " + paths_[shard]);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    fds_.push_back(fd);
+    sizes_.push_back(info.st_size);
+  }
+  try {
+    for (size_t shard = 0; shard < paths_.size(); ++shard) {
+      Index(shard);
+    }
+  } catch (...) {
+    for (int fd : fds_) {
+      close(fd);
+    }
+    throw;
+  }
+}
+
+TarShards::~TarShards() {
+  for (int fd : fds_) {
+    close(fd);
+  }
+}
+
+void TarShards::Index(size_t shard) {
+  const std::string& path = paths_[shard];
+  uint8_t header[kBlock];
+  std::string long_name;
+  uint64_t offset = 0;
+  while (offset + kBlock <= sizes_[shard]) {
+    ReadFully(fds_[shard], header, kBlock, offset, path);
+    if (header[0] == '\0') {
+      break;
+    }
+    if (!ChecksumMatches(header)) {
+      throw std::runtime_error("Corrupt tar shard " + path);
+    }
+    uint64_t data = offset + kBlock;
+    uint64_t size = ParseNumber((const char*)header + 124, 12);
+    if (size > sizes_[shard] - data) {
+      throw std::runtime_error("Truncated tar shard " + path);
+    }
+    char type = header[156];
+    if (type == 'L' || type == 'x') {
+      // names the next member
+      std::string extension(size, '\0');
+      ReadFully(fds_[shard], (uint8_t*)&extension[0], size, data, path);
+      std::string name =
+          type == 'L' ? std::string(extension.c_str()) : PaxPath(extension);
+      if (!name.empty()) {
+        long_name = name;
+      }
+    } else {
+      if (type == '0' || type == '\0' || type == '7') {
+        TarMember member;
+        member.shard = shard;
+        member.offset = data;
+        member.size = size;
+        member.name = long_name;
+        if (member.name.empty()) {
+          std::string prefix =
+              memcmp(header + 257, "ustar", 5) == 0
+                  ? ParseString((const char*)header + 345, 155)
+                  : "";
+          member.name = ParseString((const char*)header, 100);
+          if (!prefix.empty()) {
+            member.name = prefix + "/" + member.name;
+          }
+        }
+        members_.push_back(member);
+      }
+      long_name.clear();
+    }
+    offset = data + Padded(size);
+  }
+}
+
+size_t TarShards::Size() const { return members_.size(); }
+
+size_t TarShards::NumShards() const { return paths_.size(); }
+
+const TarMember& TarShards::Member(size_t i) const { return members_[i]; }
+
+const std::string& TarShards::ShardPath(size_t shard) const {
+  return paths_[shard];
+}
+
+// Reads the data of member i with a single positioned read; safe to call
+// from several threads at once.
+void TarShards::Read(size_t i, std::vector<uint8_t>& data) const {
+  const TarMember& member = members_[i];
+  data.resize(member.size);
+  ReadFully(fds_[member.shard],
+            data.data(),
+            member.size,
+            member.offset,
+            paths_[member.shard]);
+}
+
+/*
+  ReadSequential
+
+  Reads the given members in order, refilling a buffer_size buffer from the
+  first member it does not hold. When the members follow each other in the
+  shards, one read serves every member that fits in the buffer, so a whole
+  epoch takes a few large sequential reads per shard. Members larger than the
+  buffer, or reached by jumping around a shard, are read on their own.
+
+  @param const std::vector<size_t>& members -> indices of the members to read
+  @param const std::function<bool(size_t, std::vector<uint8_t>&)>& fn ->
+  called with the position in members and the data of each member; returning
+  false stops reading
+  @param size_t buffer_size -> bytes per read
+*/
+void TarShards::ReadSequential(
+    const std::vector<size_t>& members,
+    const std::function<bool(size_t, std::vector<uint8_t>&)>& fn,
+    size_t buffer_size) const {
+  std::vector<uint8_t> buffer(buffer_size);
+  size_t buffer_shard = SIZE_MAX;
+  uint64_t buffer_offset = 0;
+  uint64_t buffer_length = 0;
+  size_t previous_shard = SIZE_MAX;
+  uint64_t previous_end = 0;
+  for (size_t k = 0; k < members.size(); ++k) {
+    const TarMember& member = members_[members[k]];
+    std::vector<uint8_t> data(member.size);
+    bool buffered = member.shard == buffer_shard &&
+                    member.offset >= buffer_offset &&
+                    member.offset + member.size <=
+                        buffer_offset + buffer_length;
+    // read ahead only while moving forward through a shard; a jump back or
+    // far ahead would waste the rest of the read
+    bool forward = member.shard != previous_shard ||
+                   (member.offset >= previous_end &&
+                    member.offset - previous_end < buffer_size);
+    previous_shard = member.shard;
+    previous_end = member.offset + member.size;
+    if (!buffered && forward && member.size <= buffer_size) {
+      buffer_shard = member.shard;
+      buffer_offset = member.offset;
+      buffer_length = std::min<uint64_t>(buffer_size,
+                                         sizes_[member.shard] - member.offset);
+      ReadFully(fds_[member.shard],
+                buffer.data(),
+                buffer_length,
+                buffer_offset,
+                paths_[member.shard]);
+      buffered = true;
+    }
+    if (buffered) {
+      std::copy_n(buffer.data() + (member.offset - buffer_offset),
+                  member.size,
+                  data.data());
+    } else {
+      ReadFully(fds_[member.shard],
+                data.data(),
+                member.size,
+                member.offset,
+                paths_[member.shard]);
+    }
+    if (!fn(k, data)) {
+      return;
+    }
+  }
+}
+
+TarShardWriter::TarShardWriter(const std::string& prefix, uint64_t shard_size)
+    : prefix_(prefix), shard_size_(shard_size) {}
+
+TarShardWriter::~TarShardWriter() {
+  try {
+    Close();
+  } catch (...) {
+  }
+}
+
+/*
+  Add
+
+  Appends a file to the current shard, first moving on to a new shard if the
+  file would take the current one past the shard size. A file larger than
+  the shard size gets a shard of its own. Names longer than the 100 bytes of
+  a ustar header are stored as GNU long names.
+
+  @param const std::string& name -> name of the file in the shard
+  @param const uint8_t* data -> the file's contents
+  @param uint64_t size -> number of bytes at data
+*/
+void TarShardWriter::Add(const std::string& name,
+                         const uint8_t* data,
+                         uint64_t size) {
+  uint64_t long_name_size = name.size() > 100 ? name.size() + 1 : 0;
+  uint64_t entry_size = kBlock + Padded(size) +
+                        (long_name_size > 0 ? kBlock + Padded(long_name_size)
+                                            : 0);
+  if (out_.is_open() && shard_bytes_ > 0 &&
+      shard_bytes_ + entry_size + 2 * kBlock > shard_size_) {
+    FinishShard();
+  }
+  if (!out_.is_open()) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%06zu.tar", shard_paths_.size());
+    std::string path = prefix_ + suffix;
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!out_) {
+      throw std::runtime_error("Cannot create tar shard " + path);
+    }
+    shard_paths_.push_back(path);
+    shard_bytes_ = 0;
+  }
+  if (long_name_size > 0) {
+    WriteHeader("././@LongLink", 'L', long_name_size);
+    out_.write(name.c_str(), long_name_size);
+    Pad(long_name_size);
+  }
+  WriteHeader(name, '0', size);
+  out_.write((const char*)data, size);
+  Pad(size);
+  if (!out_) {
+    throw std::runtime_error("Failed to write tar shard " +
+                             shard_paths_.back());
+  }
+  shard_bytes_ += entry_size;
+}
+
+// Ends the last shard. Further Adds start a new shard.
+void TarShardWriter::Close() {
+  if (out_.is_open()) {
+    FinishShard();
+  }
+}
+
+const std::vector<std::string>& TarShardWriter::ShardPaths() const {
+  return shard_paths_;
+}
+
+void TarShardWriter::FinishShard() {
+  Pad(0);
+  static const char zeros[2 * kBlock] = {};
+  out_.write(zeros, sizeof(zeros));
+  out_.close();
+  if (out_.fail()) {
+    throw std::runtime_error("Failed to write tar shard " +
+                             shard_paths_.back());
+  }
+}
+
+// Writes a ustar header. Modification times are 0, so the same images always
+// give byte-identical shards.
+void TarShardWriter::WriteHeader(const std::string& name,
+                                 char type,
+                                 uint64_t size) {
+  char header[kBlock] = {};
+  memcpy(header, name.data(), std::min<size_t>(name.size(), 100));
+  snprintf(header + 100, 8, "%07o", 0644);
+  snprintf(header + 108, 8, "%07o", 0);
+  snprintf(header + 116, 8, "%07o", 0);
+  if (size < (1ull << 33)) {
+    snprintf(header + 124, 12, "%011llo", (unsigned long long)size);
+  } else {
+    header[124] = (char)0x80;
+    for (int i = 0; i < 8; ++i) {
+      header[135 - i] = (char)(size >> (8 * i));
+    }
+  }
+  snprintf(header + 136, 12, "%011o", 0);
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  memset(header + 148, ' ', 8);
+  unsigned int sum = 0;
+  for (uint64_t i = 0; i < kBlock; ++i) {
+    sum += (uint8_t)header[i];
+  }
+  snprintf(header + 148, 7, "%06o", sum);
+  out_.write(header, kBlock);
+}
+
+void TarShardWriter::Pad(uint64_t size) {
+  static const char zeros[kBlock] = {};
+  out_.write(zeros, Padded(size) - size);
+}
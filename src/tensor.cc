@@ -0,0 +1,218 @@
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <opencv2/core/hal/intrin.hpp>
+
+using namespace cv;
+
+size_t TensorImageBytes(const TensorOptions& options) {
+  return (size_t)options.size.area() * options.channels *
+         CV_ELEM_SIZE1(options.depth);
+}
+
+// Bilinear sampling positions along one axis, with the pixel-center alignment
+// of cv::resize: destination index d reads (1 - weight[d]) of source index
+// first[d] and weight[d] of source index second[d].
+static void LinearCoefficients(int src_len,
+                               int dst_len,
+                               std::vector<int>& first,
+                               std::vector<int>& second,
+                               std::vector<float>& weight) {
+  first.resize(dst_len);
+  second.resize(dst_len);
+  weight.resize(dst_len);
+  double step = (double)src_len / dst_len;
+  for (int d = 0; d < dst_len; ++d) {
+    double s = std::max(0.0, (d + 0.5) * step - 0.5);
+    int i = std::min((int)s, src_len - 1);
+    first[d] = i;
+    second[d] = std::min(i + 1, src_len - 1);
+    weight[d] = i + 1 < src_len ? (float)(s - i) : 0.f;
+  }
+}
+
+// Convert n elements of a source row to float into dst and return it; float
+// rows are used as they are.
+static const float* ToFloat(const uchar* src, float* dst, int n) {
+  int i = 0;
+#if CV_SIMD
+  for (; i + v_float32::nlanes <= n; i += v_float32::nlanes) {
+    v_store(dst + i,
+            v_cvt_f32(v_reinterpret_as_s32(vx_load_expand_q(src + i))));
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[i] = src[i];
+  }
+  return dst;
+}
+
+static const float* ToFloat(const ushort* src, float* dst, int n) {
+  int i = 0;
+#if CV_SIMD
+  for (; i + v_float32::nlanes <= n; i += v_float32::nlanes) {
+    v_store(dst + i, v_cvt_f32(v_reinterpret_as_s32(vx_load_expand(src + i))));
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[i] = src[i];
+  }
+  return dst;
+}
+
+static const float* ToFloat(const float* src, float*, int) { return src; }
+
+/*
+  PackRows
+
+  Resamples every source row needed by the output horizontally into planar
+  float rows, at most two of which are kept, and blends pairs of them
+  vertically straight into the output planes together with the per-channel
+  normalization. Every source pixel is read once per output row that needs it
+  and every output element is written once; no image sized buffer is
+  allocated.
+
+  Source rows are widened to float a vector at a time. The horizontal pass
+  then gathers the two neighbours of a vector of outputs with v_lut, through
+  indices that already pick the channel (and so do the deinterleave and the
+  R/B swap), and blends them with one multiply-add; the vertical blend and
+  the normalization are two more multiply-adds per vector.
+*/
+template <typename T>
+static void PackRows(const Mat& img, const TensorOptions& options, void* dst) {
+  int cn = img.channels();
+  int width = options.size.width;
+  int height = options.size.height;
+  size_t plane_size = (size_t)width * height;
+
+  std::vector<int> x_first, x_second, y_first, y_second;
+  std::vector<float> x_weight, y_weight;
+  LinearCoefficients(img.cols, width, x_first, x_second, x_weight);
+  LinearCoefficients(img.rows, height, y_first, y_second, y_weight);
+
+  // plane c reads source channel src_channel[c], at first_index and
+  // second_index of the interleaved source row
+  std::vector<int> first_index(cn * width), second_index(cn * width);
+  std::vector<float> mul(cn), add(cn);
+  for (int c = 0; c < cn; ++c) {
+    int src_channel = (options.swap_rb && cn >= 3 && c < 3) ? 2 - c : c;
+    for (int x = 0; x < width; ++x) {
+      first_index[c * width + x] = x_first[x] * cn + src_channel;
+      second_index[c * width + x] = x_second[x] * cn + src_channel;
+    }
+    double std_dev = c < (int)options.std_dev.size() ? options.std_dev[c] : 1;
+    double mean = c < (int)options.mean.size() ? options.mean[c] : 0;
+    mul[c] = (float)(options.scale / std_dev);
+    add[c] = (float)(-mean / std_dev);
+  }
+
+  // two horizontally resampled source rows, planar: slot * cn * width + c *
+  // width + x
+  std::vector<float> rows(2 * cn * width);
+  std::vector<float> widened(img.depth() == CV_32F ? 0 : img.cols * cn);
+  int cached[2] = {-1, -1};
+  auto resample = [&](int src_row, int keep) -> const float* {
+    for (int slot = 0; slot < 2; ++slot) {
+      if (cached[slot] == src_row) {
+        return rows.data() + slot * cn * width;
+      }
+    }
+    int slot = cached[0] == keep ? 1 : 0;
+    cached[slot] = src_row;
+    const float* s =
+        ToFloat(img.ptr<T>(src_row), widened.data(), img.cols * cn);
+    float* planes = rows.data() + slot * cn * width;
+    for (int c = 0; c < cn; ++c) {
+      const int* first = first_index.data() + c * width;
+      const int* second = second_index.data() + c * width;
+      float* row = planes + c * width;
+      int x = 0;
+#if CV_SIMD
+      for (; x + v_float32::nlanes <= width; x += v_float32::nlanes) {
+        v_float32 a = v_lut(s, first + x);
+        v_float32 b = v_lut(s, second + x);
+        v_store(row + x, v_muladd(vx_load(x_weight.data() + x), b - a, a));
+      }
+#endif
+      for (; x < width; ++x) {
+        float a = s[first[x]];
+        float b = s[second[x]];
+        row[x] = a + x_weight[x] * (b - a);
+      }
+    }
+    return planes;
+  };
+
+  std::vector<float> out_row(width);
+  for (int y = 0; y < height; ++y) {
+    const float* top = resample(y_first[y], y_second[y]);
+    const float* bottom = resample(y_second[y], y_first[y]);
+    float w = y_weight[y];
+    for (int c = 0; c < cn; ++c) {
+      const float* a = top + c * width;
+      const float* b = bottom + c * width;
+      size_t offset = c * plane_size + (size_t)y * width;
+      float* out = options.depth == CV_32F ? (float*)dst + offset
+                                           : out_row.data();
+      float m = mul[c];
+      float k = add[c];
+      int x = 0;
+#if CV_SIMD
+      v_float32 vw = vx_setall_f32(w);
+      v_float32 vm = vx_setall_f32(m);
+      v_float32 vk = vx_setall_f32(k);
+      for (; x + v_float32::nlanes <= width; x += v_float32::nlanes) {
+        v_float32 va = vx_load(a + x);
+        v_float32 vb = vx_load(b + x);
+        v_store(out + x, v_muladd(v_muladd(vw, vb - va, va), vm, vk));
+      }
+#endif
+      for (; x < width; ++x) {
+        out[x] = (a[x] + w * (b[x] - a[x])) * m + k;
+      }
+      if (options.depth == CV_16F) {
+        Mat(1, width, CV_32F, out_row.data())
+            .convertTo(Mat(1, width, CV_16F, (float16_t*)dst + offset),
+                       CV_16F);
+      }
+    }
+  }
+#if CV_SIMD
+  vx_cleanup();
+#endif
+}
+
+/*
+  PackTensor
+
+  Writes one image to a tensor in a single pass that fuses the resize to
+  options.size, the normalization, the BGR to RGB swap and the HWC to CHW
+  transpose.
+
+  @param const Mat& img -> 8U, 16U or 32F image with options.channels
+  channels
+  @param const TensorOptions& options -> size, normalization and layout
+  @param void* dst -> TensorImageBytes(options) bytes to write the image to
+*/
+void PackTensor(const Mat& img, const TensorOptions& options, void* dst) {
+  assert(img.channels() == options.channels);
+  assert(options.depth == CV_32F || options.depth == CV_16F);
+  switch (img.depth()) {
+    case CV_8U:
+      PackRows<uchar>(img, options, dst);
+      break;
+    case CV_16U:
+      PackRows<ushort>(img, options, dst);
+      break;
+    case CV_32F:
+      PackRows<float>(img, options, dst);
+      break;
+    default: {
+      Mat converted;
+      img.convertTo(converted, CV_32F);
+      PackRows<float>(converted, options, dst);
+    }
+  }
+}
@@ -0,0 +1,198 @@
+#include "tracer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+#include "op_stats.hpp"
+
+// Tells tracers apart in the per-thread rings of ThreadRing, even when one is
+// allocated where a destroyed one used to be.
+static std::atomic<uint64_t> next_tracer_id(1);
+
+Tracer::Tracer(size_t spans_per_thread)
+    : id_(next_tracer_id++),
+      capacity_(spans_per_thread > 0 ? spans_per_thread : 1),
+      start_(std::chrono::steady_clock::now()),
+      pool_(std::make_shared<Pool>()) {}
+
+// The rings a thread records into, one per tracer, given back to their
+// tracers when the thread exits.
+struct Tracer::ThreadRings {
+  struct Entry {
+    uint64_t tracer_id;
+    std::weak_ptr<Pool> pool;
+    Ring* ring;
+  };
+  std::vector<Entry> entries;
+
+  ~ThreadRings() {
+    for (const Entry& entry : entries) {
+      if (std::shared_ptr<Pool> pool = entry.pool.lock()) {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->free.push_back(entry.ring);
+      }
+    }
+  }
+};
+
+/*
+  ThreadRing
+
+  Returns the calling thread's ring. The ring is remembered in a thread_local,
+  so only a thread's first span takes the lock. A new thread takes over the
+  ring of a thread that exited if there is one, and starts a track of its own
+  in it; tracks whose spans have all been overwritten are dropped.
+
+  @return Ring* -> the calling thread's ring
+*/
+Tracer::Ring* Tracer::ThreadRing() {
+  thread_local ThreadRings thread_rings;
+  std::vector<ThreadRings::Entry>& entries = thread_rings.entries;
+  for (const ThreadRings::Entry& entry : entries) {
+    if (entry.tracer_id == id_) {
+      return entry.ring;
+    }
+  }
+  // forget the rings of destroyed tracers
+  entries.erase(std::remove_if(entries.begin(),
+                               entries.end(),
+                               [](const ThreadRings::Entry& entry) {
+                                 return entry.pool.expired();
+                               }),
+                entries.end());
+
+  std::lock_guard<std::mutex> lock(pool_->mutex);
+  Ring* ring;
+  if (pool_->free.empty()) {
+    pool_->rings.emplace_back(new Ring());
+    ring = pool_->rings.back().get();
+    ring->spans.reset(new Span[capacity_]);
+    ring->recorded = 0;
+  } else {
+    ring = pool_->free.back();
+    pool_->free.pop_back();
+  }
+  uint64_t recorded = ring->recorded.load(std::memory_order_relaxed);
+  while (ring->tracks.size() > 1 &&
+         ring->tracks[1].first + capacity_ <= recorded) {
+    ring->tracks.pop_front();
+  }
+  int tid = pool_->next_tid++;
+  ring->tracks.push_back({recorded, tid, "thread " + std::to_string(tid)});
+  entries.push_back({id_, pool_, ring});
+  return ring;
+}
+
+void Tracer::NameThread(const std::string& name) {
+  Ring* ring = ThreadRing();
+  std::lock_guard<std::mutex> lock(pool_->mutex);
+  ring->tracks.back().name = name;
+}
+
+void Tracer::Record(const char* category,
+                    const char* name,
+                    int64_t image,
+                    std::chrono::steady_clock::time_point start,
+                    std::chrono::steady_clock::time_point end) {
+  Ring* ring = ThreadRing();
+  uint64_t recorded = ring->recorded.load(std::memory_order_relaxed);
+  Span& span = ring->spans[recorded % capacity_];
+  span.category = category;
+  span.name = name;
+  span.image = image;
+  span.start_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(start - start_)
+          .count();
+  span.end_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start_)
+          .count();
+  ring->recorded.store(recorded + 1, std::memory_order_release);
+}
+
+size_t Tracer::Size() const {
+  std::lock_guard<std::mutex> lock(pool_->mutex);
+  size_t size = 0;
+  for (const std::unique_ptr<Ring>& ring : pool_->rings) {
+    uint64_t recorded = ring->recorded.load(std::memory_order_acquire);
+    size += recorded < capacity_ ? recorded : capacity_;
+  }
+  return size;
+}
+
+/*
+  WriteChromeTrace
+
+  Writes the spans in the Chrome trace_event format: one complete ("X")
+  event per span, with timestamps in microseconds since the tracer was
+  created and the image index as an argument, plus the name of every thread.
+  Each thread shows up as a track, so idle gaps in a stage's tracks are
+  bubbles in the pipeline.
+
+  @param const std::string& path -> the JSON file to write
+*/
+void Tracer::WriteChromeTrace(const std::string& path) const {
+  std::ofstream out(path, std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Cannot write trace " + path);
+  }
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  std::lock_guard<std::mutex> lock(pool_->mutex);
+  bool first = true;
+  std::string event;
+  char numbers[128];
+  for (const std::unique_ptr<Ring>& ring : pool_->rings) {
+    uint64_t recorded = ring->recorded.load(std::memory_order_acquire);
+    uint64_t begin = recorded > capacity_ ? recorded - capacity_ : 0;
+    for (size_t t = 0; t < ring->tracks.size(); ++t) {
+      const Track& track = ring->tracks[t];
+      uint64_t end =
+          t + 1 < ring->tracks.size() ? ring->tracks[t + 1].first : recorded;
+      uint64_t track_begin = std::max(track.first, begin);
+      if (track_begin >= end && t + 1 < ring->tracks.size()) {
+        continue;  // overwritten by later threads
+      }
+      event = first ? "" : ",";
+      first = false;
+      snprintf(numbers,
+               sizeof(numbers),
+               "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+               "\"tid\":%d,\"args\":{\"name\":",
+               track.tid);
+      event += numbers;
+      AppendJsonString(event, track.name);
+      event += "}}";
+      out << event;
+
+      for (uint64_t i = track_begin; i < end; ++i) {
+        const Span& span = ring->spans[i % capacity_];
+        event = ",\n{\"name\":";
+        AppendJsonString(event, span.name);
+        event += ",\"cat\":";
+        AppendJsonString(event, span.category);
+        snprintf(numbers,
+                 sizeof(numbers),
+                 ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                 "\"dur\":%.3f",
+                 track.tid,
+                 span.start_ns / 1e3,
+                 (span.end_ns - span.start_ns) / 1e3);
+        event += numbers;
+        if (span.image >= 0) {
+          snprintf(numbers,
+                   sizeof(numbers),
+                   ",\"args\":{\"image\":%lld}",
+                   (long long)span.image);
+          event += numbers;
+        }
+        event += '}';
+        out << event;
+      }
+    }
+  }
+  out << "\n]}\n";
+  if (!out) {
+    throw std::runtime_error("Cannot write trace " + path);
+  }
+}
@@ -1,8 +1,28 @@
+#include <fstream>
 #include <string>
+#include <thread>
 
+#include "async_io.hpp"
 #include "augmentations.hpp"
 #include "catch.hpp"
 #include "data_loader.hpp"
+#include "geometric_chain.hpp"
+#include "image_cache.hpp"
+#include "image_header.hpp"
+#include "lz_codec.hpp"
+#include "noise.hpp"
+#include "op_stats.hpp"
+#include "packed_dataset.hpp"
+#include "philox.hpp"
+#include "ping_pong_buffers.hpp"
+#include "pipeline.hpp"
+#include "ppm.hpp"
+#include "random_rotation_utilities.hpp"
+#include "rng_streams.hpp"
+#include "synthetic_dataset.hpp"
+#include "tar_shards.hpp"
+#include "tensor.hpp"
+#include "tracer.hpp"
 #include "utilities.hpp"
 
 using namespace cv;
@@ -13,7 +33,22 @@ HELPERS
 
 bool MatsAreEqual(const Mat& a, const Mat& b) {
   // Check if two images are identical
-  return countNonZero(a != b) == 0;
+  if (a.size() != b.size() || a.type() != b.type()) {
+    return false;
+  }
+  Mat diff = a != b;
+  return countNonZero(diff.reshape(1)) == 0;
+}
+
+// Number of times needle occurs in haystack.
+size_t CountOccurrences(const std::string& haystack,
+                        const std::string& needle) {
+  size_t count = 0;
+  for (size_t pos = haystack.find(needle); pos != std::string::npos;
+       pos = haystack.find(needle, pos + 1)) {
+    ++count;
+  }
+  return count;
 }
 
 /*
@@ -128,4 +163,1475 @@ TEST_CASE("image blur", "[blur]") {
   Mat dst;
   filter2D(img, dst, -1, kernel, Point(-1, -1), 0, BORDER_DEFAULT);
   REQUIRE(MatsAreEqual(test_blurred, dst));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Parallel pipeline matches serial output", "[pipeline]") {
+  std::string in_dir = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  std::string serial_dir = "/home/vagrant/src/final-project-rijuka/test_serial";
+  std::string parallel_dir =
+      "/home/vagrant/src/final-project-rijuka/test_parallel";
+
+  RNG serial_rng(128);
+  DataLoader serial(in_dir);
+  serial.AddAugmentation([&serial_rng](const Mat& img) {
+    return RandomSlide(img, 0.5, serial_rng);
+  });
+  serial.AugmentAndSaveToDirectory(serial_dir);
+
+  RNG parallel_rng(128);
+  DataLoader parallel(in_dir);
+  parallel.AddAugmentation([&parallel_rng](const Mat& img) {
+    return RandomSlide(img, 0.5, parallel_rng);
+  });
+  PipelineOptions options;
+  options.decode_workers = 3;
+  options.encode_workers = 2;
+  options.queue_capacity = 2;
+  parallel.AugmentAndSaveToDirectory(parallel_dir, options);
+
+  for (auto image_path :
+       boost::make_iterator_range(directory_iterator(serial_dir), {})) {
+    std::string name = image_path.path().filename().string();
+    Mat expected = imread(serial_dir + "/" + name, IMREAD_UNCHANGED);
+    Mat actual = imread(parallel_dir + "/" + name, IMREAD_UNCHANGED);
+    REQUIRE(MatsAreEqual(expected, actual));
+  }
+  boost::filesystem::remove_all(serial_dir);
+  boost::filesystem::remove_all(parallel_dir);
+}
+
+TEST_CASE("Rotation map matches per-pixel projection", "[rotation]") {
+  Size src_size(64, 48);
+  Mat rot_3x4;
+  composeExternalMatrix(12, -20, 7, 0, 0, 1000, rot_3x4);
+  Mat rot = Mat::eye(4, 4, CV_64FC1);
+  rot_3x4.copyTo(rot(Rect(0, 0, 4, 3)));
+  Rect_<double> dst_rect(-3.5, -2.25, 70, 52);
+
+  Mat map_x, map_y;
+  CreateMap(src_size, dst_rect, rot, map_x, map_y);
+  REQUIRE(map_x.size() == Size(70, 52));
+
+  Mat inv = rot.inv();
+  for (int dy = 0; dy < map_x.rows; dy += 7) {
+    for (int dx = 0; dx < map_x.cols; dx += 5) {
+      Mat dst_pos(3, 1, CV_64FC1);
+      dst_pos.at<double>(0, 0) = dst_rect.x + dx;
+      dst_pos.at<double>(1, 0) = dst_rect.y + dy;
+      dst_pos.at<double>(2, 0) = 1000;
+      Mat r = -inv(Rect(3, 2, 1, 1)) / (inv(Rect(0, 2, 3, 1)) * dst_pos);
+      Mat src_pos =
+          inv(Rect(0, 0, 3, 2)) * dst_pos * r + inv(Rect(3, 0, 1, 2));
+      REQUIRE(std::abs(map_x.at<float>(dy, dx) -
+                       (src_pos.at<double>(0, 0) + src_size.width / 2.0)) <
+              1e-3);
+      REQUIRE(std::abs(map_y.at<float>(dy, dx) -
+                       (src_pos.at<double>(1, 0) + src_size.height / 2.0)) <
+              1e-3);
+    }
+  }
+}
+
+TEST_CASE("Rotation map cache", "[rotation_cache]") {
+  Mat img =
+      imread("/home/vagrant/src/final-project-rijuka/sampleinputs/ocean.ppm");
+  RotationMapCache cache(64 << 20, 0.5);
+
+  Mat first, second;
+  RotateImage(img, first, 10.1f, -4.9f, 3.2f, cache);
+  RotateImage(img, second, 9.9f, -5.1f, 3.0f, cache);
+  REQUIRE(cache.Misses() == 1);
+  REQUIRE(cache.Hits() == 1);
+  REQUIRE(MatsAreEqual(first, second));
+
+  // The cached tables sample the quantized angles. Fixed-point rounding may
+  // move a few samples by 1/32 of a pixel.
+  Mat expected;
+  RotateImage(img, expected, 10, -5, 3);
+  REQUIRE(expected.size() == first.size());
+  REQUIRE(norm(expected, first, NORM_L1) / expected.total() < 0.5);
+
+  RotationMapCache tiny(1, 0.5);
+  RotateImage(img, first, 10, -5, 3, tiny);
+  REQUIRE(tiny.Bytes() == 0);
+}
+
+TEST_CASE("Fused geometric chain", "[geometric_chain]") {
+  Mat img =
+      imread("/home/vagrant/src/final-project-rijuka/sampleinputs/ocean.ppm");
+
+  GeometricChain chain(img.size());
+  chain.HorizontalFlip();
+  chain.Slide(-37, 120);
+  chain.VerticalFlip();
+  Mat expected = VerticalFlip(Slide(HorizontalFlip(img), -37, 120));
+  REQUIRE(MatsAreEqual(chain.Apply(img), expected));
+
+  // Random steps draw the same parameters as the Mat augmentations.
+  RNG chain_rng(7);
+  GeometricChain random_chain(img.size());
+  random_chain.RandomSlide(1, chain_rng);
+  random_chain.RandomHorizontalFlip(1, chain_rng);
+  RNG mat_rng(7);
+  expected = RandomHorizontalFlip(RandomSlide(img, 1, mat_rng), 1, mat_rng);
+  REQUIRE(MatsAreEqual(random_chain.Apply(img), expected));
+
+  // A rotation is resampled once, wherever it sits in the chain.
+  GeometricChain rotate_chain(img.size());
+  rotate_chain.Rotate(8, -6, 12);
+  rotate_chain.HorizontalFlip();
+  Mat rotated;
+  RotateImage(img, rotated, 8, -6, 12);
+  expected = HorizontalFlip(rotated);
+  Mat fused = rotate_chain.Apply(img);
+  REQUIRE(fused.size() == expected.size());
+  REQUIRE(norm(fused, expected, NORM_L1) / expected.total() < 0.5);
+}
+
+TEST_CASE("Flips match cv::flip for every type", "[flip_types]") {
+  int types[] = {CV_8UC1,
+                 CV_8UC3,
+                 CV_8UC4,
+                 CV_16UC1,
+                 CV_16UC3,
+                 CV_32FC1,
+                 CV_32FC3,
+                 CV_MAKETYPE(CV_32F, 4),
+                 CV_16SC2,
+                 CV_64FC1};
+  RNG rng(3);
+  for (int type : types) {
+    // 77 columns leaves a scalar tail after the vector loop.
+    Mat img(13, 77, type);
+    rng.fill(img, RNG::UNIFORM, Scalar::all(0), Scalar::all(250));
+
+    Mat expected;
+    flip(img, expected, 1);
+    REQUIRE(MatsAreEqual(HorizontalFlip(img), expected));
+    Mat in_place = img.clone();
+    HorizontalFlipInPlace(in_place);
+    REQUIRE(MatsAreEqual(in_place, expected));
+
+    flip(img, expected, 0);
+    REQUIRE(MatsAreEqual(VerticalFlip(img), expected));
+    in_place = img.clone();
+    VerticalFlipInPlace(in_place);
+    REQUIRE(MatsAreEqual(in_place, expected));
+  }
+}
+
+TEST_CASE("Slide any type into a reused buffer", "[slide_types]") {
+  RNG rng(11);
+  Mat img(9, 14, CV_16UC(2));
+  rng.fill(img, RNG::UNIFORM, Scalar::all(0), Scalar::all(60000));
+
+  int shifts[][2] = {{0, 0}, {3, 2}, {-5, 7}, {14, -9}, {-31, 40}};
+  Mat dst(img.size(), img.type());
+  uchar* buffer = dst.data;
+  for (auto& shift : shifts) {
+    Slide(img, dst, shift[0], shift[1]);
+    REQUIRE(dst.data == buffer);
+    for (int i = 0; i < img.rows; i++) {
+      for (int j = 0; j < img.cols; j++) {
+        int y = (((i + shift[1]) % img.rows) + img.rows) % img.rows;
+        int x = (((j + shift[0]) % img.cols) + img.cols) % img.cols;
+        REQUIRE(dst.at<Vec<ushort, 2>>(y, x) == img.at<Vec<ushort, 2>>(i, j));
+      }
+    }
+  }
+
+  Mat in_place = img.clone();
+  Slide(in_place, in_place, 4, 4);
+  REQUIRE(MatsAreEqual(in_place, Slide(img, 4, 4)));
+}
+
+TEST_CASE("Deform with per-row offsets", "[deform]") {
+  Mat img =
+      imread("/home/vagrant/src/final-project-rijuka/sampleinputs/ocean.ppm");
+  RNG rng(5);
+  Mat deformed =
+      RandomDeform(img, {0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4}, rng);
+  REQUIRE(deformed.type() == img.type());
+
+  // Same draws as RandomDeform, evaluated per pixel.
+  RNG ref_rng(5);
+  int num_rows = img.rows;
+  int num_cols = img.cols;
+  int x_wave_amp = ref_rng.uniform(0.01 * num_rows, 0.05 * num_rows);
+  int x_wave_freq = ref_rng.uniform(0.2 * num_rows, 0.4 * num_rows);
+  int y_wave_amp = ref_rng.uniform(0.01 * num_cols, 0.05 * num_cols);
+  int y_wave_freq = ref_rng.uniform(0.2 * num_cols, 0.4 * num_cols);
+  for (int i = 0; i < num_rows; i++) {
+    int x_offset =
+        std::round(x_wave_amp * std::sin((2 * M_PI * i) / x_wave_freq));
+    int y_offset =
+        std::round(y_wave_amp * std::cos((2 * M_PI * i) / y_wave_freq));
+    for (int j = 0; j < num_cols; j += 3) {
+      int y = i + y_offset;
+      int x = j + x_offset;
+      Vec3b expected(0, 0, 0);
+      if (y >= 0 && y < num_rows && x >= 0 && x < num_cols) {
+        expected = img.at<Vec3b>(y, x);
+      }
+      REQUIRE(deformed.at<Vec3b>(i, j) == expected);
+    }
+  }
+
+  RNG chain_rng(5);
+  GeometricChain chain(img.size());
+  chain.RandomDeform({0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4},
+                     chain_rng);
+  REQUIRE(MatsAreEqual(chain.Apply(img), deformed));
+}
+
+TEST_CASE("Philox4x32-10 known answers", "[philox]") {
+  // the Philox4x32-10 vectors of Random123's kat_vectors
+  Philox4x32::Counter zeros = Philox4x32::Generate({0, 0, 0, 0}, {0, 0});
+  REQUIRE(zeros == Philox4x32::Counter{
+                       0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8});
+  Philox4x32::Counter ones = Philox4x32::Generate(
+      {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+      {0xffffffff, 0xffffffff});
+  REQUIRE(ones == Philox4x32::Counter{
+                      0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd});
+  Philox4x32::Counter pi = Philox4x32::Generate(
+      {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+      {0xa4093822, 0x299f31d0});
+  REQUIRE(pi == Philox4x32::Counter{
+                    0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1});
+}
+
+TEST_CASE("Gaussian noise on 1, 3 and 4 channels", "[noise]") {
+  int types[] = {CV_8UC1, CV_8UC3, CV_8UC4};
+  for (int type : types) {
+    Mat img(256, 320, type, Scalar::all(128));
+    RNG rng(11);
+    Mat noisy = RandomNoise(img, {-20, 0, 20, 5}, {4, 8, 12, 2}, rng);
+    REQUIRE(noisy.type() == type);
+
+    // a reseeded RNG reproduces the noise exactly
+    RNG same_rng(11);
+    REQUIRE(MatsAreEqual(
+        RandomNoise(img, {-20, 0, 20, 5}, {4, 8, 12, 2}, same_rng), noisy));
+
+    Mat mean, std_dev;
+    meanStdDev(noisy, mean, std_dev);
+    double expected_mean[] = {-20, 0, 20, 5};
+    double expected_std[] = {4, 8, 12, 2};
+    for (int k = 0; k < img.channels(); ++k) {
+      REQUIRE(std::abs(mean.at<double>(k) - 128 - expected_mean[k]) < 0.2);
+      REQUIRE(std::abs(std_dev.at<double>(k) - expected_std[k]) < 0.2);
+    }
+  }
+
+  // results saturate instead of wrapping around
+  Mat white(64, 64, CV_8UC3, Scalar::all(255));
+  RNG rng(3);
+  Mat noisy = RandomNoise(white, {50, 50, 50}, {10, 10, 10}, rng);
+  REQUIRE(countNonZero(noisy.reshape(1) != 255) == 0);
+}
+
+TEST_CASE("Noise bank", "[noise_bank]") {
+  NoiseBank bank({-20, 0, 20}, {4, 8, 12}, 3, 2, Size(128, 96), 7);
+  REQUIRE(bank.NumTiles() == 2);
+  REQUIRE(bank.TileSize() == Size(128, 96));
+
+  // larger than a tile, so the window wraps in both directions
+  Mat img(300, 400, CV_8UC3, Scalar::all(128));
+  RNG rng(1);
+  Mat noisy = RandomNoise(img, bank, rng);
+  REQUIRE(noisy.type() == img.type());
+  REQUIRE(noisy.size() == img.size());
+
+  Mat mean, std_dev;
+  meanStdDev(noisy, mean, std_dev);
+  double expected_mean[] = {-20, 0, 20};
+  double expected_std[] = {4, 8, 12};
+  for (int k = 0; k < 3; ++k) {
+    REQUIRE(std::abs(mean.at<double>(k) - 128 - expected_mean[k]) < 1);
+    REQUIRE(std::abs(std_dev.at<double>(k) - expected_std[k]) < 1);
+  }
+
+  // the same draws give the same window, in place or not
+  RNG same_rng(1);
+  Mat in_place = img.clone();
+  RandomNoise(in_place, in_place, bank, same_rng);
+  REQUIRE(MatsAreEqual(in_place, noisy));
+
+  // sums saturate
+  Mat white(64, 64, CV_8UC3, Scalar::all(255));
+  NoiseBank bright({50, 50, 50}, {10, 10, 10}, 3, 1, Size(32, 32));
+  Mat bright_noisy = RandomNoise(white, bright, rng);
+  REQUIRE(countNonZero(bright_noisy.reshape(1) != 255) == 0);
+}
+
+TEST_CASE("Blur fast paths match filter2D", "[blur_fast_paths]") {
+  Mat img =
+      imread("/home/vagrant/src/final-project-rijuka/sampleinputs/ocean.ppm");
+  Mat expected, diff;
+  double max_diff;
+
+  // normalized box of an even size, run as a box filter, which may round
+  // halves the other way
+  Mat box = Mat::ones(4, 4, CV_32F) / 16.f;
+  filter2D(img, expected, -1, box, Point(-1, -1), 0, BORDER_DEFAULT);
+  absdiff(Blur(img, box), expected, diff);
+  minMaxLoc(diff.reshape(1), nullptr, &max_diff);
+  REQUIRE(max_diff <= 1);
+
+  // separable: outer product of two 1D kernels, computed in float
+  Mat column = getGaussianKernel(7, 1.5, CV_32F);
+  Mat row = getGaussianKernel(5, 0.8, CV_32F);
+  Mat separable = column * row.t();
+  filter2D(img, expected, CV_32F, separable, Point(-1, -1), 0, BORDER_DEFAULT);
+  absdiff(Blur(img, separable, Point(-1, -1), 0, CV_32F), expected, diff);
+  minMaxLoc(diff.reshape(1), nullptr, &max_diff);
+  REQUIRE(max_diff < 1e-3);
+
+  // a kernel of rank two falls back to filter2D
+  Mat sharpen = Mat::zeros(3, 3, CV_32F);
+  sharpen.at<float>(1, 1) = 5;
+  sharpen.at<float>(0, 1) = sharpen.at<float>(2, 1) = -1;
+  sharpen.at<float>(1, 0) = sharpen.at<float>(1, 2) = -1;
+  filter2D(img, expected, -1, sharpen, Point(-1, -1), 0, BORDER_DEFAULT);
+  REQUIRE(MatsAreEqual(Blur(img, sharpen), expected));
+}
+
+TEST_CASE("Random Gaussian and box blur", "[random_blur]") {
+  Mat img =
+      imread("/home/vagrant/src/final-project-rijuka/sampleinputs/ocean.ppm");
+  Mat expected;
+
+  RNG rng(9);
+  Mat blurred = RandomGaussianBlur(img, {1.0, 3.0}, rng);
+  RNG ref_rng(9);
+  double sigma = cvRound(ref_rng.uniform(1.0, 3.0) / 0.05) * 0.05;
+  int ksize = 2 * cvCeil(3 * sigma) + 1;
+  GaussianBlur(img, expected, Size(ksize, ksize), sigma, sigma, BORDER_DEFAULT);
+  Mat diff;
+  absdiff(blurred, expected, diff);
+  double max_diff;
+  minMaxLoc(diff.reshape(1), nullptr, &max_diff);
+  REQUIRE(max_diff <= 1);
+
+  rng = RNG(4);
+  blurred = RandomBoxBlur(img, {3, 15}, rng);
+  ref_rng = RNG(4);
+  int side = ref_rng.uniform(3, 16);
+  blur(img, expected, Size(side, side));
+  REQUIRE(MatsAreEqual(blurred, expected));
+}
+
+TEST_CASE("RNG streams", "[rng_streams]") {
+  StreamId id;
+  id.seed = 99;
+  id.epoch = 2;
+  id.image = 17;
+  id.op = 3;
+  RNG a = StreamRng(id);
+  RNG b = StreamRng(id);
+  for (int i = 0; i < 16; ++i) {
+    REQUIRE(a.next() == b.next());
+  }
+
+  StreamId other_op = id;
+  other_op.op = 4;
+  StreamId other_epoch = id;
+  other_epoch.epoch = 3;
+  StreamId other_seed = id;
+  other_seed.seed = 100;
+  REQUIRE(StreamRng(other_op).state != StreamRng(id).state);
+  REQUIRE(StreamRng(other_epoch).state != StreamRng(id).state);
+  REQUIRE(StreamRng(other_seed).state != StreamRng(id).state);
+}
+
+TEST_CASE("Seeded augmentations match serial on many workers",
+          "[rng_streams_pipeline]") {
+  std::string in_dir = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  std::string serial_dir = "/home/vagrant/src/final-project-rijuka/test_serial";
+  std::string parallel_dir =
+      "/home/vagrant/src/final-project-rijuka/test_parallel";
+
+  auto add_augmentations = [](DataLoader& dataset) {
+    dataset.SetSeed(7);
+    dataset.SetEpoch(1);
+    dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+      return RandomSlide(img, 0.5, rng);
+    });
+    dataset.AddAugmentation(HorizontalFlip);
+    dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+      return RandomNoise(img, {0, 0, 0}, {8, 8, 8}, rng);
+    });
+  };
+
+  DataLoader serial(in_dir);
+  add_augmentations(serial);
+  serial.AugmentAndSaveToDirectory(serial_dir);
+
+  DataLoader parallel(in_dir);
+  add_augmentations(parallel);
+  PipelineOptions options;
+  options.decode_workers = 2;
+  options.augment_workers = 4;
+  options.encode_workers = 2;
+  parallel.AugmentAndSaveToDirectory(parallel_dir, options);
+
+  // in memory, augmentations run op by op but draw the same streams
+  DataLoader in_memory(in_dir);
+  add_augmentations(in_memory);
+  in_memory.LoadInMemory();
+  in_memory.PerformAugmentations();
+  in_memory.SaveImagesToDirectory(parallel_dir + "_in_memory");
+
+  for (auto image_path :
+       boost::make_iterator_range(directory_iterator(serial_dir), {})) {
+    std::string name = image_path.path().filename().string();
+    Mat expected = imread(serial_dir + "/" + name, IMREAD_UNCHANGED);
+    Mat actual = imread(parallel_dir + "/" + name, IMREAD_UNCHANGED);
+    REQUIRE(MatsAreEqual(expected, actual));
+    actual = imread(parallel_dir + "_in_memory/" + name, IMREAD_UNCHANGED);
+    REQUIRE(MatsAreEqual(expected, actual));
+  }
+  boost::filesystem::remove_all(serial_dir);
+  boost::filesystem::remove_all(parallel_dir);
+  boost::filesystem::remove_all(parallel_dir + "_in_memory");
+}
+
+TEST_CASE("Reorder buffers stay within the queue capacity",
+          "[reorder_window]") {
+  std::string dir = "/home/vagrant/src/final-project-rijuka/test_window";
+  std::string out_dir =
+      "/home/vagrant/src/final-project-rijuka/test_window_out";
+  create_directories(dir);
+  Mat small(8, 8, CV_8UC3, Scalar(10, 20, 30));
+  for (int i = 0; i < 40; ++i) {
+    imwrite(dir + "/" + std::to_string(i) + ".png", small);
+  }
+  // the first image in directory order takes far longer to decode than the
+  // rest, which the other decoders would otherwise race past
+  path first = directory_iterator(dir)->path();
+  Mat large(3000, 3000, CV_8UC3);
+  randu(large, Scalar::all(0), Scalar::all(255));
+  imwrite(first.string(), large);
+
+  DataLoader dataset(dir);
+  dataset.EnableStats();
+  uint64_t decoded_before_first = 0;
+  bool seen_first = false;
+  dataset.AddAugmentation([&](const Mat& img) {
+    if (!seen_first) {
+      seen_first = true;
+      decoded_before_first = dataset.GetStats().decode.calls;
+    }
+    return img;
+  });
+  PipelineOptions options;
+  options.decode_workers = 4;
+  options.augment_workers = 1;
+  options.queue_capacity = 4;
+  dataset.AugmentAndSaveToDirectory(out_dir, options);
+
+  // only the first image and those within the window after it were decoded
+  // while it was held up, so they were all that waited for it
+  REQUIRE(decoded_before_first <= options.queue_capacity + 1);
+  REQUIRE(std::distance(directory_iterator(out_dir), {}) == 40);
+  remove_all(dir);
+  remove_all(out_dir);
+}
+
+TEST_CASE("Compile-time pipeline", "[static_pipeline]") {
+  Mat img =
+      imread("/home/vagrant/src/final-project-rijuka/sampleinputs/ocean.ppm");
+  DeformOp deform{{0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4}};
+  Pipeline pipeline(HorizontalFlipOp{0.5},
+                    SlideOp{0.5},
+                    VerticalFlipOp{0.5},
+                    deform,
+                    NoiseOp{{0, 0, 0}, {8, 8, 8}});
+
+  // same images as calling the Random* functions one after the other
+  RNG rng(21);
+  RNG ref_rng(21);
+  Mat dst, scratch;
+  for (int i = 0; i < 8; ++i) {
+    pipeline(img, dst, scratch, rng);
+    Mat expected = RandomHorizontalFlip(img, 0.5, ref_rng);
+    expected = RandomSlide(expected, 0.5, ref_rng);
+    expected = RandomVerticalFlip(expected, 0.5, ref_rng);
+    expected = RandomDeform(
+        expected, {0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4}, ref_rng);
+    expected = RandomNoise(expected, {0, 0, 0}, {8, 8, 8}, ref_rng);
+    REQUIRE(MatsAreEqual(dst, expected));
+  }
+
+  // skipping every op copies the source
+  Pipeline never(HorizontalFlipOp{0}, VerticalFlipOp{0});
+  Mat unchanged = never(img, rng);
+  REQUIRE(unchanged.data != img.data);
+  REQUIRE(MatsAreEqual(unchanged, img));
+
+  // registered with a DataLoader through the adapter
+  std::string in_dir = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  std::string out_dir = "/home/vagrant/src/final-project-rijuka/test_static";
+  DataLoader dataset(in_dir);
+  dataset.SetSeed(3);
+  dataset.AddAugmentation(
+      AsAugmentation(Pipeline(HorizontalFlipOp{0.5}, SlideOp{0.5})));
+  PipelineOptions options;
+  options.augment_workers = 3;
+  dataset.AugmentAndSaveToDirectory(out_dir, options);
+
+  DataLoader reference(in_dir);
+  reference.SetSeed(3);
+  reference.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomSlide(RandomHorizontalFlip(img, 0.5, rng), 0.5, rng);
+  });
+  reference.LoadInMemory();
+  reference.PerformAugmentations();
+  reference.SaveImagesToDirectory(out_dir + "_reference");
+  for (auto image_path :
+       boost::make_iterator_range(directory_iterator(out_dir), {})) {
+    std::string name = image_path.path().filename().string();
+    Mat expected = imread(out_dir + "_reference/" + name, IMREAD_UNCHANGED);
+    Mat actual = imread(out_dir + "/" + name, IMREAD_UNCHANGED);
+    REQUIRE(MatsAreEqual(expected, actual));
+  }
+  boost::filesystem::remove_all(out_dir);
+  boost::filesystem::remove_all(out_dir + "_reference");
+}
+
+TEST_CASE("Ping-pong buffers", "[ping_pong]") {
+  PingPongBuffers buffers;
+  Mat input(100, 100, CV_8UC3, Scalar::all(1));
+
+  Mat first = buffers.Target(input, input.size(), input.type());
+  REQUIRE(first.size() == input.size());
+  REQUIRE(buffers.Holds(first));
+  Mat second = buffers.Target(first, input.size(), input.type());
+  REQUIRE(second.data != first.data);
+  // the next op reuses the first buffer, and smaller images fit in it
+  REQUIRE(buffers.Target(second, input.size(), input.type()).data ==
+          first.data);
+  REQUIRE(buffers.Target(second, Size(50, 50), CV_8UC1).data == first.data);
+  REQUIRE(!buffers.Holds(input));
+
+  // detaching keeps the image alive and installs the replacement
+  Mat replacement(1, 16, CV_8UC1);
+  Mat detached = buffers.Detach(second, replacement);
+  REQUIRE(detached.data == second.data);
+  REQUIRE(!buffers.Holds(second));
+  REQUIRE(buffers.Target(first, Size(2, 2), CV_8UC3).data == replacement.data);
+}
+
+TEST_CASE("Out-parameter augmentations", "[into_augmentations]") {
+  std::string in_dir = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  std::string mat_dir = "/home/vagrant/src/final-project-rijuka/test_mat";
+  std::string into_dir = "/home/vagrant/src/final-project-rijuka/test_into";
+
+  DataLoader by_value(in_dir);
+  by_value.SetSeed(5);
+  by_value.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomHorizontalFlip(img, 0.5, rng);
+  });
+  by_value.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomDeform(
+        img, {0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4}, rng);
+  });
+  by_value.AddAugmentation(VerticalFlip);
+  by_value.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomNoise(img, {0, 0, 0}, {8, 8, 8}, rng);
+  });
+  by_value.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomRotateImage(img, 10, 10, 10, rng);
+  });
+  by_value.AugmentAndSaveToDirectory(mat_dir);
+
+  auto add_into = [](DataLoader& dataset) {
+    dataset.SetSeed(5);
+    dataset.AddAugmentation([](const Mat& img, Mat& dst, RNG& rng) {
+      RandomHorizontalFlip(img, dst, 0.5, rng);
+    });
+    dataset.AddAugmentation([](const Mat& img, Mat& dst, RNG& rng) {
+      RandomDeform(
+          img, dst, {0.01, 0.05}, {0.01, 0.05}, {0.2, 0.4}, {0.2, 0.4}, rng);
+    });
+    dataset.AddAugmentation(VerticalFlip);
+    dataset.AddAugmentation([](const Mat& img, Mat& dst, RNG& rng) {
+      RandomNoise(img, dst, {0, 0, 0}, {8, 8, 8}, rng);
+    });
+    dataset.AddAugmentation([](const Mat& img, Mat& dst, RNG& rng) {
+      RandomRotateImage(img, dst, 10, 10, 10, rng);
+    });
+  };
+
+  DataLoader serial(in_dir);
+  add_into(serial);
+  serial.AugmentAndSaveToDirectory(into_dir + "_serial");
+
+  DataLoader parallel(in_dir);
+  add_into(parallel);
+  PipelineOptions options;
+  options.augment_workers = 3;
+  options.encode_workers = 2;
+  options.queue_capacity = 2;
+  parallel.AugmentAndSaveToDirectory(into_dir + "_parallel", options);
+
+  DataLoader in_memory(in_dir);
+  add_into(in_memory);
+  in_memory.LoadInMemory();
+  in_memory.PerformAugmentations();
+  in_memory.SaveImagesToDirectory(into_dir + "_in_memory");
+
+  std::string suffixes[] = {"_serial", "_parallel", "_in_memory"};
+  for (auto image_path :
+       boost::make_iterator_range(directory_iterator(mat_dir), {})) {
+    std::string name = image_path.path().filename().string();
+    Mat expected = imread(mat_dir + "/" + name, IMREAD_UNCHANGED);
+    for (const std::string& suffix : suffixes) {
+      Mat actual = imread(into_dir + suffix + "/" + name, IMREAD_UNCHANGED);
+      REQUIRE(MatsAreEqual(expected, actual));
+    }
+  }
+  boost::filesystem::remove_all(mat_dir);
+  for (const std::string& suffix : suffixes) {
+    boost::filesystem::remove_all(into_dir + suffix);
+  }
+}
+
+TEST_CASE("Streaming epochs", "[stream]") {
+  std::string in_dir = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  DataLoader dataset(in_dir);
+  dataset.SetSeed(8);
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomSlide(img, 0.5, rng);
+  });
+
+  StreamOptions options;
+  options.batch_size = 3;
+  options.prefetch_batches = 1;
+  options.shuffle = false;
+  options.pipeline.decode_workers = 2;
+  options.pipeline.augment_workers = 2;
+  options.pipeline.queue_capacity = 1;
+
+  // unshuffled, the stream follows the order of AugmentAndSaveToDirectory
+  std::string out_dir = "/home/vagrant/src/final-project-rijuka/test_stream";
+  dataset.SetEpoch(4);
+  dataset.AugmentAndSaveToDirectory(out_dir);
+  std::vector<Mat> expected;
+  for (auto image_path :
+       boost::make_iterator_range(directory_iterator(in_dir), {})) {
+    std::string name = image_path.path().filename().string();
+    if (name.at(0) != '.') {
+      expected.push_back(imread(out_dir + "/" + name, IMREAD_UNCHANGED));
+    }
+  }
+  boost::filesystem::remove_all(out_dir);
+
+  dataset.StartEpoch(4, options);
+  std::vector<Mat> streamed, batch;
+  while (dataset.Next(batch)) {
+    REQUIRE(batch.size() <= 3);
+    streamed.insert(streamed.end(), batch.begin(), batch.end());
+  }
+  REQUIRE(!dataset.Next(batch));
+  REQUIRE(streamed.size() == expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    REQUIRE(MatsAreEqual(streamed[i], expected[i]));
+  }
+
+  // a shuffled epoch holds the same images, in an order fixed by the seed
+  options.shuffle = true;
+  std::vector<std::vector<Mat>> epochs;
+  for (int run = 0; run < 2; ++run) {
+    dataset.StartEpoch(4, options);
+    std::vector<Mat> images;
+    while (dataset.Next(batch)) {
+      images.insert(images.end(), batch.begin(), batch.end());
+    }
+    epochs.push_back(images);
+  }
+  REQUIRE(epochs[0].size() == expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    REQUIRE(MatsAreEqual(epochs[0][i], epochs[1][i]));
+    bool found = false;
+    for (const Mat& img : expected) {
+      found = found || MatsAreEqual(epochs[0][i], img);
+    }
+    REQUIRE(found);
+  }
+
+  // stopping in the middle of an epoch shuts the pipeline down
+  dataset.StartEpoch(5, options);
+  REQUIRE(dataset.Next(batch));
+  dataset.StopStreaming();
+  REQUIRE_THROWS(dataset.Next(batch));
+}
+
+TEST_CASE("Packing images into tensors", "[tensor]") {
+  Mat img(97, 131, CV_8UC3);
+  randu(img, Scalar::all(0), Scalar::all(255));
+
+  TensorOptions options;
+  options.size = Size(64, 48);
+  options.mean = {0.485, 0.456, 0.406};
+  options.std_dev = {0.229, 0.224, 0.225};
+  REQUIRE(TensorImageBytes(options) == 3 * 64 * 48 * sizeof(float));
+
+  // reference: float resize, channel swap, normalization and split
+  Mat resized, rgb;
+  img.convertTo(resized, CV_32F);
+  resize(resized, resized, options.size, 0, 0, INTER_LINEAR);
+  cvtColor(resized, rgb, COLOR_BGR2RGB);
+  std::vector<Mat> planes;
+  split(rgb, planes);
+
+  std::vector<float> tensor(3 * 64 * 48);
+  PackTensor(img, options, tensor.data());
+  for (int c = 0; c < 3; ++c) {
+    Mat packed(options.size, CV_32F, tensor.data() + c * 64 * 48);
+    Mat expected =
+        (planes[c] * options.scale - options.mean[c]) / options.std_dev[c];
+    REQUIRE(norm(packed, expected, NORM_INF) < 1e-3);
+  }
+
+  // 16-bit single-channel images, to an odd width that leaves a partial
+  // vector at the end of every row
+  Mat gray(53, 71, CV_16UC1);
+  randu(gray, Scalar::all(0), Scalar::all(65535));
+  TensorOptions gray_options;
+  gray_options.size = Size(37, 29);
+  gray_options.channels = 1;
+  gray_options.scale = 1.0 / 65535;
+  gray_options.mean = {0.5};
+  gray_options.std_dev = {0.25};
+  std::vector<float> gray_tensor(37 * 29);
+  PackTensor(gray, gray_options, gray_tensor.data());
+  Mat gray_expected;
+  gray.convertTo(gray_expected, CV_32F);
+  resize(gray_expected, gray_expected, gray_options.size, 0, 0, INTER_LINEAR);
+  gray_expected = (gray_expected / 65535 - 0.5) / 0.25;
+  REQUIRE(norm(Mat(gray_options.size, CV_32F, gray_tensor.data()),
+               gray_expected,
+               NORM_INF) < 1e-3);
+
+  // half precision holds the same values, rounded
+  options.depth = CV_16F;
+  REQUIRE(TensorImageBytes(options) == 3 * 64 * 48 * 2);
+  std::vector<float16_t> half(3 * 64 * 48);
+  PackTensor(img, options, half.data());
+  Mat widened;
+  Mat(1, (int)half.size(), CV_16F, half.data()).convertTo(widened, CV_32F);
+  REQUIRE(norm(widened, Mat(1, (int)tensor.size(), CV_32F, tensor.data()),
+               NORM_INF) < 1e-2);
+
+  // streamed batches pack straight into one NCHW buffer
+  DataLoader dataset("/home/vagrant/src/final-project-rijuka/sampleinputs");
+  StreamOptions stream_options;
+  stream_options.batch_size = 2;
+  stream_options.shuffle = false;
+  options.depth = CV_32F;
+  dataset.StartEpoch(0, stream_options);
+  std::vector<float> batch(2 * 3 * 64 * 48);
+  size_t count = dataset.NextTensor(options, batch.data());
+  REQUIRE(count > 0);
+  REQUIRE(count <= 2);
+  while (dataset.NextTensor(options, batch.data()) > 0) {
+  }
+}
+
+TEST_CASE("LZ codec round trips", "[lz_codec]") {
+  std::vector<std::vector<uint8_t>> inputs;
+  inputs.push_back({});
+  inputs.push_back({1, 2, 3});
+  inputs.push_back(std::vector<uint8_t>(100000, 7));
+  std::vector<uint8_t> random(70000);
+  RNG rng(3);
+  for (uint8_t& b : random) {
+    b = (uint8_t)rng.uniform(0, 256);
+  }
+  inputs.push_back(random);
+  std::vector<uint8_t> pattern;
+  for (int i = 0; i < 50000; ++i) {
+    pattern.push_back((uint8_t)(i % 251 + (i / 3000)));
+  }
+  inputs.push_back(pattern);
+
+  for (const std::vector<uint8_t>& input : inputs) {
+    std::vector<uint8_t> packed;
+    LzCompress(input.data(), input.size(), packed);
+    std::vector<uint8_t> unpacked(input.size());
+    REQUIRE(LzDecompress(
+        packed.data(), packed.size(), unpacked.data(), unpacked.size()));
+    REQUIRE(unpacked == input);
+  }
+
+  // runs compress well, and a wrong size or truncated block is rejected
+  std::vector<uint8_t> packed;
+  LzCompress(inputs[2].data(), inputs[2].size(), packed);
+  REQUIRE(packed.size() < 1000);
+  std::vector<uint8_t> unpacked(inputs[2].size());
+  REQUIRE(!LzDecompress(
+      packed.data(), packed.size(), unpacked.data(), unpacked.size() - 1));
+  REQUIRE(!LzDecompress(
+      packed.data(), packed.size() - 1, unpacked.data(), unpacked.size()));
+}
+
+TEST_CASE("Decoded-image cache", "[image_cache]") {
+  Mat a(64, 80, CV_8UC3), b(64, 80, CV_8UC3), c(64, 80, CV_8UC3);
+  randu(a, Scalar::all(0), Scalar::all(255));
+  randu(b, Scalar::all(0), Scalar::all(255));
+  randu(c, Scalar::all(0), Scalar::all(255));
+  size_t image_bytes = a.total() * a.elemSize();
+
+  // room for two images: the least recently used one is evicted
+  ImageCache cache(2 * image_bytes);
+  cache.Put("a", a);
+  cache.Put("b", b);
+  Mat img;
+  REQUIRE(cache.Get("a", img));
+  REQUIRE(MatsAreEqual(img, a));
+  cache.Put("c", c);
+  REQUIRE(!cache.Get("b", img));
+  REQUIRE(cache.Get("c", img));
+  ImageCacheStats stats = cache.GetStats();
+  REQUIRE(stats.hits == 2);
+  REQUIRE(stats.misses == 1);
+  REQUIRE(stats.evictions == 1);
+  REQUIRE(stats.entries == 2);
+  REQUIRE(stats.bytes == 2 * image_bytes);
+
+  // loads run on misses only
+  int loads = 0;
+  auto load = [&]() {
+    ++loads;
+    return b;
+  };
+  REQUIRE(MatsAreEqual(cache.GetOrLoad("b", load), b));
+  REQUIRE(MatsAreEqual(cache.GetOrLoad("b", load), b));
+  REQUIRE(loads == 1);
+
+  // compressed entries decode to the same pixels and take less room when the
+  // image is smooth
+  Mat smooth(120, 160, CV_8UC3);
+  for (int i = 0; i < smooth.rows; ++i) {
+    for (int j = 0; j < smooth.cols; ++j) {
+      smooth.at<Vec3b>(i, j) = Vec3b(i, j, (i + j) / 2);
+    }
+  }
+  Mat wide(40, 30, CV_16UC1);
+  randu(wide, Scalar::all(0), Scalar::all(65535));
+  ImageCache packed(1 << 20, CacheCompression::kLz);
+  packed.Put("smooth", smooth);
+  packed.Put("a", a);
+  packed.Put("wide", wide(Rect(3, 0, 20, 40)));
+  REQUIRE(packed.Get("smooth", img));
+  REQUIRE(MatsAreEqual(img, smooth));
+  REQUIRE(packed.Get("a", img));
+  REQUIRE(MatsAreEqual(img, a));
+  REQUIRE(packed.Get("wide", img));
+  REQUIRE(MatsAreEqual(img, wide(Rect(3, 0, 20, 40))));
+  stats = packed.GetStats();
+  REQUIRE(stats.image_bytes ==
+          smooth.total() * 3 + image_bytes + 20 * 40 * 2);
+  REQUIRE(stats.bytes < stats.image_bytes);
+
+  // a second epoch is served from the cache
+  DataLoader dataset("/home/vagrant/src/final-project-rijuka/sampleinputs");
+  dataset.EnableImageCache(512 << 20, CacheCompression::kLz);
+  StreamOptions options;
+  std::vector<Mat> batch;
+  size_t images = 0;
+  dataset.StartEpoch(0, options);
+  while (dataset.Next(batch)) {
+    images += batch.size();
+  }
+  REQUIRE(dataset.GetImageCacheStats().misses == images);
+  dataset.StartEpoch(1, options);
+  while (dataset.Next(batch)) {
+  }
+  REQUIRE(dataset.GetImageCacheStats().hits == images);
+  REQUIRE(dataset.GetImageCacheStats().misses == images);
+}
+
+TEST_CASE("Packed datasets", "[packed_dataset]") {
+  std::string pack_path =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/test.pack";
+  create_directories("/home/vagrant/src/final-project-rijuka/sampleoutputs");
+
+  // any type and size round trips, including ROIs
+  Mat color(37, 53, CV_8UC3), wide(20, 31, CV_16UC1), real(9, 7, CV_32FC4);
+  randu(color, Scalar::all(0), Scalar::all(255));
+  randu(wide, Scalar::all(0), Scalar::all(65535));
+  randu(real, Scalar::all(-1), Scalar::all(1));
+  {
+    PackedDatasetWriter writer(pack_path);
+    writer.Add("color.png", color);
+    writer.Add("wide.png", wide(Rect(5, 2, 20, 15)));
+    writer.Add("real.exr", real);
+    writer.Finish();
+  }
+  {
+    PackedDataset packed(pack_path);
+    REQUIRE(packed.Size() == 3);
+    REQUIRE(packed.Name(0) == "color.png");
+    REQUIRE(packed.Name(2) == "real.exr");
+    REQUIRE(MatsAreEqual(packed.Image(0), color));
+    REQUIRE(MatsAreEqual(packed.Image(1), wide(Rect(5, 2, 20, 15))));
+    REQUIRE(MatsAreEqual(packed.Image(2), real));
+    for (size_t i = 0; i < packed.Size(); ++i) {
+      REQUIRE((uintptr_t)packed.Image(i).data % 64 == 0);
+    }
+  }
+
+  // an entry with an unknown type or more rows than the file holds is
+  // rejected; patch swaps a field of the first entry and returns the old value
+  auto patch = [&](size_t field, int32_t value) {
+    std::fstream file(pack_path,
+                      std::ios::in | std::ios::out | std::ios::binary);
+    PackedFileHeader header;
+    file.read((char*)&header, sizeof(header));
+    int32_t old_value;
+    file.seekg(header.index_offset + field);
+    file.read((char*)&old_value, sizeof(old_value));
+    file.seekp(header.index_offset + field);
+    file.write((const char*)&value, sizeof(value));
+    return old_value;
+  };
+  int32_t type = patch(offsetof(PackedFileEntry, type), 1 << 20);
+  REQUIRE_THROWS(PackedDataset(pack_path));
+  patch(offsetof(PackedFileEntry, type), type);
+  int32_t rows = patch(offsetof(PackedFileEntry, rows), INT32_MAX);
+  REQUIRE_THROWS(PackedDataset(pack_path));
+  patch(offsetof(PackedFileEntry, rows), rows);
+  REQUIRE(PackedDataset(pack_path).Size() == 3);
+
+  // a truncated file is rejected
+  resize_file(pack_path, sizeof(PackedFileHeader) + 10);
+  REQUIRE_THROWS(PackedDataset(pack_path));
+
+  // a loader reading the pack gives the same images as the directory
+  DataLoader dataset("/home/vagrant/src/final-project-rijuka/sampleinputs");
+  dataset.SavePacked(pack_path);
+  dataset.LoadInMemory();
+  DataLoader packed_dataset;
+  packed_dataset.UsePackedDataset(pack_path);
+  packed_dataset.LoadInMemory();
+  REQUIRE(packed_dataset.GetImages().size() == dataset.GetImages().size());
+  for (size_t i = 0; i < dataset.GetImages().size(); ++i) {
+    REQUIRE(MatsAreEqual(packed_dataset.GetImages()[i],
+                         dataset.GetImages()[i]));
+  }
+
+  // augmenting in memory never writes into the read-only mapping
+  packed_dataset.AddAugmentation(
+      [](const Mat& img, Mat& dst, RNG&) { HorizontalFlipTo(img, dst); });
+  packed_dataset.AddAugmentation(
+      [](const Mat& img, Mat& dst, RNG&) { VerticalFlipTo(img, dst); });
+  packed_dataset.PerformAugmentations();
+  for (size_t i = 0; i < dataset.GetImages().size(); ++i) {
+    Mat expected;
+    flip(dataset.GetImages()[i], expected, -1);
+    REQUIRE(MatsAreEqual(packed_dataset.GetImages()[i], expected));
+  }
+
+  // images loaded from the old mapping are dropped when the source changes
+  packed_dataset.UsePackedDataset(pack_path);
+  REQUIRE(packed_dataset.GetImages().empty());
+  REQUIRE_THROWS(packed_dataset.SaveImagesToDirectory(
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/stale"));
+  remove(pack_path);
+}
+
+TEST_CASE("Tar shards", "[tar_shards]") {
+  std::string shard_dir =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/shards";
+  remove_all(shard_dir);
+  create_directories(shard_dir);
+
+  // shards roll over at the size limit and read back member by member,
+  // including names too long for a ustar header
+  std::vector<std::string> names = {"a.bin", std::string(150, 'n') + ".bin"};
+  for (int i = 0; i < 6; ++i) {
+    names.push_back("file" + std::to_string(i) + ".bin");
+  }
+  std::vector<std::vector<uint8_t>> contents;
+  TarShardWriter writer(shard_dir + "/test", 8192);
+  for (size_t i = 0; i < names.size(); ++i) {
+    contents.push_back(std::vector<uint8_t>(1000 * i + 1, (uint8_t)i));
+    writer.Add(names[i], contents[i].data(), contents[i].size());
+  }
+  writer.Close();
+  REQUIRE(writer.ShardPaths().size() > 1);
+  for (const std::string& shard : writer.ShardPaths()) {
+    REQUIRE(file_size(shard) <= 8192 + 8 * 1024);
+  }
+
+  TarShards shards(writer.ShardPaths());
+  REQUIRE(shards.Size() == names.size());
+  std::vector<size_t> members;
+  for (size_t i = 0; i < names.size(); ++i) {
+    REQUIRE(shards.Member(i).name == names[i]);
+    std::vector<uint8_t> data;
+    shards.Read(i, data);
+    REQUIRE(data == contents[i]);
+    members.push_back(i);
+  }
+  std::reverse(members.begin(), members.end());
+  size_t read = 0;
+  shards.ReadSequential(
+      members,
+      [&](size_t k, std::vector<uint8_t>& data) {
+        REQUIRE(data == contents[members[k]]);
+        ++read;
+        return true;
+      },
+      4096);
+  REQUIRE(read == names.size());
+
+  // augmented images written to shards read back as a dataset
+  DataLoader dataset("/home/vagrant/src/final-project-rijuka/sampleinputs");
+  PipelineOptions options;
+  options.decode_workers = 2;
+  options.encode_workers = 2;
+  options.shard_size = 1 << 20;
+  dataset.AugmentAndSaveToDirectory(shard_dir, options);
+  dataset.LoadInMemory();
+
+  std::vector<std::string> shard_paths;
+  for (auto entry :
+       boost::make_iterator_range(directory_iterator(shard_dir), {})) {
+    if (entry.path().filename().string().rfind("shard-", 0) == 0) {
+      shard_paths.push_back(entry.path().string());
+    }
+  }
+  std::sort(shard_paths.begin(), shard_paths.end());
+  DataLoader sharded;
+  sharded.UseTarShards(shard_paths);
+  StreamOptions stream_options;
+  stream_options.pipeline.decode_workers = 2;
+  sharded.StartEpoch(0, stream_options);
+  std::vector<Mat> batch;
+  size_t images = 0;
+  while (sharded.Next(batch)) {
+    for (const Mat& img : batch) {
+      REQUIRE(!img.empty());
+      // lossy formats were encoded again, so compare loosely
+      bool found = false;
+      for (const Mat& expected : dataset.GetImages()) {
+        found = found || (expected.size() == img.size() &&
+                          norm(expected, img, NORM_L1) / img.total() < 8);
+      }
+      REQUIRE(found);
+    }
+    images += batch.size();
+  }
+  REQUIRE(images == dataset.GetImages().size());
+
+  // members are appended in directory order, however the encoders finish
+  TarShards written(shard_paths);
+  size_t member = 0;
+  for (auto entry : boost::make_iterator_range(
+           directory_iterator(
+               "/home/vagrant/src/final-project-rijuka/sampleinputs"),
+           {})) {
+    REQUIRE(written.Member(member++).name ==
+            entry.path().filename().string());
+  }
+
+  // shuffled epochs mix the members of the shards, in an order fixed by the
+  // seed and the epoch
+  auto epoch_order = [&sharded](uint32_t epoch) {
+    StreamOptions shuffled;
+    shuffled.batch_size = 3;
+    sharded.StartEpoch(epoch, shuffled);
+    std::vector<double> order;
+    std::vector<Mat> epoch_batch;
+    while (sharded.Next(epoch_batch)) {
+      for (const Mat& img : epoch_batch) {
+        order.push_back(sum(img)[0]);
+      }
+    }
+    return order;
+  };
+  std::vector<double> first_epoch = epoch_order(0);
+  REQUIRE(first_epoch.size() == images);
+  REQUIRE(epoch_order(0) == first_epoch);
+  bool reshuffled = false;
+  for (uint32_t epoch = 1; epoch < 4; ++epoch) {
+    reshuffled = reshuffled || epoch_order(epoch) != first_epoch;
+  }
+  REQUIRE(reshuffled);
+  remove_all(shard_dir);
+}
+
+TEST_CASE("Asynchronous file I/O", "[async_io]") {
+  std::string dir = "/home/vagrant/src/final-project-rijuka/sampleoutputs/io";
+  create_directories(dir);
+  std::vector<std::string> paths;
+  std::vector<std::vector<uint8_t>> contents;
+  RNG rng(5);
+  for (int i = 0; i < 40; ++i) {
+    paths.push_back(dir + "/" + std::to_string(i) + ".bin");
+    // empty, small, and larger than one read
+    size_t size = i == 0 ? 0 : i == 1 ? (1 << 20) + 3 : rng.uniform(1, 5000);
+    std::vector<uint8_t> data(size);
+    for (uint8_t& b : data) {
+      b = (uint8_t)rng.uniform(0, 256);
+    }
+    contents.push_back(data);
+  }
+
+  // io_uring where the kernel allows it, and the thread pool fallback
+  for (bool use_io_uring : {true, false}) {
+    AsyncFileIO io(8, use_io_uring);
+    if (!use_io_uring) {
+      REQUIRE(!io.UsesIoUring());
+    }
+    size_t next = 0;
+    io.WriteFiles([&](std::string& file, std::vector<uint8_t>& data) {
+      if (next == paths.size()) {
+        return false;
+      }
+      file = paths[next];
+      data = contents[next++];
+      return true;
+    });
+    std::vector<bool> seen(paths.size(), false);
+    io.ReadFiles(paths, [&](size_t i, std::vector<uint8_t>& data) {
+      REQUIRE(data == contents[i]);
+      seen[i] = true;
+      return true;
+    });
+    REQUIRE(std::count(seen.begin(), seen.end(), true) == 40);
+
+    size_t calls = 0;
+    io.ReadFiles(paths, [&](size_t, std::vector<uint8_t>&) {
+      return ++calls < 3;
+    });
+    REQUIRE(calls == 3);
+    REQUIRE_THROWS(io.ReadFiles({dir + "/missing.bin"},
+                                [](size_t, std::vector<uint8_t>&) {
+                                  return true;
+                                }));
+  }
+  remove_all(dir);
+
+  // the pipeline gives the same images with asynchronous I/O
+  DataLoader dataset("/home/vagrant/src/final-project-rijuka/sampleinputs");
+  dataset.SetSeed(3);
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomHorizontalFlip(img, 0.5, rng);
+  });
+  PipelineOptions options;
+  options.decode_workers = 2;
+  options.encode_workers = 2;
+  std::string sync_dir =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/sync";
+  std::string async_dir =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/async";
+  dataset.AugmentAndSaveToDirectory(sync_dir, options);
+  options.async_io = true;
+  options.io_queue_depth = 4;
+  dataset.AugmentAndSaveToDirectory(async_dir, options);
+  for (auto entry :
+       boost::make_iterator_range(directory_iterator(sync_dir), {})) {
+    path other = path(async_dir) / entry.path().filename();
+    REQUIRE(exists(other));
+    REQUIRE(MatsAreEqual(imread(entry.path().string()),
+                         imread(other.string())));
+  }
+  remove_all(sync_dir);
+  remove_all(async_dir);
+}
+
+TEST_CASE("Image headers and reduced decoding", "[image_header]") {
+  // probed sizes match the decoded images
+  std::string inputs = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  for (auto entry :
+       boost::make_iterator_range(directory_iterator(inputs), {})) {
+    std::ifstream in(entry.path().string(), std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+    ImageHeader header;
+    if (ProbeImageHeader(data.data(), data.size(), header)) {
+      REQUIRE(header.size == imread(entry.path().string()).size());
+    }
+  }
+  uint8_t garbage[] = {0xFF, 0xD8, 0xFF, 0xC0, 0x00};
+  ImageHeader header;
+  REQUIRE(!ProbeImageHeader(garbage, sizeof(garbage), header));
+
+  // a 1600x1200 JPEG needed at 300x200 decodes at 1/4 scale
+  Mat large(1200, 1600, CV_8UC3);
+  randu(large, Scalar::all(0), Scalar::all(256));
+  std::vector<uint8_t> jpeg;
+  imencode(".jpg", large, jpeg);
+  REQUIRE(ProbeImageHeader(jpeg.data(), jpeg.size(), header));
+  REQUIRE(header.format == ImageFormat::kJpeg);
+  REQUIRE(header.size == Size(1600, 1200));
+  REQUIRE(ReducedDecodeFlag(header, Size(300, 200)) == IMREAD_REDUCED_COLOR_4);
+  REQUIRE(ReducedDecodeFlag(header, Size(1000, 200)) == IMREAD_COLOR);
+  REQUIRE(ReducedDecodeFlag(header, Size()) == IMREAD_COLOR);
+
+  std::string dir =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/reduced";
+  create_directories(dir);
+  imwrite(dir + "/large.jpg", large);
+  imwrite(dir + "/large.png", large);
+  DataLoader dataset(dir);
+  dataset.SetDecodeSize(Size(300, 200));
+  dataset.LoadInMemory();
+  for (const Mat& img : dataset.GetImages()) {
+    // only the JPEG is reduced
+    REQUIRE((img.size() == Size(400, 300) || img.size() == Size(1600, 1200)));
+  }
+  REQUIRE(dataset.GetImages()[0].size() != dataset.GetImages()[1].size());
+  remove_all(dir);
+}
+
+TEST_CASE("PPM decoding and encoding", "[ppm]") {
+  // the sample PPMs, ASCII and binary, decode as with imread
+  std::string inputs = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  for (auto entry :
+       boost::make_iterator_range(directory_iterator(inputs), {})) {
+    if (entry.path().extension() == ".ppm") {
+      Mat img = ReadPpm(entry.path().string());
+      REQUIRE(!img.empty());
+      REQUIRE(MatsAreEqual(img, imread(entry.path().string())));
+    }
+  }
+
+  Mat img(37, 53, CV_8UC3);
+  randu(img, Scalar::all(0), Scalar::all(256));
+  std::vector<uint8_t> ascii;
+  imencode(".ppm", img, ascii, {IMWRITE_PXM_BINARY, 0});
+  REQUIRE(ascii[1] == '3');
+  REQUIRE(MatsAreEqual(DecodePpm(ascii.data(), ascii.size()), img));
+  std::vector<uint8_t> binary;
+  EncodePpm(img, binary);
+  REQUIRE(binary[1] == '6');
+  REQUIRE(MatsAreEqual(DecodePpm(binary.data(), binary.size()), img));
+  REQUIRE(MatsAreEqual(imdecode(binary, IMREAD_COLOR), img));
+
+  // comments, odd whitespace and truncated files
+  std::string text = "P3\n# comment\n2 1\n255\n1 2 3\n\n 4\t5  6 ";
+  Mat parsed = DecodePpm((const uint8_t*)text.data(), text.size());
+  REQUIRE(parsed.size() == Size(2, 1));
+  REQUIRE(parsed.at<Vec3b>(0, 1) == Vec3b(6, 5, 4));
+  REQUIRE(DecodePpm(ascii.data(), ascii.size() - 20).empty());
+  REQUIRE(DecodePpm(binary.data(), binary.size() - 1).empty());
+  REQUIRE(ReadPpm(inputs + "/missing.ppm").empty());
+
+  // ppm_output saves every image as P6
+  DataLoader dataset(inputs);
+  PipelineOptions options;
+  options.ppm_output = true;
+  std::string dir = "/home/vagrant/src/final-project-rijuka/sampleoutputs/ppm";
+  dataset.AugmentAndSaveToDirectory(dir, options);
+  dataset.LoadInMemory();
+  size_t saved = 0;
+  for (auto entry : boost::make_iterator_range(directory_iterator(dir), {})) {
+    REQUIRE(entry.path().extension() == ".ppm");
+    std::ifstream in(entry.path().string(), std::ios::binary);
+    REQUIRE(in.get() == 'P');
+    REQUIRE(in.get() == '6');
+    ++saved;
+  }
+  REQUIRE(saved == dataset.GetImages().size());
+  remove_all(dir);
+}
+
+TEST_CASE("Per-stage stats", "[op_stats]") {
+  OpStatsRecorder recorder;
+  for (uint64_t micros = 1; micros <= 100; ++micros) {
+    recorder.Record(micros * 1000, 10, 20);
+  }
+  OpStats op = recorder.Snapshot("op");
+  REQUIRE(op.calls == 100);
+  REQUIRE(op.bytes_in == 1000);
+  REQUIRE(op.bytes_out == 2000);
+  REQUIRE(op.total_ms == Approx(5.05));
+  REQUIRE(op.p50_us == Approx(50).epsilon(0.03));
+  REQUIRE(op.p99_us == Approx(99).epsilon(0.03));
+
+  std::string inputs = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  std::string dir =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/stats";
+  std::string json_path =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/stats.jsonl";
+  remove(json_path);
+  DataLoader dataset(inputs);
+  dataset.AddAugmentation([](const Mat& img) { return HorizontalFlip(img); },
+                          "flip");
+  dataset.AddAugmentation([](const Mat& img, RNG& rng) {
+    return RandomSlide(img, 0.5, rng);
+  });
+  REQUIRE(dataset.GetStats().augmentations.empty());
+
+  dataset.DumpStats(json_path, 0.01);
+  PipelineOptions options;
+  options.decode_workers = 2;
+  options.encode_workers = 2;
+  dataset.AugmentAndSaveToDirectory(dir, options);
+  size_t images = std::distance(directory_iterator(inputs), {});
+  LoaderStats stats = dataset.GetStats();
+  REQUIRE(stats.decode.calls == images);
+  REQUIRE(stats.encode.calls == images);
+  REQUIRE(stats.augmentations.size() == 2);
+  REQUIRE(stats.augmentations[0].name == "flip");
+  REQUIRE(stats.augmentations[1].name == "augmentation_1");
+  for (const OpStats& augmentation : stats.augmentations) {
+    REQUIRE(augmentation.calls == images);
+    REQUIRE(augmentation.bytes_in > 0);
+    REQUIRE(augmentation.p50_us <= augmentation.p99_us);
+  }
+  REQUIRE(stats.augmentations[0].bytes_in == stats.augmentations[0].bytes_out);
+
+  // stopping the dump writes a last, complete line
+  dataset.DumpStats(json_path, 0);
+  std::ifstream in(json_path);
+  std::string line, last;
+  while (std::getline(in, line)) {
+    REQUIRE(line.rfind("{\"elapsed_s\":", 0) == 0);
+    last = line;
+  }
+  REQUIRE(last.find("\"name\":\"flip\",\"calls\":" +
+                    std::to_string(images)) != std::string::npos);
+
+  dataset.ResetStats();
+  REQUIRE(dataset.GetStats().decode.calls == 0);
+  dataset.EnableStats(false);
+  REQUIRE(dataset.GetStats().augmentations.empty());
+  remove_all(dir);
+  remove(json_path);
+}
+
+TEST_CASE("Chrome trace export", "[tracer]") {
+  // full rings keep the newest spans
+  Tracer tracer(4);
+  for (int i = 0; i < 10; ++i) {
+    TraceSpan span(&tracer, "test", "span", i);
+  }
+  REQUIRE(tracer.Size() == 4);
+
+  // threads that exit hand their ring on, so a thread started per span does
+  // not grow the tracer
+  Tracer handed_on(4);
+  for (int i = 0; i < 10; ++i) {
+    std::thread([&handed_on] {
+      TraceSpan span(&handed_on, "test", "span");
+    }).join();
+  }
+  REQUIRE(handed_on.Size() == 4);
+
+  std::string inputs = "/home/vagrant/src/final-project-rijuka/sampleinputs";
+  std::string dir =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/traced";
+  std::string trace_path =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/trace.json";
+  DataLoader dataset(inputs);
+  dataset.AddAugmentation([](const Mat& img) { return HorizontalFlip(img); },
+                          "flip");
+  REQUIRE_THROWS(dataset.WriteTrace(trace_path));
+  dataset.EnableTracing();
+  PipelineOptions options;
+  options.decode_workers = 2;
+  options.encode_workers = 2;
+  dataset.AugmentAndSaveToDirectory(dir, options);
+  dataset.WriteTrace(trace_path);
+
+  std::ifstream in(trace_path);
+  std::string trace((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+  size_t images = std::distance(directory_iterator(inputs), {});
+  REQUIRE(trace.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 0) == 0);
+  REQUIRE(CountOccurrences(trace, "{\"name\":\"decode\",\"cat\":\"stage\"") ==
+          images);
+  REQUIRE(CountOccurrences(trace, "{\"name\":\"augment\",") == images);
+  REQUIRE(CountOccurrences(trace, "{\"name\":\"encode\",") == images);
+  REQUIRE(CountOccurrences(trace, "{\"name\":\"flip\",") == images);
+  REQUIRE(CountOccurrences(trace, "\"args\":{\"name\":\"decode ") == 2);
+  REQUIRE(CountOccurrences(trace, "\"args\":{\"name\":\"encode ") == 2);
+  remove_all(dir);
+  remove(trace_path);
+}
+
+TEST_CASE("Synthetic datasets", "[synthetic_dataset]") {
+  SyntheticDatasetOptions options;
+  options.count = 12;
+  options.seed = 5;
+  options.sizes = {Size(64, 48), Size(200, 120)};
+  options.size_weights = {3, 1};
+  options.size_jitter = 0.25;
+  options.formats = {SyntheticFormat::kJpeg,
+                     SyntheticFormat::kPng,
+                     SyntheticFormat::kPpm,
+                     SyntheticFormat::kPpmAscii};
+  options.files_per_directory = 5;
+  std::string dir =
+      "/home/vagrant/src/final-project-rijuka/sampleoutputs/synthetic";
+  remove_all(dir);
+  std::vector<std::string> paths = GenerateSyntheticDataset(dir, options);
+  REQUIRE(paths.size() == 12);
+  REQUIRE(path(paths[0]).stem() == "00000000");
+  REQUIRE(path(paths[0]).parent_path() == path(dir + "/000000"));
+  REQUIRE(path(paths[11]).parent_path() == path(dir + "/000002"));
+  for (const std::string& file : paths) {
+    Mat img = imread(file);
+    REQUIRE(img.type() == CV_8UC3);
+    REQUIRE(img.cols >= 48);
+    REQUIRE(img.cols <= 250);
+  }
+
+  // the same seed writes the same files, whatever the thread count
+  std::string again = dir + "_again";
+  remove_all(again);
+  setNumThreads(1);
+  std::vector<std::string> same = GenerateSyntheticDataset(again, options);
+  setNumThreads(-1);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::ifstream a(paths[i], std::ios::binary);
+    std::ifstream b(same[i], std::ios::binary);
+    REQUIRE(std::string(std::istreambuf_iterator<char>(a), {}) ==
+            std::string(std::istreambuf_iterator<char>(b), {}));
+  }
+
+  // the loader finds the images in the subdirectories
+  DataLoader dataset(dir);
+  dataset.LoadInMemory();
+  REQUIRE(dataset.GetImages().size() == 12);
+
+  options.size_weights = {1};
+  REQUIRE_THROWS(GenerateSyntheticDataset(again, options));
+  remove_all(dir);
+  remove_all(again);
+}
+
+TEST_CASE("Images in subdirectories keep their paths", "[subdirectories]") {
+  std::string dir = "/home/vagrant/src/final-project-rijuka/test_nested";
+  std::string out_dir =
+      "/home/vagrant/src/final-project-rijuka/test_nested_out";
+  create_directories(dir + "/a");
+  create_directories(dir + "/b");
+  Mat dark(8, 8, CV_8UC3, Scalar::all(10));
+  Mat light(8, 8, CV_8UC3, Scalar::all(200));
+  imwrite(dir + "/a/0001.png", dark);
+  imwrite(dir + "/b/0001.png", light);
+
+  // files of the same name are saved apart, by every save path
+  DataLoader dataset(dir);
+  dataset.AugmentAndSaveToDirectory(out_dir + "/serial");
+  PipelineOptions options;
+  options.decode_workers = 2;
+  options.encode_workers = 2;
+  dataset.AugmentAndSaveToDirectory(out_dir + "/parallel", options);
+  dataset.LoadInMemory();
+  dataset.SaveImagesToDirectory(out_dir + "/in_memory");
+  for (std::string save : {"/serial", "/parallel", "/in_memory"}) {
+    REQUIRE(MatsAreEqual(imread(out_dir + save + "/a/0001.png"), dark));
+    REQUIRE(MatsAreEqual(imread(out_dir + save + "/b/0001.png"), light));
+  }
+  remove_all(dir);
+  remove_all(out_dir);
+}